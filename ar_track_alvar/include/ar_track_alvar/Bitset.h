@@ -33,16 +33,30 @@
 #include "Alvar.h"
 #include <iostream>
 #include <deque>
+#include <vector>
 #include <string>
 #include <sstream>
 #include <iomanip>
+#include <stdint.h>
 
 namespace alvar {
 
+/** \brief The number of set bits in \e v */
+inline int PopCount(uint64_t v) {
+#if defined(__GNUC__)
+	return __builtin_popcountll(v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
 /**
  * \brief \e Bitset is a basic class for handling bit sequences
  *
- * The bits are stored internally using deque<bool> (See http://osdir.com/ml/gis.geos.devel/2006-04/msg00142.html).
+ * The bits are stored internally packed into 64-bit words.
  * The bitset is assumed to have most significant bits left i.e. the push_back() methods add to the least 
  * significant end of the bit sequence. The usage is clarified by the following example.
  *
@@ -61,11 +75,20 @@ namespace alvar {
  */
 class ALVAR_EXPORT Bitset {
 protected:
-	std::deque<bool> bits;
-	
+	std::vector<uint64_t> words;
+	size_t first;
+	size_t length;
+
+	/** \brief Returns \e count (max 64) bits starting from \e pos, the bit at \e pos being the least significant */
+	uint64_t get_block(size_t pos, int count) const;
+	/** \brief Appends the \e count (max 64) least significant bits of \e block, the least significant bit first */
+	void push_block(uint64_t block, int count);
+
 public:
+	/** \brief Constructor */
+	Bitset();
 	/** \brief The length of the \e Bitset */
-	int Length();
+	int Length() const;
 	/** \brief Output the bits to selected ostream 
 	 *  \param os The output stream to be used for outputting e.g. std::cout
 	 */
@@ -111,32 +134,37 @@ public:
 	 *  \param pos The bit in this given position is flipped.
 	 */
 	void flip(size_t pos);
+	/** \brief The bit in the given position */
+	bool at(size_t pos) const
+	{
+		size_t p = first + pos;
+		return ((words[p >> 6] >> (p & 63)) & 1) != 0;
+	}
 	/** \brief The \e Bitset as a hex string */
 	std::string hex();
 	/** \brief The \e Bitset as 'unsigned long' */
 	unsigned long ulong();
 	/** \brief The \e Bitset as 'unsigned char' */
 	unsigned char uchar();
-	/** \brief The \e Bitset as 'deque<bool>' */
-	inline std::deque<bool>& GetBits()
-	{
-		return bits;
-	}
+	/** \brief A copy of the \e Bitset as 'deque<bool>' */
+	std::deque<bool> GetBits() const;
 };
 
 /**
  * \brief An extended \e Bitset ( \e BitsetExt ) for handling e.g. Hamming encoding/decoding
  *
  * This class is based on the basic \e Bitset. It provides additional features for Hamming coding
- * (See http://en.wikipedia.org/wiki/Hamming_code).
+ * (See http://en.wikipedia.org/wiki/Hamming_code). The blocks are handled as words: the syndrome
+ * is the parity (popcount) of the block masked with the coverage of each parity bit, so block
+ * lengths up to 64 bits are supported.
  *
  * The \e BitsetExt is used e.g by \e MarkerData
  */
 class ALVAR_EXPORT BitsetExt : public Bitset {
 protected:
 	bool verbose;
-	void hamming_enc_block(unsigned long block_len, std::deque<bool>::iterator &iter);
-	int hamming_dec_block(unsigned long block_len, std::deque<bool>::iterator &iter);
+	void hamming_enc_block(unsigned long block_len, size_t &pos, BitsetExt &enc);
+	int hamming_dec_block(unsigned long block_len, size_t &pos, BitsetExt &dec);
 public:
 	/** \brief Constructor */
 	BitsetExt();
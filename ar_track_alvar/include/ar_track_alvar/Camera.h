@@ -35,6 +35,8 @@
 #include "Pose.h"
 #include "Util.h"
 #include "FileFormat.h"
+#include "DistortionMap.h"
+#include "PlanarPose.h"
 #include <vector>
 
 #include <ros/ros.h>
@@ -77,6 +79,12 @@ struct ALVAR_EXPORT ProjPoints {
 };
 
 
+/** \brief The z coordinate of a point for \e Camera::CalcExteriorOrientation, zero for the 2D point types */
+inline double PointZ(const CvPoint2D64f &) { return 0; }
+inline double PointZ(const CvPoint2D32f &) { return 0; }
+inline double PointZ(const CvPoint3D64f &p) { return p.z; }
+inline double PointZ(const CvPoint3D32f &p) { return p.z; }
+
 /**
  * \brief Simple \e Camera class for calculating distortions, orientation or projections with pre-calibrated camera
  */
@@ -98,6 +106,17 @@ protected:
 	void camInfoCallback (const sensor_msgs::CameraInfoConstPtr &);
 	ros::Subscriber sub_;
 	ros::NodeHandle n_;
+	bool undistort_enabled;
+	int undistort_grid_step;
+	DistortionMap distortion_map;
+	/** \brief Rebuilds the lookup grids after the calibration or the resolution has changed */
+	void UpdateDistortionMap();
+	/** \brief Fills the planar target points and the undistorted normalized image points, returns the point count or 0 */
+	int NormalizePlanarPoints(const std::vector<PointDouble>& pw, const std::vector<PointDouble>& pi,
+						double *model, double *image) const;
+	/** \brief RMS reprojection error in pixels of the planar target points with the lens distortion */
+	double PlanarReprojectionError(const double *model, const std::vector<PointDouble>& pi,
+						const double rot[9], const double tra[3]) const;
 
 private:
 	bool LoadCalibXML(const char *calibfile);
@@ -202,9 +221,28 @@ public:
 	/** \brief Invert operation for \e GetOpenglProjectionMatrix */
 	void SetOpenglProjectionMatrix(double proj_matrix[16], const int width, const int height);
 
+	/** \brief Select whether the lens distortion is applied and unapplied.
+	 * The distortion is ignored by default, which is right for rectified images. When enabled the
+	 * mappings are precomputed into lookup grids (see \e DistortionMap) that are rebuilt when
+	 * the calibration or the resolution changes.
+	 *
+	 * The image points given to and returned by the other methods stay in the raw image coordinates
+	 * either way: the labeling fits the edges without the distortion but returns the corners with it,
+	 * and the pose is solved by unapplying the distortion of \e calib_D once (see \e NormalizePlanarPoints).
+	 * \param _enable Do \e Undistort and \e Distort use the calibrated distortion?
+	 * \param _grid_step The distance between the lookup grid nodes in pixels, 1 gives a dense map.
+	 */
+	void SetUndistortion(bool _enable = false, int _grid_step = 4);
+
 	/** \brief Unapplys the lens distortion for points on image plane. */
 	void Undistort(std::vector<PointDouble >& points);
 
+	/** \brief Unapplys the lens distortion for \e count points on an image plane. */
+	void Undistort(CvPoint2D32f *points, int count);
+
+	/** \brief Unapplys the lens distortion for \e count points on an image plane. */
+	void Undistort(PointDouble *points, int count);
+
 	/** \brief Unapplys the lens distortion for one point on an image plane. */
 	void Undistort(PointDouble &point);
 
@@ -220,7 +258,54 @@ public:
 	/** \brief Applys the lens distortion for points on image plane. */
 	void Distort(PointDouble &point);
 
-	/** \brief Calculate exterior orientation */
+	/** \brief Applys the lens distortion for \e count points on an image plane. */
+	void Distort(PointDouble *points, int count);
+
+	/** \brief The number of points that \e CalcExteriorOrientation converts on the stack */
+	enum { EXTERIOR_ORIENTATION_STACK_POINTS = 64 };
+
+	/** \brief Calculate exterior orientation for \e count contiguous points of any type with \e x and \e y (and \e z) members
+	 *
+	 * The points are converted into buffers on the stack, so no memory is allocated for up to
+	 * \e EXTERIOR_ORIENTATION_STACK_POINTS points. The 2D world points are on the z=0 plane.
+	 * \param distortion If false, the image points are considered undistorted
+	 */
+	template <class P3, class P2>
+	void CalcExteriorOrientation(const P3 *pw, const P2 *pi, int count, CvMat *rodriques, CvMat *tra, bool distortion = true) {
+		double stack_buffer[5*EXTERIOR_ORIENTATION_STACK_POINTS];
+		std::vector<double> heap_buffer;
+		double *world = stack_buffer;
+		if (count > EXTERIOR_ORIENTATION_STACK_POINTS) {
+			heap_buffer.resize(5*count);
+			world = &heap_buffer[0];
+		}
+		double *image = world + 3*count;
+		for (int i=0; i<count; i++) {
+			world[3*i+0] = pw[i].x;
+			world[3*i+1] = pw[i].y;
+			world[3*i+2] = PointZ(pw[i]);
+			image[2*i+0] = pi[i].x;
+			image[2*i+1] = pi[i].y;
+		}
+		CvMat world_mat = cvMat(count, 1, CV_64FC3, world);
+		CvMat image_mat = cvMat(count, 1, CV_64FC2, image);
+		cvZero(tra);
+		cvFindExtrinsicCameraParams2(&world_mat, &image_mat, &calib_K, (distortion ? &calib_D : NULL), rodriques, tra);
+	}
+
+	/** \brief Calculate exterior orientation for \e count contiguous points into \e pose (see above) */
+	template <class P3, class P2>
+	void CalcExteriorOrientation(const P3 *pw, const P2 *pi, int count, Pose *pose, bool distortion = true) {
+		double ext_rodriques[3];
+		double ext_translate[3];
+		CvMat ext_rodriques_mat = cvMat(3, 1, CV_64F, ext_rodriques);
+		CvMat ext_translate_mat = cvMat(3, 1, CV_64F, ext_translate);
+		CalcExteriorOrientation(pw, pi, count, &ext_rodriques_mat, &ext_translate_mat, distortion);
+		pose->SetRodriques(&ext_rodriques_mat);
+		pose->SetTranslation(&ext_translate_mat);
+	}
+
+	/** \brief Calculate exterior orientation (without the lens distortion) */
 	void CalcExteriorOrientation(std::vector<CvPoint3D64f>& pw, std::vector<CvPoint2D64f>& pi, Pose *pose);
 
 	/** \brief Calculate exterior orientation
@@ -237,6 +322,47 @@ public:
 	 */
 	void CalcExteriorOrientation(std::vector<PointDouble>& pw, std::vector<PointDouble >& pi, Pose *pose);
 
+	/** \brief Calculate exterior orientation of a planar target (see \e PlanarPose)
+	 *
+	 * Returns both solutions of the planar pose ambiguity with their RMS reprojection errors in pixels.
+	 * \param pw The target points on the z=0 plane, from four to \e PlanarPose::MAX_POINTS
+	 * \param pi The (distorted) image points
+	 * \param pose The solution with the smaller error
+	 * \param error If not NULL, filled with the error of \e pose
+	 * \param pose2 If not NULL, filled with the other solution (if there is one)
+	 * \param error2 If not NULL, filled with the error of \e pose2 (-1 if there is no other solution)
+	 * \return False if the pose could not be solved
+	 */
+	bool CalcExteriorOrientationPlanar(const std::vector<PointDouble>& pw, const std::vector<PointDouble>& pi,
+						Pose *pose, double *error = NULL, Pose *pose2 = NULL, double *error2 = NULL);
+
+	/** \brief Refine the exterior orientation of a planar target starting from the current \e pose
+	 *
+	 * Meant for tracked targets whose pose from the previous frame is close (see \e PlanarPose::Refine).
+	 * \param pw The target points on the z=0 plane, from four to \e PlanarPose::MAX_POINTS
+	 * \param pi The (distorted) image points
+	 * \param pose The initial pose, replaced with the refined pose on success
+	 * \param error If not NULL, filled with the RMS reprojection error in pixels
+	 * \param iterations The maximum number of Levenberg-Marquardt iterations
+	 * \return False if the refinement failed and \e pose was left untouched
+	 */
+	bool RefineExteriorOrientationPlanar(const std::vector<PointDouble>& pw, const std::vector<PointDouble>& pi,
+						Pose *pose, double *error = NULL, int iterations = 5);
+
+	/** \brief Calculate the covariance of the exterior orientation of a planar target
+	 *
+	 * The covariance is propagated from the image noise through the Jacobian of the
+	 * reprojection at \e pose (see \e PlanarPose::Covariance).
+	 * \param pw The target points on the z=0 plane, from four to \e PlanarPose::MAX_POINTS
+	 * \param pi The (distorted) image points
+	 * \param pose The solved pose
+	 * \param cov The row-major 6x6 covariance of (x, y, z, rotation about x, y and z axes) in the camera frame
+	 * \param min_sigma The smallest standard deviation of the image noise in pixels, larger residuals are used as they are
+	 * \return False if the covariance could not be solved
+	 */
+	bool CalcExteriorOrientationCovariance(const std::vector<PointDouble>& pw, const std::vector<PointDouble>& pi,
+						Pose *pose, double cov[36], double min_sigma = 0.5);
+
 	/** \brief Update existing pose based on new observations. Use (CV_32FC3 and CV_32FC2) for matrices. */
 	bool CalcExteriorOrientation(const CvMat* object_points, CvMat* image_points, Pose *pose);
 
@@ -277,9 +403,19 @@ struct ALVAR_EXPORT Homography {
 	
 	/** \brief Find Homography for two point-sets */
 	void Find(const std::vector<PointDouble>& pw, const std::vector<PointDouble>& pi);
+
+	/** \brief Find Homography for four point pairs in closed form without allocating
+	 *
+	 * The homography is composed from the square-to-quad mappings of both quads (see Heckbert1989).
+	 * Returns false if either quad is degenerate, \e H is left untouched then.
+	 */
+	bool Find(const PointDouble pw[4], const PointDouble pi[4]);
 	
 	/** \brief Project points using the Homography */
 	void ProjectPoints(const std::vector<PointDouble>& from, std::vector<PointDouble>& to);
+
+	/** \brief Project \e count points from \e from into \e to without allocating */
+	void ProjectPoints(const PointDouble *from, PointDouble *to, int count) const;
 };
 
 } // namespace alvar
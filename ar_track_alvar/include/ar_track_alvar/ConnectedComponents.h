@@ -34,15 +34,33 @@
 #include "Util.h"
 #include "Line.h"
 #include "Camera.h"
+#include "IntegralImage.h"
 
 namespace alvar {
 
+class WorkerPool;
+class LabelingBand;
+
 /**
  * \brief Connected components labeling methods.
 */
 enum ALVAR_EXPORT LabelingMethod
 {
-	CVSEQ
+	CVSEQ,
+	RLE
+};
+
+/**
+ * \brief Reusable buffers for fitting the edges of the square candidates.
+ *
+ * Every labeling thread uses its own buffers, so that the fitting does not allocate
+ * memory once the buffers have grown to the size of the largest contour.
+*/
+class ALVAR_EXPORT EdgeFitBuffer
+{
+public:
+	std::vector<CvPoint> contour;
+	std::vector<CvPoint2D32f> points;
 };
 
 /**
@@ -55,11 +73,14 @@ protected :
 
 	Camera	 *cam;
 	int thresh_param1, thresh_param2;
+	IntegralThreshold integral_threshold;
 
 public :
 
 	/**
 	 * \brief Pointer to grayscale image that is thresholded for labeling.
+	 *
+	 * With 8-bit mono input this points to the input image itself.
 	*/
 	IplImage *gray;
 	/**
@@ -69,41 +90,168 @@ public :
 
 	/**
 	 * \brief Vector of 4-length vectors where the corners of detected blobs are stored.
+	 *
+	 * The corners are in the raw (distorted) image coordinates. With \e Camera::SetUndistortion
+	 * the edges are fitted without the distortion, and their intersections are distorted back.
 	*/
 	std::vector<std::vector<PointDouble> > blob_corners;
 
 	/**
-	 * \brief Two alternatives for thresholding the gray image. ADAPT (adaptive threshold) is only supported currently.
+	 * \brief Alternatives for thresholding the gray image. ADAPT (OpenCV adaptive threshold)
+	 * and ADAPT_INTEGRAL (the same threshold using \e IntegralThreshold) are supported currently.
 	*/
 	enum ThresholdMethod 
 	{
 		THRESH,
-		ADAPT
+		ADAPT,
+		ADAPT_INTEGRAL
 	};
 
+	/**
+	 * \brief Pixel formats of the input image.
+	 *
+	 * PIXEL_AUTO selects the conversion from the number of channels (1: mono, 3: BGR, 4: BGRA),
+	 * and always copies the image. PIXEL_MONO8 uses an 8-bit mono image as \e gray without a copy,
+	 * so nothing may draw into the image before the labeling results are used.
+	 * PIXEL_YUV422 is packed UYVY with two channels, and only its luma is used. The Bayer
+	 * formats are named by their top-left 2x2 block, and only their green channel is used.
+	*/
+	enum PixelFormat
+	{
+		PIXEL_AUTO,
+		PIXEL_MONO8,
+		PIXEL_YUV422,
+		PIXEL_BAYER_RGGB,
+		PIXEL_BAYER_BGGR,
+		PIXEL_BAYER_GBRG,
+		PIXEL_BAYER_GRBG
+	};
+
+protected :
+
+	ThresholdMethod thresh_method;
+	PixelFormat pixel_format;
+	bool detect_pose_grayscale;
+	IplImage *gray_buffer;
+
+	std::vector<CvRect> regions;
+
+	/**
+	 * \brief Is the \e image used as the \e gray image without conversion?
+	*/
+	bool WrapsGray(IplImage* image);
+
+	/**
+	 * \brief Allocates \e gray and \e bw for the \e image size.
+	*/
+	void AllocateImages(IplImage* image);
+
+	/**
+	 * \brief Converts the \e rect of \e image into \e gray according to the \e pixel_format.
+	*/
+	void ConvertGray(IplImage* image, CvRect rect);
+
+	/**
+	 * \brief Allocates \e gray and \e bw for the \e image size and converts \e image to grayscale.
+	 * \param rect If given, only this area of the \e image is converted.
+	*/
+	void PrepareGray(IplImage* image, const CvRect* rect=0);
+
+	/**
+	 * \brief Returns \e regions padded by the threshold block and clipped to the image.
+	 *
+	 * Overlapping regions are merged so that every square is found at most once.
+	*/
+	void GetLabelingRegions(int width, int height, std::vector<CvRect> &rects);
+
+	/**
+	 * \brief Thresholds \e gray into \e bw using the selected \e ThresholdMethod.
+	*/
+	void Threshold();
+
+	/**
+	 * \brief Thresholds \e src into \e dst with the given block size using the selected \e ThresholdMethod.
+	*/
+	void Threshold(IplImage* src, IplImage* dst, int block_size);
+
+	/**
+	 * \brief Thresholds \e src into \e dst using the given \e IntegralThreshold buffers when needed.
+	*/
+	void Threshold(IplImage* src, IplImage* dst, int block_size, IntegralThreshold &integral);
+
+	/**
+	 * \brief Fits lines to the four edges of a closed contour and intersects them into \e corners.
+	 * \param contour The contour points.
+	 * \param total The number of contour points.
+	 * \param k The contour indices of the four polygon vertices.
+	 * \param buffer The scratch buffers of the calling thread.
+	*/
+	void FitQuadCorners(const CvPoint* contour, int total, const int k[4],
+		std::vector<PointDouble> &corners, std::vector<Line> &fitted_lines, EdgeFitBuffer &buffer);
+
+public :
+
 	/** Constructor */
 	Labeling();
 
 	/** Destructor*/
-	~Labeling();
+	virtual ~Labeling();
 
 	/**
 	 * \brief Sets the camera object that is used to correct lens distortions.
 	*/
 	void SetCamera(Camera* camera) {cam = camera;}
 
+	/**
+	 * \brief Enables the refinement of the edge points from the gray image.
+	 *
+	 * The contour points are moved along the edge normal to the centroid of the intensity
+	 * differences before the edge lines are fitted.
+	*/
+	void SetOptions(bool _detect_pose_grayscale=false) {detect_pose_grayscale = _detect_pose_grayscale;}
+
 	/**
 	 * \brief Labels image and filters blobs to obtain square-shaped objects from the scene.
 	*/
 	virtual void LabelSquares(IplImage* image, bool visualize=false) = 0;
 
+	/**
+	 * \brief Converts \e image into \e gray without labeling it, the \e blob_corners are cleared.
+	 *
+	 * Used when the markers are tracked between the full detections.
+	*/
+	void UpdateGray(IplImage* image);
+
 	bool CheckBorder(CvSeq* contour, int width, int height);
 
+	/**
+	 * \brief Checks that the contour does not touch the border of the given image area.
+	*/
+	bool CheckBorder(CvSeq* contour, CvRect rect);
+
+	/**
+	 * \brief Restricts the following \e LabelSquares calls to the given image regions.
+	 *
+	 * The regions are padded so that the threshold inside them equals the one computed for the
+	 * whole image. An empty vector restores labeling of the whole image.
+	*/
+	void SetRegions(const std::vector<CvRect> &_regions) {regions = _regions;}
+
 	void SetThreshParams(int param1, int param2)
 	{
 		thresh_param1 = param1;
 		thresh_param2 = param2;
 	}
+
+	/**
+	 * \brief Selects the backend used for thresholding the gray image.
+	*/
+	void SetThreshMethod(ThresholdMethod method) {thresh_method = method;}
+
+	/**
+	 * \brief Selects the pixel format of the images given to \e LabelSquares.
+	*/
+	void SetPixelFormat(PixelFormat format) {pixel_format = format;}
 };
 
 /**
@@ -117,16 +265,87 @@ protected :
 	int _n_blobs;
 	int _min_edge;
 	int _min_area;
-	bool detect_pose_grayscale;
+
+	int pyramid_levels;
+	double pyramid_tolerance;
+	IplImage *gray_small;
+	IplImage *bw_small;
+
+	int n_threads;
+	int band_overlap;
+	WorkerPool *pool;
+	std::vector<LabelingBand*> bands;
+	IplImage *band_image;
 
 	CvMemStorage* storage;
+	EdgeFitBuffer edge_buffer;
+
+	/**
+	 * \brief Approximates \e contour with a polygon and returns it in \e result if it is an acceptable square.
+	 * \param rect The image area that was labeled, the squares touching its border are rejected.
+	 * \param mem The storage for the polygon.
+	*/
+	bool ApproxSquare(CvSeq* contour, CvRect rect, CvMemStorage* mem, CvSeq** result);
+
+	/**
+	 * \brief Finds the 4-vertex contours from the thresholded \e bw_img covering \e rect of the image.
+	*/
+	void FindSquares(IplImage* bw_img, CvRect rect, CvSeq* squares, CvSeq* square_contours);
+
+	/**
+	 * \brief Fits lines to the four edges of the \e square_contour and intersects them into \e corners.
+	 * \param buffer The scratch buffers of the calling thread.
+	*/
+	void FitSquareCorners(CvSeq* sq, CvSeq* square_contour, std::vector<PointDouble> &corners, std::vector<Line> &fitted_lines, EdgeFitBuffer &buffer);
+
+	/**
+	 * \brief Labels the image in overlapping horizontal bands using the worker \e pool.
+	*/
+	void LabelSquaresParallel(IplImage* image, bool visualize);
+
+	static void ConvertBand(void *labeling, int band);
+	static void ThresholdBand(void *labeling, int band);
+	static void LabelBand(void *labeling, int band);
+
+	/**
+	 * \brief Finds the square candidates from a downsampled image and refines them in full resolution.
+	*/
+	void LabelSquaresPyramid(IplImage* image, bool visualize);
+
+	/**
+	 * \brief Refines the four edges of a coarse quad from the full resolution \e gray image.
+	 *
+	 * The edge points are searched along the edge normals within \e search pixels. The
+	 * lines are refitted and the quad vertices updated until they move less than
+	 * \e pyramid_tolerance pixels. Returns false if some edge cannot be found.
+	 * \param hole The quad is a hole contour (the inner border of a dark frame), whose
+	 * edges are searched from the dark outside towards the bright inside.
+	*/
+	bool RefineQuad(PointDouble vertices[4], std::vector<Line> &fitted_lines, int search, bool hole=false);
 
 public:
 
 	LabelingCvSeq();
 	~LabelingCvSeq();
 
-	void SetOptions(bool _detect_pose_grayscale=false);
+	/**
+	 * \brief Sets the coarse-to-fine detection mode.
+	 * \param levels The quads are searched from an image downsampled by 2^levels (0 disables the mode).
+	 * \param tolerance The edge refinement is iterated until the corners move less than this (pixels).
+	 *
+	 * The mode is not used when the labeling is restricted with \e SetRegions.
+	*/
+	void SetPyramid(int levels=0, double tolerance=0.1);
+
+	/**
+	 * \brief Sets the number of threads used for labeling the whole image.
+	 * \param threads The image is split into this many horizontal bands that are labeled in parallel (1 disables).
+	 * \param overlap The bands are extended downwards by this many rows. Squares that do not fit into
+	 * their band are labeled once more after the parallel pass, so the overlap only affects the speed.
+	 *
+	 * The bands are not used with \e SetRegions or \e SetPyramid.
+	*/
+	void SetThreads(int threads=1, int overlap=128);
 
 	void LabelSquares(IplImage* image, bool visualize=false);
 
@@ -134,6 +353,80 @@ public:
 	CvSeq* LabelImage(IplImage* image, int min_size, bool approx=false);
 };
 
+/**
+ * \brief Labeling class that finds the squares with a run-length encoded connected component pass.
+ *
+ * The foreground runs of every row are joined with the runs of the previous row using
+ * union-find (8-connectivity). The outer border of every large enough component is then
+ * traced and approximated with a polygon (Douglas-Peucker) in the same way as
+ * \e cvFindContours and \e cvApproxPoly do in \e LabelingCvSeq. All the work is done in
+ * flat arrays that are reused between the frames.
+ *
+ * Only the outer borders of the dark components are traced, which is where the marker
+ * borders are found.
+*/
+class ALVAR_EXPORT LabelingRle : public Labeling
+{
+
+protected :
+
+	struct Run {
+		int x0, x1; // [x0, x1)
+		int y;
+		int parent; // Union-find parent, always a preceding run
+		int label; // Index of the blob
+	};
+
+	struct Blob {
+		int run; // The first run in scan order
+		int x0, y0, x1, y1; // Inclusive bounding box
+	};
+
+	int _n_blobs;
+	int _min_edge;
+	int _min_area;
+
+	std::vector<Run> runs;
+	std::vector<Blob> blobs;
+	std::vector<int> polygon;
+	std::vector<int> dp_stack;
+	EdgeFitBuffer edge_buffer;
+
+	int FindRoot(int i);
+
+	/**
+	 * \brief Encodes the foreground runs of \e bw inside \e rect and joins the connected runs.
+	*/
+	void EncodeRuns(CvRect rect);
+
+	/**
+	 * \brief Collects the components whose bounding box can contain a square inside \e rect.
+	*/
+	void CollectBlobs(CvRect rect);
+
+	/**
+	 * \brief Traces the outer border of the component starting from its top-left pixel into \e contour.
+	*/
+	void TraceBorder(int x, int y, std::vector<CvPoint> &contour);
+
+	/**
+	 * \brief Approximates the closed \e contour with a polygon and stores the vertex indices in \e polygon.
+	*/
+	void ApproxPolygon(const std::vector<CvPoint> &contour, double eps);
+
+	/**
+	 * \brief Finds the squares from \e bw inside \e rect and appends their corners to \e blob_corners.
+	*/
+	void FindSquares(IplImage* image, CvRect rect, bool visualize);
+
+public:
+
+	LabelingRle();
+	~LabelingRle();
+
+	void LabelSquares(IplImage* image, bool visualize=false);
+};
+
 } // namespace alvar
 
 #endif
@@ -0,0 +1,111 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+
+#ifndef DISTORTIONMAP_H
+#define DISTORTIONMAP_H
+
+/**
+ * \file DistortionMap.h
+ *
+ * \brief This file implements lookup grids for the lens distortion.
+ */
+
+#include "Alvar.h"
+#include "Util.h"
+#include <vector>
+
+namespace alvar {
+
+/**
+ * \brief Lookup grids for applying and unapplying the lens distortion of a calibrated camera
+ *
+ * The distortion model is the one of OpenCV with the coefficients k1, k2, p1 and p2.
+ * The mappings are evaluated once at the nodes of a regular grid that covers the image
+ * with some border, and the points are mapped by interpolating the grids bilinearly.
+ * A grid step of one pixel gives a dense map, larger steps give sparse maps that take
+ * less memory. Points outside the grids are mapped with the exact model.
+ */
+class ALVAR_EXPORT DistortionMap {
+protected:
+	double K[3][3];
+	double D[4];
+	int step;
+	double inv_step;
+	double x0, y0;
+	int cols, rows;
+	// The offsets (dx, dy) from the grid nodes to the mapped points
+	std::vector<double> undistort_grid;
+	std::vector<double> distort_grid;
+
+	bool Interpolate(const std::vector<double> &grid, double &x, double &y) const;
+
+public:
+	DistortionMap();
+
+	/** \brief Build the grids
+	 * \param K The 3x3 intrinsic camera matrix for the current resolution
+	 * \param D The distortion coefficients k1, k2, p1 and p2
+	 * \param width The image width
+	 * \param height The image height
+	 * \param _step The distance between the grid nodes in pixels
+	 */
+	void Build(const double K[3][3], const double D[4], int width, int height, int _step = 4);
+
+	/** \brief Remove the grids, \e IsEmpty maps leave the points unchanged */
+	void Clear();
+
+	/** \brief Are there no grids (no distortion or \e Build has not been called) */
+	bool IsEmpty() const { return cols == 0; }
+
+	/** \brief Unapply the lens distortion for one point */
+	void Undistort(double &x, double &y) const;
+
+	/** \brief Apply the lens distortion for one point */
+	void Distort(double &x, double &y) const;
+
+	/** \brief Unapply the lens distortion for \e count points */
+	void Undistort(PointDouble *points, int count) const;
+
+	/** \brief Unapply the lens distortion for \e count points */
+	void Undistort(CvPoint2D32f *points, int count) const;
+
+	/** \brief Apply the lens distortion for \e count points */
+	void Distort(PointDouble *points, int count) const;
+
+	/** \brief Unapply the lens distortion for a point on normalized image plane with the iterative model */
+	static void UndistortNormalized(const double D[4], double &x, double &y, int iterations = 20);
+
+	/** \brief Apply the lens distortion for a point on normalized image plane with the model */
+	static void DistortNormalized(const double D[4], double &x, double &y);
+
+	/** \brief Unapply the lens distortion with the iterative model */
+	static void UndistortExact(const double K[3][3], const double D[4], double &x, double &y, int iterations = 20);
+
+	/** \brief Apply the lens distortion with the model */
+	static void DistortExact(const double K[3][3], const double D[4], double &x, double &y);
+};
+
+} // namespace alvar
+
+#endif
@@ -162,6 +162,36 @@ public:
 	void GetAveGradient(CvRect &rect, double *dirx, double *diry);
 };
 
+/** \brief \e IntegralThreshold is used for fast mean adaptive thresholding
+ *
+ * The box means are calculated from a summed-area table that is built over the
+ * image padded with replicated borders. The result is identical with
+ * \e cvAdaptiveThreshold using \e CV_ADAPTIVE_THRESH_MEAN_C and
+ * \e CV_THRESH_BINARY_INV. To avoid the division per pixel the comparison
+ * src+param <= round(sum/area) is evaluated as (src+param)*area <= sum+area/2,
+ * which keeps the SSE2/AVX2 comparison kernel in 32-bit integers.
+ */
+class ALVAR_EXPORT IntegralThreshold {
+protected:
+	IplImage *sum;
+	int radius;
+public:
+	IntegralThreshold();
+	~IntegralThreshold();
+	/** \brief Update the padded summed-area table for the given image.
+	 *  \param gray The 8-bit grayscale image we want to threshold
+	 *  \param block_size The (odd) size of the box used for the mean
+	 */
+	void Update(IplImage *gray, int block_size);
+	/** \brief Threshold \e gray into \e bw (255 for dark, 0 for bright pixels).
+	 *  \param gray The 8-bit grayscale image we want to threshold
+	 *  \param bw The 8-bit result image of the same size
+	 *  \param block_size The (odd) size of the box used for the mean
+	 *  \param param The constant subtracted from the mean
+	 */
+	void Threshold(IplImage *gray, IplImage *bw, int block_size, int param);
+};
+
 } // namespace alvar
 
 #endif
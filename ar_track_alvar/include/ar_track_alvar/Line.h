@@ -70,6 +70,17 @@ int ALVAR_EXPORT FitLines(std::vector<Line> &lines,
 			 const std::vector<PointInt >& edge,
 					IplImage *grey=0); 
 
+/**
+ * \brief Fits a line to the points in total least squares sense.
+ *
+ * The result is the same as with cvFitLine using CV_DIST_L2, but the points are
+ * read directly from the given array and no memory is allocated.
+ * \param points	The points (pixels) where the line is fitted.
+ * \param count		The number of points.
+ * \param params	Resulting line parameters in the same format as with \e Line(float params[4]).
+ */
+void ALVAR_EXPORT FitLine(const CvPoint2D32f *points, int count, float params[4]);
+
 /**
  * \brief Calculates an intersection point of two lines.
  * \param l1	First line.
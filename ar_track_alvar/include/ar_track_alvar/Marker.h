@@ -44,6 +44,29 @@
 
 namespace alvar {
 
+  /**
+   * \brief The sample points of a marker in marker coordinates for one set of size parameters.
+   *
+   * The geometries are immutable and shared by all the markers with the same
+   * size parameters, use \e Get to find or create one.
+   */
+  struct ALVAR_EXPORT MarkerGeometry {
+    double edge_length;
+    int res;
+    double margin;
+    /** \brief Marker corners in marker coordinates */
+    std::vector<PointDouble> corners;
+    /** \brief Marker color points in marker coordinates */
+    std::vector<PointDouble> points;
+    /** \brief Samples to be used in figuring out min/max for thresholding */
+    std::vector<PointDouble> margin_w;
+    /** \brief Samples to be used in figuring out min/max for thresholding */
+    std::vector<PointDouble> margin_b;
+
+    /** \brief Returns the cached geometry for the given size parameters (thread safe) */
+    static const MarkerGeometry *Get(double edge_length, int res, double margin);
+  };
+
   /**
    * \brief Basic 2D \e Marker functionality.
    *
@@ -77,6 +100,15 @@ namespace alvar {
     /** \brief Updates the markers \e pose estimation
      */
     void UpdatePose(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, Camera *cam, int orientation, int frame_no = 0, bool update_pose = true);
+    /** \brief Refines the markers \e pose from the pose of the previous frame
+     *
+     *  Meant for the tracked markers. The pose is solved from scratch as in \e UpdatePose
+     *  if the refinement fails or its RMS reprojection error is above \e max_error pixels.
+     */
+    void RefinePose(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, Camera *cam, int orientation, double max_error = 2.0);
+    /** \brief Updates \e pose_covariance for the current \e pose and \e marker_corners_img
+     */
+    void UpdatePoseCovariance(Camera *cam);
     /** \brief Decodes the marker content. Please call \e UpdateContent before this. 
      *  This virtual method is meant to be implemented by heirs.
      */
@@ -100,6 +132,10 @@ namespace alvar {
     void SetMarkerSize(double _edge_length = 0, int _res = 0, double _margin = 0);
     /** \brief Get edge length (to support different size markers */
     double GetMarkerEdgeLength() const { return edge_length; }
+    /** \brief Get the shared sample points of the current marker size */
+    const MarkerGeometry *GetGeometry() const { return geometry; }
+    /** \brief Do we interpolate the gray levels bilinearly when reading the content in \e UpdateContent */
+    void SetBilinearSampling(bool _bilinear_sampling = false) { bilinear_sampling = _bilinear_sampling; }
     /** \brief Destructor  */
     ~Marker();
     /** \brief Default constructor 
@@ -134,6 +170,12 @@ namespace alvar {
     /** \brief The current marker \e Pose
      */
     Pose pose;
+    /** \brief The row-major 6x6 covariance of \e pose in the camera frame
+     *
+     *  The order is (x, y, z, rotation about x, y and z axes) as in \e Camera::CalcExteriorOrientationCovariance,
+     *  all zeros if it is unknown.
+     */
+    double pose_covariance[36];
     /** \brief Get marker detection error estimate
      * \param errors Flags indicating what error elements are combined
      * The marker detection error can consist of several elements:
@@ -166,23 +208,23 @@ namespace alvar {
     int res;
     double margin;
     CvMat *marker_content;
+    const MarkerGeometry *geometry;
+    bool bilinear_sampling;
+    /** \brief The content points followed by the white and black margin samples in image coordinates (reused between the calls) */
+    std::vector<PointDouble> sample_points_img;
 
   public:
       
-    /** \brief Marker color points in marker coordinates */
-    std::vector<PointDouble> marker_points;
     /** \brief Marker corners in marker coordinates */
     std::vector<PointDouble> marker_corners;
     /** \brief Marker corners in image coordinates */
     std::vector<PointDouble> marker_corners_img;
+    /** \brief Motion of the image corners since the previous frame (filled when the marker is tracked) */
+    std::vector<PointDouble> marker_corners_img_velocity;
     /** \brief Marker points in image coordinates */
     std::vector<PointDouble> ros_marker_points_img;
     ar_track_alvar::ARCloud ros_corners_3D;
     int ros_orientation;
-    /** \brief Samples to be used in figuring out min/max for thresholding */
-    std::vector<PointDouble> marker_margin_w;
-    /** \brief Samples to be used in figuring out min/max for thresholding */
-    std::vector<PointDouble> marker_margin_b;
 #ifdef VISUALIZE_MARKER_POINTS
     std::vector<PointDouble> marker_allpoints_img;
 #endif
@@ -215,19 +257,25 @@ namespace alvar {
     void SetContent(unsigned long _id);
   };
 
+  class MarkerDataTable;
+
   /**
    * \brief \e MarkerData contains matrix of Hamming encoded data.
    */
   class ALVAR_EXPORT MarkerData : public Marker
   {
   protected:
+    const MarkerDataTable *decode_table;
+    int decode_table_max_distance;
+    const std::vector<int> *allowed_res;
+    bool DecodeContentTable(int *orientation);
     virtual void VisualizeMarkerContent(IplImage *image, Camera *cam, double datatext_point[2], double content_point[2]) const;
     void DecodeOrientation(int *error, int *total, int *orientation);
     int DecodeCode(int orientation, BitsetExt *bs, int *erroneous, int *total, unsigned char* content_type);
     void Read6bitStr(BitsetExt *bs, char *s, size_t s_max_len);
     void Add6bitStr(BitsetExt *bs, char *s);
     int UsableDataBits(int marker_res, int hamming);
-    bool DetectResolution(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam);
+    bool DetectResolution(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, const std::vector<int> *resolutions);
 
   public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW  
@@ -252,7 +300,7 @@ namespace alvar {
      * \param _margin The marker margin resolution in pixels (The actual captured marker image has pixel resolution of _margin+_res+_margin)
      */
   MarkerData(double _edge_length = 0, int _res = 0, double _margin = 0) : 
-    Marker(_edge_length, _res, (_margin?_margin:2))
+    Marker(_edge_length, _res, (_margin?_margin:2)), decode_table(NULL), decode_table_max_distance(0), allowed_res(NULL)
       {
       }
     /** \brief Get ID for recognizing this marker */
@@ -267,11 +315,69 @@ namespace alvar {
     /** \brief \e DecodeContent should be called after \e UpdateContent to fill \e content_type, \e decode_error and \e data 
      */
     bool DecodeContent(int *orientation);
+    /** \brief Decode the content by looking it up from \e table when the marker has the resolution of the table
+     * \param table The codes of all the ids, NULL uses the Hamming decoding
+     * \param max_distance The number of cells that may differ from the nearest code
+     */
+    void SetDecodeTable(const MarkerDataTable *table, int max_distance = 1) {
+      decode_table = table;
+      decode_table_max_distance = max_distance;
+    }
+    /** \brief Limits the automatic resolution detection of \e UpdateContent to the given resolutions
+     * \param resolutions The allowed resolutions, kept by pointer. NULL or empty allows all the resolutions.
+     */
+    void SetAllowedResolutions(const std::vector<int> *resolutions) {
+      allowed_res = resolutions;
+    }
     /** \brief Updates the \e marker_content by "encoding" the given parameters
      */
     void SetContent(MarkerContentType content_type, unsigned long id, const char *str, bool force_strong_hamming=false, bool verbose=false);
   };
 
+  /**
+   * \brief The content of every number \e MarkerData of one resolution in all four orientations.
+   *
+   * The thresholded cells are packed row by row into a bit mask (set bits are black) and
+   * the masks are kept in a hash table. The tables are shared, use \e Get to find or create one.
+   */
+  class ALVAR_EXPORT MarkerDataTable {
+  protected:
+    int res;
+    std::vector<uint64_t> codes; // The code of id i in orientation k is at 4*i+k
+    std::vector<int> slots;      // Open addressing hash table of the indices to \e codes
+    std::vector<unsigned long> ids; // The id of the codes 4*i..4*i+3 if not all the ids are included
+    int hash_bits;
+    int min_distance;
+    MarkerDataTable(int _res);
+    void Build();
+    int Slot(uint64_t code) const;
+  public:
+    /** \brief Creates a table with only the given ids of \e table
+     *
+     * The codes of a smaller set are usually further apart from each other, so
+     * more erroneous cells can be corrected (see \e GetMinDistance).
+     */
+    MarkerDataTable(const MarkerDataTable &table, const std::vector<unsigned long> &_ids);
+    /** \brief The marker resolution */
+    int GetRes() const { return res; }
+    /** \brief The least number of cells that differ between any two codes of the table */
+    int GetMinDistance() const { return min_distance; }
+    /** \brief The most erroneous cells that can be corrected with this table when \e table corrects \e max_distance
+     *
+     * The distance grows while the codes stay uniquely decodable and a random code is not
+     * matched more often than with \e max_distance in \e table. It is never less than \e max_distance.
+     */
+    int GetMaxDistance(const MarkerDataTable &table, int max_distance) const;
+    /** \brief Packs the thresholded cells of \e content into a code */
+    static uint64_t Code(const CvMat *content);
+    /** \brief Finds the id and the orientation of the code nearest to \e code
+     * \return False if there is no code within \e max_distance or the nearest one is ambiguous
+     */
+    bool Find(uint64_t code, int max_distance, unsigned long *id, int *orientation, int *distance) const;
+    /** \brief Returns the shared table for the resolution, NULL if the resolution has too many ids (only 5 is supported) */
+    static const MarkerDataTable *Get(int res);
+  };
+
   /** \brief Iterator type for traversing templated Marker vector without the template.
    */
   class ALVAR_EXPORT MarkerIterator : public std::iterator<std::forward_iterator_tag, Marker*> {
@@ -43,11 +43,37 @@ using std::rotate;
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
 #include <cassert>
 #include <Eigen/StdVector>
 
 namespace alvar {
 
+/**
+ * \brief Counts of the new marker candidates handled by each stage of \e MarkerDetectorImpl::Detect
+ */
+struct ALVAR_EXPORT DetectStats {
+	/** \brief The quads that were not matched to the tracked markers */
+	int candidates;
+	/** \brief Rejected by the border and margin samples before reading the content */
+	int prefilter_rejected;
+	/** \brief Rejected by \e Marker::UpdateContent */
+	int content_rejected;
+	/** \brief Rejected by \e Marker::DecodeContent */
+	int decode_rejected;
+	/** \brief Rejected because the decoded id is not allowed */
+	int id_rejected;
+	/** \brief Rejected by the margin and decode error limit */
+	int error_rejected;
+	/** \brief Accepted as new markers */
+	int accepted;
+	/** \brief Tracked with the optical flow without labeling the image */
+	int flow_tracked;
+
+	DetectStats() : candidates(0), prefilter_rejected(0), content_rejected(0),
+		decode_rejected(0), id_rejected(0), error_rejected(0), accepted(0), flow_tracked(0) {}
+};
+
 /**
  * \brief Templateless version of MarkerDetector. Please use MarkerDetector instead.
  */
@@ -70,6 +96,114 @@ protected:
 	int res;
 	double margin;
 	bool detect_pose_grayscale;
+	Labeling::ThresholdMethod thresh_method;
+	Labeling::PixelFormat pixel_format;
+	int pyramid_levels;
+	double pyramid_tolerance;
+	int labeling_threads;
+	bool roi_tracking;
+	int roi_full_scan_interval;
+	double roi_padding;
+	int roi_frame_count;
+	bool prefilter;
+	double prefilter_min_contrast;
+	double prefilter_max_error;
+	DetectStats stats;
+	bool bilinear_sampling;
+	bool decode_table_enabled;
+	int decode_table_max_distance;
+	const MarkerDataTable *decode_table;
+	int decode_table_distance;
+	double decode_table_error;
+	std::set<unsigned long> allowed_ids;
+	MarkerDataTable *allowed_table;
+
+	/** Selects the decode table for the resolution and the allowed ids */
+	void UpdateDecodeTable();
+	/** The margin and decode error of a new candidate, without the cells corrected beyond \e decode_table_max_distance */
+	double DecodeError(const Marker *mn) const;
+
+	int decode_threads;
+	WorkerPool *decode_pool;
+	std::vector<Marker*> decode_scratch;
+	std::vector<size_t> decode_candidates;
+	std::vector<Marker*> decode_results;
+	std::vector<int> decode_outcomes;
+	int decode_slices;
+	Camera *decode_cam;
+	double decode_max_error;
+	bool decode_update_pose;
+
+	/** Decodes every \e decode_slices:th new candidate starting from \e slice using the scratch marker of the slice */
+	void DecodeSlice(int slice);
+	static void DecodeJob(void *detector, int slice);
+	void ClearDecodeScratch();
+
+	/** Samples the black border and the white margin of the quad, returns false if they are clearly wrong */
+	bool PrefilterQuad(const std::vector<PointDouble> &corners, IplImage *gray, int quad_res);
+
+	/** The detected resolution of a marker at an image position */
+	struct ResolutionHint {
+		PointDouble center;
+		double size;
+		int res;
+	};
+	std::vector<int> allowed_res;
+	std::vector<ResolutionHint> res_hints;      // The markers of the previous frame and the tracked markers
+	std::vector<ResolutionHint> res_hints_next; // The markers of the current frame
+	void AddResolutionHint(const Marker *mn);
+	/** Returns the resolution of a known marker at the quad, or zero if the resolution must be detected */
+	int FindResolutionHint(const std::vector<PointDouble> &corners) const;
+
+	/** A tracked marker matched with a blob */
+	struct TrackMatch {
+		double error;
+		size_t track;
+		int blob;
+		int orientation;
+		bool operator<(const TrackMatch &m) const {
+			if (error != m.error) return error < m.error;
+			if (track != m.track) return track < m.track;
+			return blob < m.blob;
+		}
+	};
+	std::vector<PointDouble> blob_centers;
+	std::vector<int> blob_grid_start;           // The first position of each grid cell in blob_grid
+	std::vector<int> blob_grid;                 // The blob indices ordered by the grid cell
+	std::vector<int> blob_cells;                // The grid cell of each blob, -1 once the blob is matched
+	std::vector<TrackMatch> track_candidates;   // The pairs within the tracking gate
+	std::vector<TrackMatch> track_matches;      // The match of each tracked marker, blob is -1 if none
+	/** Matches the tracked markers with the blobs, the best pairs are assigned first and each blob only once */
+	void MatchTracks(IplImage *image, std::vector<std::vector<PointDouble> > &blob_corners, double max_track_error);
+
+	bool flow_tracking;
+	int flow_keyframe_interval;
+	int flow_win_size;
+	int flow_pyr_levels;
+	double flow_max_error;
+	int flow_frame_count;
+	IplImage *flow_gray;          // The gray image of the latest frame
+	IplImage *flow_prev_gray;     // The gray image of the frame before
+	IplImage *flow_pyramid;
+	IplImage *flow_prev_pyramid;
+	bool flow_gray_valid;
+	bool flow_prev_gray_valid;
+	bool flow_pyramid_ready;      // Is the pyramid of flow_gray computed
+	bool flow_prev_pyramid_ready;
+	std::vector<CvPoint2D32f> flow_points_prev;
+	std::vector<CvPoint2D32f> flow_points;
+	std::vector<CvPoint2D32f> flow_points_back;
+	std::vector<char> flow_status;
+	std::vector<char> flow_status_back;
+	/** Keeps a copy of the gray image of the frame for the optical flow of the next frame */
+	void StoreFlowGray(IplImage *gray);
+	void ReleaseFlowImages();
+	/** Moves the corners of all the tracked markers with the optical flow and updates their poses.
+	 *  Returns false without changing anything if any of the markers fails the consistency checks. */
+	bool TrackFlow(IplImage *image, Camera *cam, bool update_pose, bool visualize, double max_track_error);
+
+	/** Predicts the image regions of the tracked markers for the next \e Detect */
+	void PredictTrackRegions(IplImage *image, std::vector<CvRect> &regions);
 
 	MarkerDetectorImpl();
 	virtual ~MarkerDetectorImpl();
@@ -106,6 +240,107 @@ public:
 	*/
 	void SetOptions(bool _detect_pose_grayscale=false);
 
+	/** Select the thresholding backend used when labeling the image.
+	* \param _thresh_method \e Labeling::ADAPT uses OpenCV's adaptive threshold and \e Labeling::ADAPT_INTEGRAL
+	* computes the identical result using \e IntegralThreshold.
+	*/
+	void SetThresholdMethod(Labeling::ThresholdMethod _thresh_method=Labeling::ADAPT);
+
+	/** Select the pixel format of the images given to \e Detect.
+	* \param _pixel_format With \e Labeling::PIXEL_AUTO the format follows the number of channels.
+	* The 8-bit mono images are labeled without copying them with \e Labeling::PIXEL_MONO8, except when
+	* \e Detect visualizes into the image. The luma of \e Labeling::PIXEL_YUV422 and the green channel
+	* of the Bayer formats are used as the gray image.
+	*/
+	void SetPixelFormat(Labeling::PixelFormat _pixel_format=Labeling::PIXEL_AUTO);
+
+	/** Enable the coarse-to-fine detection mode.
+	* \param _levels The quad candidates are searched from an image downsampled by 2^_levels
+	* (1 or 2 are sensible values, 0 disables the mode). The edges are then refined in full resolution.
+	* \param _tolerance The full resolution refinement is iterated until the corners move less than this (pixels).
+	* The mode is used only with the \e CVSEQ labeling method.
+	*/
+	void SetPyramidLevels(int _levels=0, double _tolerance=0.1);
+
+	/** Set the number of threads used for labeling the image.
+	* \param _threads The image is labeled in this many horizontal bands in parallel (1 disables).
+	* The bands are used only with the \e CVSEQ labeling method.
+	*/
+	void SetLabelingThreads(int _threads=1);
+
+	/** Set the number of threads used for decoding the new marker candidates.
+	* \param _threads The content and the pose of the new candidates are solved in parallel
+	* using this many threads (1 disables). The markers are added in the same order as with one thread.
+	*/
+	void SetDecodeThreads(int _threads=1);
+
+	/** Enable labeling only around the predicted positions of the tracked markers.
+	* When \e Detect is called with \e track the quad of every tracked marker is predicted from its
+	* last corners and their velocity, and only the padded regions around the predictions are labeled.
+	* The whole image is scanned every \e _full_scan_interval frames and in the frame after a track is lost.
+	* \param _enable Do we use the region tracking?
+	* \param _full_scan_interval How many frames are labeled using the regions between the full scans.
+	* \param _padding The predicted region is grown by this fraction of the marker size.
+	*/
+	void SetRoiTracking(bool _enable=false, int _full_scan_interval=10, double _padding=0.3);
+
+	/** Enable tracking the markers with the optical flow between the full detections.
+	* When \e Detect is called with \e track, the image is labeled and decoded only on the keyframes.
+	* In between, the corners of the tracked markers are moved with the pyramidal Lucas-Kanade optical
+	* flow and only the poses are updated. If the flow of any corner is lost, is not consistent
+	* forward and backward, makes the quad non-convex or moves more than \e max_track_error, the
+	* frame is detected fully. The new markers are found only on the keyframes.
+	* \param _enable Do we use the optical flow tracking?
+	* \param _keyframe_interval How many frames are tracked with the flow between the full detections.
+	* \param _win_size The size of the Lucas-Kanade search window (pixels).
+	* \param _pyr_levels The number of pyramid levels used for the flow.
+	* \param _max_flow_error The largest forward-backward error of a corner (pixels).
+	*/
+	void SetFlowTracking(bool _enable=false, int _keyframe_interval=5, int _win_size=11, int _pyr_levels=3, double _max_flow_error=1.0);
+
+	/** Enable the early rejection of the new marker candidates.
+	* A few points in the middle of the black border and half a cell outside the marker are sampled
+	* from every quad before its content is read. The check is skipped when the marker resolution
+	* is detected automatically (\e SetMarkerSize with zero \e _res) and not yet known for the quad.
+	* The rejection is disabled by default, so the detection results do not change unless it is enabled.
+	* \param _enable Do we use the early rejection?
+	* \param _min_contrast The least difference of the white and black sample averages (gray levels).
+	* \param _max_error The largest fraction of samples on the wrong side of the middle level.
+	*/
+	void SetPrefilter(bool _enable=false, double _min_contrast=8, double _max_error=0.5);
+
+	/** Select how the marker content is read from the image.
+	* \param _enable The gray levels of the content and margin samples are interpolated bilinearly
+	* instead of taking the nearest pixel.
+	*/
+	void SetBilinearSampling(bool _enable=false);
+
+	/** Decode the \e MarkerData content with a precomputed table of all the valid codes.
+	* The table is only available for the 5x5 number markers, other markers are decoded as before.
+	* \param _enable Do we use the lookup table?
+	* \param _max_distance The most cells that may differ from the nearest valid code.
+	*/
+	void SetDecodeTable(bool _enable=false, int _max_distance=1);
+
+	/** Detect only the markers with the given ids.
+	* The new candidates with other ids are rejected before their pose is calculated. With
+	* \e SetDecodeTable the codes are looked up only among the allowed ids, which can correct
+	* more erroneous cells than \e _max_distance when the allowed codes are far enough apart
+	* (see \e MarkerDataTable::GetMaxDistance). The extra cells do not count towards \e max_new_marker_error.
+	* \param ids The allowed ids, all the ids are allowed if this is empty.
+	*/
+	void SetAllowedIds(const std::vector<unsigned long> &ids = std::vector<unsigned long>());
+
+	/** Limit the automatic resolution detection (\e SetMarkerSize with zero \e _res) to the given resolutions.
+	* The resolution of a new candidate is taken from a marker found near it in the previous frame
+	* when possible and detected only if that fails. With a single allowed resolution it is never detected.
+	* \param resolutions The allowed resolutions, all the resolutions are allowed if this is empty.
+	*/
+	void SetAllowedResolutions(const std::vector<int> &resolutions = std::vector<int>());
+
+	/** Returns the counts of the candidates rejected by each stage in the last \e Detect */
+	const DetectStats& GetStats() const { return stats; }
+
 	/**
 	 * \brief \e Detect \e Marker 's from \e image 
 	 *
@@ -0,0 +1,101 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+
+#ifndef PLANARPOSE_H
+#define PLANARPOSE_H
+
+/**
+ * \file PlanarPose.h
+ *
+ * \brief This file implements the pose estimation of planar targets.
+ */
+
+#include "Alvar.h"
+
+namespace alvar {
+
+/**
+ * \brief Pose of a planar target from its points on normalized image plane
+ *
+ * The rotation is solved in closed form from the Jacobian of the homography between the
+ * target plane and the image (Infinitesimal Plane-based Pose Estimation, IPPE), which gives
+ * the two solutions of the planar pose ambiguity. The translation is then solved linearly
+ * and both solutions are refined with a few Levenberg-Marquardt steps of the reprojection error.
+ *
+ * \section References
+ * - Collins, T. & Bartoli, A. (2014). Infinitesimal Plane-based Pose Estimation.
+ *   International Journal of Computer Vision, 109(3), 252-286.
+ */
+class ALVAR_EXPORT PlanarPose {
+public:
+	/** \brief The most points \e Solve accepts, the work buffers are on the stack */
+	enum { MAX_POINTS = 64 };
+
+	/** \brief Solve the pose
+	 * \param model The (x, y) coordinates of the target points on the z=0 plane
+	 * \param image The (x, y) coordinates of the undistorted normalized image points
+	 * \param count The number of points, from four to \e MAX_POINTS
+	 * \param rot The row-major rotation matrices of the solutions
+	 * \param tra The translations of the solutions
+	 * \param error The sums of the squared reprojection errors on normalized image plane
+	 * \param iterations The most Levenberg-Marquardt steps for each solution
+	 * \return The number of solutions (0-2), the solution with the smaller error is first
+	 */
+	static int Solve(const double *model, const double *image, int count,
+	                 double rot[2][9], double tra[2][3], double error[2], int iterations = 3);
+
+	/** \brief Refine a pose with Levenberg-Marquardt steps starting from the given pose
+	 *
+	 * This is meant for the tracked targets whose pose in the previous frame is near the
+	 * current one. The refinement stays with the solution it starts from, so it does not
+	 * flip between the two solutions of the planar pose ambiguity.
+	 * \param model The (x, y) coordinates of the target points on the z=0 plane
+	 * \param image The (x, y) coordinates of the undistorted normalized image points
+	 * \param count The number of points, from three to \e MAX_POINTS
+	 * \param rot The row-major rotation matrix, updated in place
+	 * \param tra The translation, updated in place
+	 * \param iterations The most steps, the refinement stops earlier when the error does not decrease
+	 * \return The sum of the squared reprojection errors on normalized image plane, HUGE_VAL on failure
+	 */
+	static double Refine(const double *model, const double *image, int count,
+	                     double rot[9], double tra[3], int iterations = 5);
+
+	/** \brief The first order covariance of a pose from the Jacobian of the reprojection
+	 *
+	 * \param model The (x, y) coordinates of the target points on the z=0 plane
+	 * \param count The number of points, from three to \e MAX_POINTS
+	 * \param rot The row-major rotation matrix
+	 * \param tra The translation
+	 * \param variance The variance of the image coordinates on normalized image plane
+	 * \param cov The row-major 6x6 covariance of (x, y, z, rotation about x, y and z axes), the
+	 *        rotations are small rotations about the fixed axes of the camera frame
+	 * \return False if the covariance could not be solved
+	 */
+	static bool Covariance(const double *model, int count, const double rot[9], const double tra[3],
+	                       double variance, double cov[36]);
+};
+
+} // namespace alvar
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#ifndef POSE_TRACKER_H
+#define POSE_TRACKER_H
+
+/**
+ * \file PoseTracker.h
+ *
+ * \brief This file implements a per-marker pose tracker built on \e KalmanEkf.
+ */
+
+#include "Alvar.h"
+#include "Kalman.h"
+#include <map>
+#include <vector>
+
+namespace alvar {
+
+/** \brief Constant velocity EKF for a 6-DOF pose.
+ *
+ * The state is [t(3), v(3), q(4), w(3)] where \e t is the translation, \e v
+ * its velocity, \e q the rotation quaternion in [w x y z] order and \e w the
+ * angular velocity in the same frame as \e t. Between measurements the
+ * velocities are assumed constant and perturbed by white accelerations. The
+ * measurement is [t(3), q(4)] with the covariance given in the (t, rotation
+ * vector) order used by \e Marker::pose_covariance.
+ */
+class ALVAR_EXPORT KalmanPose : public KalmanEkf {
+protected:
+	KalmanSensor sensor;
+	double acceleration_noise;
+	double angular_acceleration_noise;
+	bool initialized;
+	virtual void f(CvMat *_x, CvMat *_x_pred, double dt);
+	virtual void update_F(unsigned long tick);
+	void SetMeasurement(const double tra[3], const double quat[4], const double cov[36]);
+public:
+	/** \brief Constructor
+	 *  \param _acceleration_noise The std of the linear acceleration (units/s^2)
+	 *  \param _angular_acceleration_noise The std of the angular acceleration (rad/s^2)
+	 */
+	KalmanPose(double _acceleration_noise=1.0, double _angular_acceleration_noise=1.0);
+	virtual ~KalmanPose() {}
+	/** \brief Has the filter received its first measurement */
+	bool IsInitialized() const { return initialized; }
+	/** \brief The tick (ms) of the latest measurement */
+	unsigned long GetUpdateTick() const { return (unsigned long)prev_tick; }
+	/** \brief Forget the state; the next \e Update initializes the filter again */
+	void Reset() { initialized = false; }
+	/** \brief Update the filter with a measured pose.
+	 *  \param tick The time of the measurement in milliseconds
+	 *  \param tra The measured translation
+	 *  \param quat The measured quaternion [w x y z]
+	 *  \param cov The 6x6 measurement covariance in (t, rotation vector) order
+	 */
+	void Update(unsigned long tick, const double tra[3], const double quat[4], const double cov[36]);
+	/** \brief Predict the pose for the given time without changing the state.
+	 *  \param tick The time in milliseconds; earlier times return the latest estimate
+	 *  \param tra The predicted translation
+	 *  \param quat The predicted quaternion [w x y z]
+	 *  \param cov If given, filled with the 6x6 covariance in (t, rotation vector) order
+	 */
+	void Predict(unsigned long tick, double tra[3], double quat[4], double cov[36]=NULL);
+};
+
+/** \brief Tracks the poses of several markers with one \e KalmanPose per id.
+ *
+ * The tracker is fed with the detected poses. \e Get returns the filtered pose
+ * for any id that has been seen within \e timeout seconds, predicting through
+ * the frames where the marker was missed. Ids older than that are dropped.
+ *
+ * \code
+ * PoseTracker tracker(0.5);
+ * tracker.Update(id, stamp, marker.pose.translation, quat, marker.pose_covariance);
+ * tracker.GetIds(stamp, ids);
+ * for (size_t i=0; i<ids.size(); i++) tracker.Get(ids[i], stamp, tra, quat);
+ * \endcode
+ */
+class ALVAR_EXPORT PoseTracker {
+protected:
+	std::map<int, KalmanPose *> filters;
+	double timeout;
+	double acceleration_noise;
+	double angular_acceleration_noise;
+	double position_sigma;
+	double rotation_sigma;
+	double start_time;
+	bool started;
+	unsigned long Tick(double time);
+public:
+	/** \brief Constructor
+	 *  \param _timeout How long (s) an id is predicted after its latest measurement
+	 *  \param _acceleration_noise The std of the linear acceleration (units/s^2)
+	 *  \param _angular_acceleration_noise The std of the angular acceleration (rad/s^2)
+	 *  \param _position_sigma The position std (units) used when no covariance is given
+	 *  \param _rotation_sigma The rotation std (rad) used when no covariance is given
+	 */
+	PoseTracker(double _timeout=0.5, double _acceleration_noise=1.0, double _angular_acceleration_noise=1.0,
+		double _position_sigma=0.01, double _rotation_sigma=0.02);
+	~PoseTracker();
+	/** \brief Remove all the tracked ids */
+	void Reset();
+	/** \brief Set how long (s) an id is predicted after its latest measurement */
+	void SetTimeout(double _timeout) { timeout = _timeout; }
+	/** \brief Update the filter of \e id with a measured pose.
+	 *  \param id The marker id
+	 *  \param time The time of the measurement in seconds
+	 *  \param tra The measured translation
+	 *  \param quat The measured quaternion [w x y z]
+	 *  \param cov The optional 6x6 covariance in (t, rotation vector) order
+	 */
+	void Update(int id, double time, const double tra[3], const double quat[4], const double *cov=NULL);
+	/** \brief Get the filtered or predicted pose of \e id for the given time.
+	 *  \return false if the id is unknown or has not been seen within the timeout
+	 */
+	bool Get(int id, double time, double tra[3], double quat[4], double *cov=NULL);
+	/** \brief Drop the expired ids and list the ones that are still tracked */
+	void GetIds(double time, std::vector<int> &ids);
+};
+
+} // namespace alvar
+
+#endif
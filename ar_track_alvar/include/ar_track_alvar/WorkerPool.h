@@ -0,0 +1,93 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+/**
+ * \file WorkerPool.h
+ *
+ * \brief This file implements a pool of worker threads.
+ */
+
+#include "Alvar.h"
+
+namespace alvar {
+
+class WorkerPoolPrivate;
+
+/**
+ * \brief Pool of worker threads for running data parallel jobs.
+ *
+ * The threads are created once and they wait for jobs between the \e run calls.
+ * The calling thread takes part in running the jobs, so a pool of \e n threads
+ * creates \e n-1 worker threads.
+ *
+ * \section Usage
+ * \code
+ * void job(void *parameters, int index) {
+ *     // Process the part 'index' of the data in 'parameters'
+ * }
+ * WorkerPool pool(4);
+ * pool.run(job, &data, 16);
+ * \endcode
+ */
+class ALVAR_EXPORT WorkerPool
+{
+public:
+    /**
+     * \brief Constructor.
+     *
+     * \param threads The number of threads running the jobs (0 uses the number of processors).
+     */
+    WorkerPool(int threads = 0);
+
+    /**
+     * \brief Destructor.
+     */
+    ~WorkerPool();
+
+    /**
+     * \brief The number of threads running the jobs (including the calling thread).
+     */
+    int size() const;
+
+    /**
+     * \brief Runs method(parameters, index) for every index in [0, count) and returns when all are done.
+     *
+     * The same pool should not be run from several threads at the same time.
+     *
+     * \param method The method that is run for each index.
+     * \param parameters The parameters sent to the method.
+     * \param count The number of indices.
+     */
+    void run(void (*method)(void *, int), void *parameters, int count);
+
+private:
+    WorkerPoolPrivate *d;
+};
+
+} // namespace alvar
+
+#endif
@@ -37,6 +37,7 @@
 #include "ar_track_alvar/MarkerDetector.h"
 #include "ar_track_alvar/MultiMarkerBundle.h"
 #include "ar_track_alvar/MultiMarkerInitializer.h"
+#include "ar_track_alvar/PoseTracker.h"
 #include "ar_track_alvar/Shared.h"
 #include <cv_bridge/cv_bridge.h>
 #include <ar_track_alvar_msgs/AlvarMarker.h>
@@ -102,6 +103,7 @@ std::vector<int> *bundle_indices;
 bool init = true;
 ata::MedianFilter **med_filts;
 int med_filt_size;
+PoseTracker *pose_tracker = NULL;
 
 double marker_size;
 double max_new_marker_error;
@@ -371,7 +373,7 @@ int PlaneFitPoseImprovement(int id, const ARCloud &corners_3D, ARCloud::Ptr sele
 
 // Updates the bundlePoses of the multi_marker_bundles by detecting markers and
 // using all markers in a bundle to infer the master tag's position
-void GetMultiMarkerPoses(IplImage *image, ARCloud &cloud) {
+void GetMultiMarkerPoses(IplImage *image, ARCloud &cloud, double stamp) {
 
   for(int i=0; i<n_bundles; i++){
     master_visible[i] = false;
@@ -488,7 +490,11 @@ void GetMultiMarkerPoses(IplImage *image, ARCloud &cloud) {
             //    } 
             //}
             Pose ret_pose;
-            if(med_filt_size > 0){
+            if(pose_tracker){
+                pose_tracker->Update(i, stamp, bundlePoses[i].translation, bundlePoses[i].quaternion);
+                pose_tracker->Get(i, stamp, bundlePoses[i].translation, bundlePoses[i].quaternion);
+            }
+            else if(med_filt_size > 0){
                 med_filts[i]->addPose(bundlePoses[i]);
                 med_filts[i]->getMedian(ret_pose);
                 bundlePoses[i] = ret_pose;
@@ -629,7 +635,7 @@ void getPointCloudCallback (const sensor_msgs::PointCloud2ConstPtr &msg)
       // us a cv::Mat. I'm too lazy to change to cv::Mat throughout right now, so I
       // do this conversion here -jbinney
       IplImage ipl_image = cv_ptr_->image;
-      GetMultiMarkerPoses(&ipl_image, cloud);
+      GetMultiMarkerPoses(&ipl_image, cloud, msg->header.stamp.toSec());
 
       for (size_t i=0; i<marker_detector.markers->size(); i++)
 	{
@@ -659,6 +665,12 @@ void getPointCloudCallback (const sensor_msgs::PointCloud2ConstPtr &msg)
 	    rvizMarkerPub_.publish (rvizMarker);
 	    arPoseMarkers_.markers.push_back (ar_pose_marker);
 	  }
+	  //With the pose tracker, keep predicting a missed bundle until its timeout
+	  else if(pose_tracker && pose_tracker->Get(i, msg->header.stamp.toSec(), bundlePoses[i].translation, bundlePoses[i].quaternion)){
+	    makeMarkerMsgs(MAIN_MARKER, master_id[i], bundlePoses[i], image_msg, CamToOutput, &rvizMarker, &ar_pose_marker, 0);
+	    rvizMarkerPub_.publish (rvizMarker);
+	    arPoseMarkers_.markers.push_back (ar_pose_marker);
+	  }
 	}
 
       //Publish the marker messages
@@ -768,7 +780,7 @@ int calcAndSaveMasterCoords(MultiMarkerBundle &master)
 int main(int argc, char *argv[])
 {
   ros::init (argc, argv, "marker_detect");
-  ros::NodeHandle n;
+  ros::NodeHandle n, pn("~");
 
   if(argc < 9){
     std::cout << std::endl;
@@ -802,6 +814,15 @@ int main(int argc, char *argv[])
   for(int i=0; i<n_bundles; i++)
     med_filts[i] = new ata::MedianFilter(med_filt_size);
 
+  //Optionally track the master poses with a constant velocity Kalman filter instead of
+  //the median filter; the noises are in m/s^2 and rad/s^2, the poses in centimeters
+  double kalman_timeout, kalman_acceleration_noise, kalman_angular_acceleration_noise;
+  pn.param("kalman_timeout", kalman_timeout, 0.0);
+  pn.param("kalman_acceleration_noise", kalman_acceleration_noise, 2.0);
+  pn.param("kalman_angular_acceleration_noise", kalman_angular_acceleration_noise, 5.0);
+  if(kalman_timeout > 0)
+    pose_tracker = new PoseTracker(kalman_timeout, kalman_acceleration_noise*100.0, kalman_angular_acceleration_noise, 1.0, 0.02);
+
   // Load the marker bundle XML files
   for(int i=0; i<n_bundles; i++){	
     bundlePoses[i].Reset();		
@@ -820,6 +841,16 @@ int main(int argc, char *argv[])
     }		
   }  
 
+  //Optionally detect only the markers of the bundles, the other markers are not published then
+  bool only_bundle_markers;
+  pn.param("only_bundle_markers", only_bundle_markers, false);
+  if(only_bundle_markers){
+    vector<unsigned long> bundle_ids;
+    for(int i=0; i<n_bundles; i++)
+      bundle_ids.insert(bundle_ids.end(), bundle_indices[i].begin(), bundle_indices[i].end());
+    marker_detector.SetAllowedIds(bundle_ids);
+  }
+
   // Set up camera, listeners, and broadcasters
   cam = new Camera(n, cam_info_topic);
   tf_listener = new tf::TransformListener(n);
@@ -91,7 +91,8 @@ void GetMultiMarkerPoses(IplImage *image) {
     
     if(marker_detector.DetectAdditional(image, cam, false) > 0){
       for(int i=0; i<n_bundles; i++){
-	if ((multi_marker_bundles[i]->SetTrackMarkers(marker_detector, cam, bundlePoses[i], image) > 0))
+	// The image may be the message data, so the track markers are not drawn on it
+	if ((multi_marker_bundles[i]->SetTrackMarkers(marker_detector, cam, bundlePoses[i], NULL) > 0))
 	  multi_marker_bundles[i]->Update(marker_detector.markers, cam, bundlePoses[i]);
       }
     }
@@ -188,6 +189,20 @@ void makeMarkerMsgs(int type, int id, Pose &p, sensor_msgs::ImageConstPtr image_
 }
 
 
+// Returns the pixel format for the encodings that the detector reads directly from the message
+bool getPixelFormat (const std::string &encoding, Labeling::PixelFormat &format)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  if (encoding == enc::MONO8) format = Labeling::PIXEL_MONO8;
+  else if (encoding == enc::YUV422) format = Labeling::PIXEL_YUV422;
+  else if (encoding == enc::BAYER_RGGB8) format = Labeling::PIXEL_BAYER_RGGB;
+  else if (encoding == enc::BAYER_BGGR8) format = Labeling::PIXEL_BAYER_BGGR;
+  else if (encoding == enc::BAYER_GBRG8) format = Labeling::PIXEL_BAYER_GBRG;
+  else if (encoding == enc::BAYER_GRBG8) format = Labeling::PIXEL_BAYER_GRBG;
+  else return false;
+  return true;
+}
+
 //Callback to handle getting video frames and processing them
 void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
 {
@@ -209,15 +224,25 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
       arPoseMarkers_.markers.clear ();
 
 
-      //Convert the image
-      cv_ptr_ = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
+      //Wrap the mono, YUV and Bayer images without copying, convert the others
+      IplImage ipl_image;
+      Labeling::PixelFormat pixel_format;
+      if (getPixelFormat(image_msg->encoding, pixel_format)) {
+        int channels = (pixel_format == Labeling::PIXEL_YUV422 ? 2 : 1);
+        cvInitImageHeader(&ipl_image, cvSize(image_msg->width, image_msg->height), IPL_DEPTH_8U, channels);
+        cvSetData(&ipl_image, const_cast<unsigned char *>(&image_msg->data[0]), image_msg->step);
+      } else {
+        pixel_format = Labeling::PIXEL_AUTO;
+        cv_ptr_ = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
+
+        // GetMultiMarkersPoses expects an IplImage*, but as of ros groovy, cv_bridge gives
+        // us a cv::Mat. I'm too lazy to change to cv::Mat throughout right now, so I
+        // do this conversion here -jbinney
+        ipl_image = cv_ptr_->image;
+      }
+      marker_detector.SetPixelFormat(pixel_format);
 
       //Get the estimated pose of the main markers by using all the markers in each bundle
-
-      // GetMultiMarkersPoses expects an IplImage*, but as of ros groovy, cv_bridge gives
-      // us a cv::Mat. I'm too lazy to change to cv::Mat throughout right now, so I
-      // do this conversion here -jbinney
-      IplImage ipl_image = cv_ptr_->image;
       GetMultiMarkerPoses(&ipl_image);
 		
       //Draw the observed markers that are visible and note which bundles have at least 1 marker seen
@@ -278,7 +303,7 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
 int main(int argc, char *argv[])
 {
   ros::init (argc, argv, "marker_detect");
-  ros::NodeHandle n;
+  ros::NodeHandle n, pn("~");
 
   if(argc < 8){
     std::cout << std::endl;
@@ -322,8 +347,25 @@ int main(int argc, char *argv[])
     }		
   }  
 
+  //Optionally detect only the markers of the bundles, the other markers are not published then
+  bool only_bundle_markers;
+  pn.param("only_bundle_markers", only_bundle_markers, false);
+  if(only_bundle_markers){
+    vector<unsigned long> bundle_ids;
+    for(int i=0; i<n_bundles; i++)
+      bundle_ids.insert(bundle_ids.end(), bundle_indices[i].begin(), bundle_indices[i].end());
+    marker_detector.SetAllowedIds(bundle_ids);
+  }
+
+  // Optionally undistort the image for fitting the marker edges, needed with wide-angle lenses
+  bool undistort;
+  int undistort_grid_step;
+  pn.param("undistort", undistort, false);
+  pn.param("undistort_grid_step", undistort_grid_step, 4);
+
   // Set up camera, listeners, and broadcasters
   cam = new Camera(n, cam_info_topic);
+  cam->SetUndistortion(undistort, undistort_grid_step);
   tf_listener = new tf::TransformListener(n);
   tf_broadcaster = new tf::TransformBroadcaster();
   arMarkerPub_ = n.advertise < ar_track_alvar_msgs::AlvarMarkers > ("ar_pose_marker", 0);
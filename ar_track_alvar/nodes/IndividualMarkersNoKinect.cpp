@@ -37,10 +37,12 @@
 
 #include "ar_track_alvar/CvTestbed.h"
 #include "ar_track_alvar/MarkerDetector.h"
+#include "ar_track_alvar/PoseTracker.h"
 #include "ar_track_alvar/Shared.h"
 #include <cv_bridge/cv_bridge.h>
 #include <ar_track_alvar_msgs/AlvarMarker.h>
 #include <ar_track_alvar_msgs/AlvarMarkers.h>
+#include <geometry_msgs/PoseWithCovarianceStamped.h>
 #include <tf/transform_listener.h>
 #include <sensor_msgs/image_encodings.h>
 #include <dynamic_reconfigure/server.h>
@@ -55,11 +57,13 @@ cv_bridge::CvImagePtr cv_ptr_;
 image_transport::Subscriber cam_sub_;
 ros::Publisher arMarkerPub_;
 ros::Publisher rvizMarkerPub_;
+std::map<int, ros::Publisher> covarianceMarkerPubs_;
 ar_track_alvar_msgs::AlvarMarkers arPoseMarkers_;
 visualization_msgs::Marker rvizMarker_;
 tf::TransformListener *tf_listener;
 tf::TransformBroadcaster *tf_broadcaster;
 MarkerDetector<MarkerData> marker_detector;
+PoseTracker *pose_tracker = NULL;
 
 bool enableSwitched = false;
 bool enabled = true;
@@ -73,6 +77,61 @@ std::string output_frame;
 
 void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg);
 
+// A marker pose to publish, either as detected or as filtered by the pose tracker
+struct MarkerOutput {
+	int id;
+	Pose pose;
+	double covariance[36];
+};
+
+
+// Publishes the pose with its covariance on ar_pose_marker_covariance/<id> if the id was advertised in main,
+// the covariance of the marker is in the camera frame and in centimeters, the message is in the output frame and in meters
+void publishCovariance (int id, const tf::Transform &tagPoseOutput, const tf::Transform &camToOutput,
+                        const double *cov, const std_msgs::Header &header)
+{
+	std::map<int, ros::Publisher>::iterator pub = covarianceMarkerPubs_.find(id);
+	if (pub == covarianceMarkerPubs_.end()) return;
+
+	geometry_msgs::PoseWithCovarianceStamped msg;
+	msg.header = header;
+	tf::poseTFToMsg (tagPoseOutput, msg.pose.pose);
+
+	// Both the translation and the rotation blocks rotate with the output frame
+	tf::Matrix3x3 R = camToOutput.getBasis();
+	double B[6][6] = {{0}};
+	for (int i=0; i<3; i++) {
+		for (int j=0; j<3; j++) {
+			B[i][j] = R[i][j]/100.0;
+			B[i+3][j+3] = R[i][j];
+		}
+	}
+	for (int i=0; i<6; i++) {
+		for (int j=0; j<6; j++) {
+			double sum = 0;
+			for (int a=0; a<6; a++) {
+				for (int b=0; b<6; b++) sum += B[i][a]*cov[a*6+b]*B[j][b];
+			}
+			msg.pose.covariance[i*6+j] = sum;
+		}
+	}
+	pub->second.publish (msg);
+}
+
+
+// Returns the pixel format for the encodings that the detector reads directly from the message
+bool getPixelFormat (const std::string &encoding, Labeling::PixelFormat &format)
+{
+	namespace enc = sensor_msgs::image_encodings;
+	if (encoding == enc::MONO8) format = Labeling::PIXEL_MONO8;
+	else if (encoding == enc::YUV422) format = Labeling::PIXEL_YUV422;
+	else if (encoding == enc::BAYER_RGGB8) format = Labeling::PIXEL_BAYER_RGGB;
+	else if (encoding == enc::BAYER_BGGR8) format = Labeling::PIXEL_BAYER_BGGR;
+	else if (encoding == enc::BAYER_GBRG8) format = Labeling::PIXEL_BAYER_GBRG;
+	else if (encoding == enc::BAYER_GRBG8) format = Labeling::PIXEL_BAYER_GRBG;
+	else return false;
+	return true;
+}
 
 void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
 {
@@ -89,24 +148,56 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
     			}
 
 
-            //Convert the image
-            cv_ptr_ = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
+            //Wrap the mono, YUV and Bayer images without copying, convert the others
+            IplImage ipl_image;
+            Labeling::PixelFormat pixel_format;
+            if (getPixelFormat(image_msg->encoding, pixel_format)) {
+                int channels = (pixel_format == Labeling::PIXEL_YUV422 ? 2 : 1);
+                cvInitImageHeader(&ipl_image, cvSize(image_msg->width, image_msg->height), IPL_DEPTH_8U, channels);
+                cvSetData(&ipl_image, const_cast<unsigned char *>(&image_msg->data[0]), image_msg->step);
+            } else {
+                pixel_format = Labeling::PIXEL_AUTO;
+                cv_ptr_ = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
+
+                // GetMultiMarkersPoses expects an IplImage*, but as of ros groovy, cv_bridge gives
+                // us a cv::Mat. I'm too lazy to change to cv::Mat throughout right now, so I
+                // do this conversion here -jbinney
+                ipl_image = cv_ptr_->image;
+            }
+            marker_detector.SetPixelFormat(pixel_format);
 
-            //Get the estimated pose of the main markers by using all the markers in each bundle
+            marker_detector.Detect(&ipl_image, cam, true, false, max_new_marker_error, max_track_error, CVSEQ, true);
 
-            // GetMultiMarkersPoses expects an IplImage*, but as of ros groovy, cv_bridge gives
-            // us a cv::Mat. I'm too lazy to change to cv::Mat throughout right now, so I
-            // do this conversion here -jbinney
-            IplImage ipl_image = cv_ptr_->image;
+			std::vector<MarkerOutput> outputs (marker_detector.markers->size());
+			for (size_t i=0; i<marker_detector.markers->size(); i++)
+			{
+				Marker &marker = (*(marker_detector.markers))[i];
+				outputs[i].id = marker.GetId();
+				outputs[i].pose = marker.pose;
+				for (int j=0; j<36; j++) outputs[i].covariance[j] = marker.pose_covariance[j];
+			}
 
-            marker_detector.Detect(&ipl_image, cam, true, false, max_new_marker_error, max_track_error, CVSEQ, true);
+			//Replace the detections with the filtered poses, predicting the markers
+			//that were missed in this frame until their timeout
+			if (pose_tracker) {
+				double stamp = image_msg->header.stamp.toSec();
+				for (size_t i=0; i<outputs.size(); i++)
+					pose_tracker->Update(outputs[i].id, stamp, outputs[i].pose.translation, outputs[i].pose.quaternion, outputs[i].covariance);
+				std::vector<int> ids;
+				pose_tracker->GetIds(stamp, ids);
+				outputs.resize(ids.size());
+				for (size_t i=0; i<ids.size(); i++) {
+					outputs[i].id = ids[i];
+					pose_tracker->Get(ids[i], stamp, outputs[i].pose.translation, outputs[i].pose.quaternion, outputs[i].covariance);
+				}
+			}
 
 			arPoseMarkers_.markers.clear ();
-			for (size_t i=0; i<marker_detector.markers->size(); i++) 
+			for (size_t i=0; i<outputs.size(); i++) 
 			{
 				//Get the pose relative to the camera
-        		int id = (*(marker_detector.markers))[i].GetId(); 
-				Pose p = (*(marker_detector.markers))[i].pose;
+        		int id = outputs[i].id; 
+				Pose p = outputs[i].pose;
 				double px = p.translation[0]/100.0;
 				double py = p.translation[1]/100.0;
 				double pz = p.translation[2]/100.0;
@@ -195,6 +286,8 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
 			    ar_pose_marker.header.stamp = image_msg->header.stamp;
 			    ar_pose_marker.id = id;
 			    arPoseMarkers_.markers.push_back (ar_pose_marker);	
+
+				publishCovariance (id, tagPoseOutput, CamToOutput, outputs[i].covariance, ar_pose_marker.header);
 			}
 			arMarkerPub_.publish (arPoseMarkers_);
 		}
@@ -252,11 +345,38 @@ int main(int argc, char *argv[])
   if (argc > 7)
     pn.setParam("max_frequency", max_frequency);
 
+  // Optional per-marker Kalman filtering of the poses; the default zero timeout
+  // publishes the raw detections. The noises are in m/s^2 and rad/s^2, the tracker
+  // works in the centimeters of the detector.
+  double kalman_timeout, kalman_acceleration_noise, kalman_angular_acceleration_noise;
+  pn.param("kalman_timeout", kalman_timeout, 0.0);
+  pn.param("kalman_acceleration_noise", kalman_acceleration_noise, 2.0);
+  pn.param("kalman_angular_acceleration_noise", kalman_angular_acceleration_noise, 5.0);
+  if (kalman_timeout > 0)
+    pose_tracker = new PoseTracker(kalman_timeout, kalman_acceleration_noise*100.0, kalman_angular_acceleration_noise, 1.0, 0.02);
+
+  // Wide-angle lenses need the undistortion for fitting the marker edges; the grid
+  // step is in pixels and the map is rebuilt when the camera info arrives.
+  bool undistort;
+  int undistort_grid_step;
+  pn.param("undistort", undistort, false);
+  pn.param("undistort_grid_step", undistort_grid_step, 4);
+
 	cam = new Camera(n, cam_info_topic);
+	cam->SetUndistortion(undistort, undistort_grid_step);
 	tf_listener = new tf::TransformListener(n);
 	tf_broadcaster = new tf::TransformBroadcaster();
 	arMarkerPub_ = n.advertise < ar_track_alvar_msgs::AlvarMarkers > ("ar_pose_marker", 0);
 	rvizMarkerPub_ = n.advertise < visualization_msgs::Marker > ("visualization_marker", 0);
+
+  // The pose covariances are published only for the listed ids, each on its own topic
+  std::vector<int> covariance_ids;
+  pn.getParam("covariance_ids", covariance_ids);
+  for (size_t i=0; i<covariance_ids.size(); i++) {
+    std::stringstream topic;
+    topic << "ar_pose_marker_covariance/" << covariance_ids[i];
+    covarianceMarkerPubs_[covariance_ids[i]] = n.advertise < geometry_msgs::PoseWithCovarianceStamped > (topic.str(), 0);
+  }
 	
   // Prepare dynamic reconfiguration
   dynamic_reconfigure::Server < ar_track_alvar::ParamsConfig > server;
@@ -28,20 +28,69 @@ using namespace std;
 namespace alvar {
 using namespace std;
 
-int Bitset::Length() {
-	return bits.size();
+// The positions covered by the parity bits 1, 2, 4, ..., 64 when position i is stored in bit i-1
+static const uint64_t parity_masks[7] = {
+	0x5555555555555555ULL,
+	0x6666666666666666ULL,
+	0x7878787878787878ULL,
+	0x7f807f807f807f80ULL,
+	0x7fff80007fff8000ULL,
+	0x7fffffff80000000ULL,
+	0x8000000000000000ULL
+};
+
+// The xor of the positions of the set bits in the block
+static inline unsigned long Syndrome(uint64_t block) {
+	unsigned long syndrome = 0;
+	for (int k=0; k<7; k++) {
+		if (PopCount(block & parity_masks[k]) & 1) syndrome |= (1UL << k);
+	}
+	return syndrome;
+}
+
+Bitset::Bitset() : first(0), length(0) {}
+
+uint64_t Bitset::get_block(size_t pos, int count) const {
+	if (count <= 0) return 0;
+	size_t p = first + pos;
+	size_t w = p >> 6;
+	int o = (int)(p & 63);
+	uint64_t block = words[w] >> o;
+	if (o && (o + count > 64)) block |= words[w+1] << (64 - o);
+	if (count < 64) block &= (((uint64_t)1) << count) - 1;
+	return block;
+}
+
+void Bitset::push_block(uint64_t block, int count) {
+	if (count <= 0) return;
+	if (count < 64) block &= (((uint64_t)1) << count) - 1;
+	size_t p = first + length;
+	size_t w = p >> 6;
+	int o = (int)(p & 63);
+	size_t needed = (p + count + 63) >> 6;
+	if (words.size() < needed) words.resize(needed, 0);
+	// The bits after the sequence are always zero
+	words[w] |= block << o;
+	if (o && (o + count > 64)) words[w+1] |= block >> (64 - o);
+	length += count;
+}
+
+int Bitset::Length() const {
+	return (int)length;
 }
 ostream &Bitset::Output(ostream &os) const {
-	deque<bool>::const_iterator iter=bits.begin();
-	while (iter != bits.end()) {
-		if (*iter) os<<"1";
+	for (size_t i=0; i<length; i++) {
+		if (at(i)) os<<"1";
 		else os<<"0";
-		iter++;
 	}
 	return os;
 }
-void Bitset::clear() { bits.clear(); }
-void Bitset::push_back(const bool bit) { bits.push_back(bit); }
+void Bitset::clear() {
+	words.clear();
+	first = 0;
+	length = 0;
+}
+void Bitset::push_back(const bool bit) { push_block(bit ? 1 : 0, 1); }
 void Bitset::push_back(const unsigned char b, int bit_count /*=8*/) {
 	push_back((const unsigned long)b, bit_count);
 }
@@ -49,27 +98,29 @@ void Bitset::push_back(const unsigned short s, int bit_count /*=16*/) {
 	push_back((const unsigned long)s, bit_count);
 }
 void Bitset::push_back(const unsigned long l, int bit_count /*=32*/) {
-	unsigned long mask;
 	if ((bit_count > 32) || (bit_count == 0)) bit_count=32;
-	mask = 0x01<<(bit_count-1);
-	for (int i=0; i<bit_count; i++) {
-		if (l & mask) push_back(true);
-		else push_back(false);
-		mask>>=1;
+	for (int i=bit_count-1; i>=0; i--) {
+		push_block((l >> i) & 1, 1);
 	}
 }
 void Bitset::push_back_meaningful(const unsigned long l) {
 	int bit_count = 1;
 	for (int i=0; i<32; i++) {
-		unsigned long mask = 0x01<<i;
+		unsigned long mask = 1UL<<i;
 		if (l & mask) bit_count = i+1;
 	}
 	push_back(l, bit_count);
 }
 void Bitset::fill_zeros_left(size_t bit_count) {
-	while (bits.size() < bit_count) {
-		bits.push_front(false);
+	if (length >= bit_count) return;
+	size_t zeros = bit_count - length;
+	if (zeros > first) {
+		size_t extra_words = (zeros - first + 63) >> 6;
+		words.insert(words.begin(), extra_words, 0);
+		first += extra_words << 6;
 	}
+	first -= zeros;
+	length += zeros;
 }
 
 void Bitset::push_back(string s) {
@@ -82,19 +133,35 @@ void Bitset::push_back(string s) {
 }
 bool Bitset::pop_front()
 {
-	bool ret = bits.front();
-	bits.pop_front();	
+	bool ret = at(0);
+	words[first >> 6] &= ~(((uint64_t)1) << (first & 63));
+	first++;
+	length--;
+	if (length == 0) clear();
+	else if (first >= 64) {
+		words.erase(words.begin());
+		first -= 64;
+	}
 	return ret;
 }
 bool Bitset::pop_back()
 {
-	bool ret = bits.back();
-	bits.pop_back();	
+	size_t p = first + length - 1;
+	bool ret = at(length - 1);
+	words[p >> 6] &= ~(((uint64_t)1) << (p & 63));
+	length--;
 	return ret;
 }
 
 void Bitset::flip(size_t pos) {
-	bits[pos] = !bits[pos];
+	size_t p = first + pos;
+	words[p >> 6] ^= ((uint64_t)1) << (p & 63);
+}
+
+deque<bool> Bitset::GetBits() const {
+	deque<bool> bits;
+	for (size_t i=0; i<length; i++) bits.push_back(at(i));
+	return bits;
 }
 
 string Bitset::hex() 
@@ -102,17 +169,17 @@ string Bitset::hex()
 	stringstream ss;
 	ss.unsetf(std::ios_base::dec);
 	ss.setf(std::ios_base::hex);
-	unsigned long b=0;
-	int bitpos = (0x08 << (bits.size() % 4));
-	if (bitpos > 0x08) bitpos >>= 4;
-	for (size_t i=0; i < bits.size(); i++) {
-		if (bits[i]) b = b | bitpos;
-		else b = b & (0x0f ^ bitpos);
-		bitpos >>= 1;
-		if (bitpos == 0x00) {
-			bitpos = 0x08;
-			ss << b;
+	// The first digit holds the bits that do not fill a whole digit
+	int digit_bits = (int)(length % 4);
+	if (digit_bits == 0) digit_bits = 4;
+	size_t i = 0;
+	while (i < length) {
+		unsigned long b = 0;
+		for (int k=0; k<digit_bits; k++) {
+			b = (b << 1) | (at(i++) ? 1 : 0);
 		}
+		ss << b;
+		digit_bits = 4;
 	}
 	return ss.str();
 }
@@ -121,10 +188,10 @@ unsigned long Bitset::ulong()
 {
 	//if(bits.size() > (sizeof(unsigned long)*8))
 	//	throw "code too big for unsigned long\n";
-	stringstream ss;
-	ss << setbase(16) << hex();
-	unsigned long v;
-	ss >> v;
+	unsigned long v = 0;
+	for (size_t i=0; i<length; i++) {
+		v = (v << 1) | (at(i) ? 1 : 0);
+	}
 	return v;
 }
 
@@ -132,96 +199,91 @@ unsigned char Bitset::uchar()
 {
 	//if(bits.size() > (sizeof(unsigned char)*8))
 	//	throw "code too big for unsigned char\n";
-	stringstream ss;
-	ss << setbase(16) << hex();
-	unsigned long v; //ttehop: Note, that this cannot be char
-	ss >> v;
-	return (unsigned char)v;
+	return (unsigned char)ulong();
 }
 
-void BitsetExt::hamming_enc_block(unsigned long block_len, deque<bool>::iterator &iter) {
+void BitsetExt::hamming_enc_block(unsigned long block_len, size_t &pos, BitsetExt &enc) {
 	if (verbose) cout<<"hamming_enc_block: ";
+	uint64_t block = 0;
+	unsigned long syndrome = 0;
 	unsigned long next_parity=1;
 	for (unsigned long i=1; i<=block_len; i++) {
-		// Add a parity bit if this a place for such
+		// Leave a place for the parity bit
 		if (i == next_parity) {
 			if (verbose) cout<<"p";
 			next_parity <<= 1;
-			iter = bits.insert(iter, false);
-		} 
-		// Otherwise if this bit is 1 change all related parity bits
-		else {
-			if (iter == bits.end()) {
-				block_len = i-1;
-				break;
-			}
-			if (verbose) cout<<(*iter?1:0);
-			if (*iter) {
-				unsigned long parity = next_parity>>1;
-				while (parity) {
-					if (i & parity) {
-						deque<bool>::iterator parity_iter=(iter - (i - parity));
-						*parity_iter = !*parity_iter;
-					}
-					parity >>= 1;
-				}
-			}
+			continue;
+		}
+		if (pos >= length) {
+			block_len = i-1;
+			break;
+		}
+		bool bit = at(pos++);
+		if (verbose) cout<<(bit?1:0);
+		if (bit) {
+			block |= ((uint64_t)1) << (i-1);
+			syndrome ^= i;
 		}
-		iter++;
+	}
+	// Each parity bit makes the parity of the positions it covers even
+	for (unsigned long parity=1; parity<=block_len; parity<<=1) {
+		if (syndrome & parity) block |= ((uint64_t)1) << (parity-1);
 	}
 	// Update the last parity bit if we have one
 	// Note, that the last parity bit can safely be removed from the code if it is not desired...
 	if (block_len == (next_parity >> 1)) {
 		// If the last bit is parity bit - make parity over the previous data
-		for (unsigned long ii=1; ii<block_len; ii++) {
-			if (*(iter-ii-1)) *(iter-1) = !*(iter-1);
-		}
+		if (PopCount(block) & 1) block |= ((uint64_t)1) << (block_len-1);
 	}
+	enc.push_block(block, (int)block_len);
 	if (verbose) {
 		cout<<" -> ";
-		for (unsigned long ii=block_len; ii>=1; ii--) {
-			cout<<(*(iter-ii)?1:0);
+		for (unsigned long ii=1; ii<=block_len; ii++) {
+			cout<<((block >> (ii-1)) & 1);
 		}
 		cout<<" block_len: "<<block_len<<endl;
 	}
 }
-int BitsetExt::hamming_dec_block(unsigned long block_len, deque<bool>::iterator &iter) {
+int BitsetExt::hamming_dec_block(unsigned long block_len, size_t &pos, BitsetExt &dec) {
 	if (verbose) cout<<"hamming_dec_block: ";
-	bool potentially_double_error = false;
-	unsigned long total_parity=0;
-	unsigned long parity=0;
-	unsigned long next_parity=1;
-	for (unsigned long i=1; i<=block_len; i++) {
-		if (iter == bits.end()) {
-			// ttehop: 
-			// At 3.12.2009 I changed the following line because
-			// it crashed with 7x7 markers. However, I didn't fully
-			// understand the reason why it should be so. Lets
-			// give more thought to it when we have more time.
-			// old version: block_len = i-1;
-			block_len = i;
-			break;
-		}
-		if (*iter) {
-			parity = parity ^ i;
-			total_parity = total_parity ^ 1;
-		}
-		if (i == next_parity) {
-			if (verbose) cout<<"("<<*iter<<")";
-			next_parity <<= 1;
-			iter = bits.erase(iter);
-		} else {
-			if (verbose) cout<<*iter;
-			iter++;
+	unsigned long count = block_len;
+	if (count > length - pos) {
+		count = (unsigned long)(length - pos);
+		// ttehop: 
+		// At 3.12.2009 I changed the following line because
+		// it crashed with 7x7 markers. However, I didn't fully
+		// understand the reason why it should be so. Lets
+		// give more thought to it when we have more time.
+		// old version: block_len = i-1;
+		block_len = count+1;
+	}
+	uint64_t block = get_block(pos, (int)count);
+	pos += count;
+
+	// The data bits between the parity bits p and 2p are copied at once
+	unsigned long next_parity = 1;
+	while (next_parity <= count) next_parity <<= 1;
+	for (unsigned long parity=2; parity<count; parity<<=1) {
+		unsigned long last = (2*parity-1 < count ? 2*parity-1 : count);
+		dec.push_block(block >> parity, (int)(last - parity));
+	}
+	if (verbose) {
+		for (unsigned long i=1; i<=count; i++) {
+			bool bit = ((block >> (i-1)) & 1) != 0;
+			if ((i & (i-1)) == 0) cout<<"("<<bit<<")";
+			else cout<<bit;
 		}
 	}
+
 	if (block_len < 3)  {
 		if (verbose) cout<<" too short"<<endl;
 		return 0;
 	}
+	bool potentially_double_error = false;
+	unsigned long parity = Syndrome(block);
 	if (block_len == (next_parity >> 1)) {
 		parity = parity & ~(next_parity >> 1); // The last parity bit shouldn't be included in the other parity tests (TODO: Better solution)
-		if (total_parity == 0) {
+		if ((PopCount(block) & 1) == 0) {
 			potentially_double_error = true;
 		}
 	}
@@ -244,7 +306,12 @@ int BitsetExt::hamming_dec_block(unsigned long block_len, deque<bool>::iterator
 				steps++;
 			}
 		}
-		iter[-steps] = !iter[-steps];
+		if ((steps == 0) || ((size_t)steps > dec.length)) {
+			// The syndrome points past the end of the block, so this is not a single bit error
+			if (verbose) cout<<" uncorrectable"<<endl;
+			return -1;
+		}
+		dec.flip(dec.length - steps);
 		if (verbose) cout<<" corrected"<<endl;
 		return 1;
 	}
@@ -310,20 +377,28 @@ int BitsetExt::count_hamming_dec_len(int block_len, int enc_len) {
 	return enc_len - parity_len;
 }
 void BitsetExt::hamming_enc(int block_len) {
-	deque<bool>::iterator iter=bits.begin();
-	while (iter != bits.end()) {
-		hamming_enc_block(block_len, iter);
+	BitsetExt enc;
+	size_t pos = 0;
+	while (pos < length) {
+		hamming_enc_block(block_len, pos, enc);
 	}
+	words.swap(enc.words);
+	first = enc.first;
+	length = enc.length;
 }
 // Returns number of corrected errors (or -1 if there were unrecoverable error)
 int BitsetExt::hamming_dec(int block_len) {
+	BitsetExt dec;
 	int error_count=0;
-	deque<bool>::iterator iter=bits.begin();
-	while (iter != bits.end()) {
-		int error=hamming_dec_block(block_len, iter);
+	size_t pos = 0;
+	while (pos < length) {
+		int error=hamming_dec_block(block_len, pos, dec);
 		if ((error == -1) || (error_count == -1)) error_count=-1;
 		else error_count += error;
 	}
+	words.swap(dec.words);
+	first = dec.first;
+	length = dec.length;
 	return error_count;
 }
 
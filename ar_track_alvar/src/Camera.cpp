@@ -25,6 +25,7 @@
 #include "ar_track_alvar/Camera.h"
 #include "ar_track_alvar/FileFormatUtils.h"
 #include <memory>
+#include <cmath>
 
 using namespace std;
 
@@ -117,6 +118,8 @@ Camera::Camera() {
 	calib_y_res = 480;
 	x_res = 640;
 	y_res = 480;
+	undistort_enabled = false;
+	undistort_grid_step = 4;
 }
 
 
@@ -135,6 +138,8 @@ Camera::Camera(ros::NodeHandle & n, std::string cam_info_topic):n_(n)
 	calib_y_res = 480;
 	x_res = 640;
 	y_res = 480;
+	undistort_enabled = false;
+	undistort_grid_step = 4;
 	cameraInfoTopic_ = cam_info_topic;
 	ROS_INFO ("Subscribing to info topic");
     sub_ = n_.subscribe (cameraInfoTopic_, 1, &Camera::camInfoCallback, this);
@@ -171,6 +176,7 @@ void Camera::SetSimpleCalib(int _x_res, int _y_res, double f_fac)
 	calib_K_data[2][2] = 1;
 	calib_x_res = _x_res;
 	calib_y_res = _y_res;
+	UpdateDistortionMap();
 }
 
 bool Camera::LoadCalibXML(const char *calibfile) {
@@ -257,7 +263,9 @@ void Camera::camInfoCallback (const sensor_msgs::CameraInfoConstPtr & cam_info)
             cvmSet(&calib_D, 2, 0, 0);
             cvmSet(&calib_D, 3, 0, 0);
         }
-		  
+
+		// The lookup grids are built once for the received calibration
+		UpdateDistortionMap();
 		getCamInfo_ = true;
     }
   }
@@ -293,6 +301,7 @@ bool Camera::SetCalib(const char *calibfile, int _x_res, int _y_res, FILE_FORMAT
 			calib_K_data[1][1] *= (double(y_res)/double(calib_y_res));
 			calib_K_data[1][2] *= (double(y_res)/double(calib_y_res));
 		}
+		UpdateDistortionMap();
 	}
 	return success;
 }
@@ -361,6 +370,7 @@ void Camera::Calibrate(ProjPoints &pp)
 
 	calib_x_res = pp.width;
 	calib_y_res = pp.height;
+	UpdateDistortionMap();
 	
 	cvReleaseMat(&object_points);
 	cvReleaseMat(&image_points);
@@ -380,6 +390,7 @@ void Camera::SetRes(int _x_res, int _y_res) {
 		calib_K_data[1][1] *= (double(y_res)/double(calib_y_res));
 		calib_K_data[1][2] *= (double(y_res)/double(calib_y_res));
 	}
+	UpdateDistortionMap();
 }
 
 // TODO: Better approach for this...
@@ -418,304 +429,226 @@ void Camera::SetOpenglProjectionMatrix(double proj_matrix[16], const int width,
 	calib_K_data[0][2] = (-proj_matrix[8] + 1.0f) * float(width) / 2.0f; // Is this ok?
 	calib_K_data[1][2] = (proj_matrix[9] + 1.0f) * float(height) / 2.0f;
 	calib_K_data[2][2] = 1;
+	UpdateDistortionMap();
+}
+
+void Camera::SetUndistortion(bool _enable, int _grid_step) {
+	undistort_enabled = _enable;
+	undistort_grid_step = _grid_step;
+	UpdateDistortionMap();
+}
+
+void Camera::UpdateDistortionMap() {
+	if (undistort_enabled) distortion_map.Build(calib_K_data, calib_D_data, x_res, y_res, undistort_grid_step);
+	else distortion_map.Clear();
 }
 
 void Camera::Undistort(PointDouble &point)
 {
-/*
-	// focal length
-	double ifx = 1./cvmGet(&calib_K, 0, 0);
-	double ify = 1./cvmGet(&calib_K, 1, 1);
-
-	// principal point
-	double cx = cvmGet(&calib_K, 0, 2);
-	double cy = cvmGet(&calib_K, 1, 2);
-
-	// distortion coeffs
-	double* k = calib_D.data.db;
-
-	// compensate distortion iteratively
-	double x = (point.x - cx)*ifx, y = (point.y - cy)*ify, x0 = x, y0 = y;
-	for(int j = 0; j < 5; j++){
-		double r2 = x*x + y*y;
-		double icdist = 1./(1 + k[0]*r2 + k[1]*r2*r2);
-		double delta_x = 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
-		double delta_y = k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
-		x = (x0 - delta_x)*icdist;
-		y = (y0 - delta_y)*icdist;
-	}
-	// apply compensation
-	point.x = x/ifx + cx;
-	point.y = y/ify + cy;
-*/
+	distortion_map.Undistort(point.x, point.y);
 }
 
 void Camera::Undistort(vector<PointDouble >& points)
 {
-/*
-	// focal length
-	double ifx = 1./cvmGet(&calib_K, 0, 0);
-	double ify = 1./cvmGet(&calib_K, 1, 1);
-
-	// principal point
-	double cx = cvmGet(&calib_K, 0, 2);
-	double cy = cvmGet(&calib_K, 1, 2);
-
-	// distortion coeffs
-	double* k = calib_D.data.db;
-
-	for(unsigned int i = 0; i < points.size(); i++)
-	{
-		// compensate distortion iteratively
-		double x = (points[i].x - cx)*ifx, y = (points[i].y - cy)*ify, x0 = x, y0 = y;
-		for(int j = 0; j < 5; j++){
-			double r2 = x*x + y*y;
-			double icdist = 1./(1 + k[0]*r2 + k[1]*r2*r2);
-			double delta_x = 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
-			double delta_y = k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
-			x = (x0 - delta_x)*icdist;
-			y = (y0 - delta_y)*icdist;
-		}
-		// apply compensation
-		points[i].x = x/ifx + cx;
-		points[i].y = y/ify + cy;
-	}
-*/
+	if (!points.empty()) distortion_map.Undistort(&points[0], (int)points.size());
 }
 
 void Camera::Undistort(CvPoint2D32f& point)
 {
-/*
-	// focal length
-	double ifx = 1./cvmGet(&calib_K, 0, 0);
-	double ify = 1./cvmGet(&calib_K, 1, 1);
-
-	// principal point
-	double cx = cvmGet(&calib_K, 0, 2);
-	double cy = cvmGet(&calib_K, 1, 2);
-
-	// distortion coeffs
-	double* k = calib_D.data.db;
-
-
-	// compensate distortion iteratively
-	double x = (point.x - cx)*ifx, y = (point.y - cy)*ify, x0 = x, y0 = y;
-	for(int j = 0; j < 5; j++){
-		double r2 = x*x + y*y;
-		double icdist = 1./(1 + k[0]*r2 + k[1]*r2*r2);
-		double delta_x = 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
-		double delta_y = k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
-		x = (x0 - delta_x)*icdist;
-		y = (y0 - delta_y)*icdist;
-	}
-	// apply compensation
-	point.x = float(x/ifx + cx);
-	point.y = float(y/ify + cy);
-*/
+	distortion_map.Undistort(&point, 1);
 }
 
-/*
-	template<class PointType>
-	void Undistort(PointType& point) {
-		// focal length
-		double ifx = 1./cvmGet(&calib_K, 0, 0);
-		double ify = 1./cvmGet(&calib_K, 1, 1);
-
-		// principal point
-		double cx = cvmGet(&calib_K, 0, 2);
-		double cy = cvmGet(&calib_K, 1, 2);
-
-		// distortion coeffs
-		double* k = calib_D.data.db;
-
-		// compensate distortion iteratively
-		double x = (point.x - cx)*ifx, y = (point.y - cy)*ify, x0 = x, y0 = y;
-		for(int j = 0; j < 5; j++){
-			double r2 = x*x + y*y;
-			double icdist = 1./(1 + k[0]*r2 + k[1]*r2*r2);
-			double delta_x = 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
-			double delta_y = k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
-			x = (x0 - delta_x)*icdist;
-			y = (y0 - delta_y)*icdist;
-		}
-		// apply compensation
-		point.x = x/ifx + cx;
-		point.y = y/ify + cy;
-	}
-*/
+void Camera::Undistort(CvPoint2D32f *points, int count)
+{
+	distortion_map.Undistort(points, count);
+}
 
-void Camera::Distort(vector<PointDouble>& points) 
+void Camera::Undistort(PointDouble *points, int count)
 {
-/*
-	double u0 = cvmGet(&calib_K, 0, 2), v0 = cvmGet(&calib_K, 1, 2); // cx, cy
-	double fx = cvmGet(&calib_K, 0, 0), fy = cvmGet(&calib_K, 1, 1);
-	double _fx = 1./fx, _fy = 1./fy;
-	double* k = calib_D.data.db;
+	distortion_map.Undistort(points, count);
+}
 
-	double k1 = k[0], k2 = k[1];
-	double p1 = k[2], p2 = k[3];
+void Camera::Distort(vector<PointDouble>& points) 
+{
+	if (!points.empty()) distortion_map.Distort(&points[0], (int)points.size());
+}
 
-	for(unsigned int i = 0; i < points.size(); i++)
-	{
-		// Distort
-		double y = (points[i].y - v0)*_fy;
-		double y2 = y*y;
-		double _2p1y = 2*p1*y;
-		double _3p1y2 = 3*p1*y2;
-		double p2y2 = p2*y2;
-
-		double x = (points[i].x - u0)*_fx;
-		double x2 = x*x;
-		double r2 = x2 + y2;
-		double d = 1 + (k1 + k2*r2)*r2;
-
-		points[i].x = fx*(x*(d + _2p1y) + p2y2 + (3*p2)*x2) + u0;
-		points[i].y = fy*(y*(d + (2*p2)*x) + _3p1y2 + p1*x2) + v0;
-	}
-*/
+void Camera::Distort(PointDouble *points, int count)
+{
+	distortion_map.Distort(points, count);
 }
 
 void Camera::Distort(PointDouble & point) 
 {
-/*
-	double u0 = cvmGet(&calib_K, 0, 2), v0 = cvmGet(&calib_K, 1, 2); // cx, cy
-	double fx = cvmGet(&calib_K, 0, 0), fy = cvmGet(&calib_K, 1, 1);
-	double _fx = 1./fx, _fy = 1./fy;
-	double* k = calib_D.data.db;
-
-	double k1 = k[0], k2 = k[1];
-	double p1 = k[2], p2 = k[3];
-
-	// Distort
-	double y = (point.y - v0)*_fy;
-	double y2 = y*y;
-	double _2p1y = 2*p1*y;
-	double _3p1y2 = 3*p1*y2;
-	double p2y2 = p2*y2;
-
-	double x = (point.x - u0)*_fx;
-	double x2 = x*x;
-	double r2 = x2 + y2;
-	double d = 1 + (k1 + k2*r2)*r2;
-
-	point.x = fx*(x*(d + _2p1y) + p2y2 + (3*p2)*x2) + u0;
-	point.y = fy*(y*(d + (2*p2)*x) + _3p1y2 + p1*x2) + v0;
-*/
+	distortion_map.Distort(point.x, point.y);
 }
 
 void Camera::Distort(CvPoint2D32f & point) 
 {
-/*
-	double u0 = cvmGet(&calib_K, 0, 2), v0 = cvmGet(&calib_K, 1, 2); // cx, cy
-	double fx = cvmGet(&calib_K, 0, 0), fy = cvmGet(&calib_K, 1, 1);
-	double _fx = 1./fx, _fy = 1./fy;
-	double* k = calib_D.data.db;
-
-	double k1 = k[0], k2 = k[1];
-	double p1 = k[2], p2 = k[3];
-
-	// Distort
-	double y = (point.y - v0)*_fy;
-	double y2 = y*y;
-	double _2p1y = 2*p1*y;
-	double _3p1y2 = 3*p1*y2;
-	double p2y2 = p2*y2;
-
-	double x = (point.x - u0)*_fx;
-	double x2 = x*x;
-	double r2 = x2 + y2;
-	double d = 1 + (k1 + k2*r2)*r2;
-
-	point.x = float(fx*(x*(d + _2p1y) + p2y2 + (3*p2)*x2) + u0);
-	point.y = float(fy*(y*(d + (2*p2)*x) + _3p1y2 + p1*x2) + v0);
-*/
+	if (distortion_map.IsEmpty()) return;
+	double x = point.x, y = point.y;
+	distortion_map.Distort(x, y);
+	point.x = float(x);
+	point.y = float(y);
 }
 
 void Camera::CalcExteriorOrientation(vector<CvPoint3D64f>& pw, vector<CvPoint2D64f>& pi,
 					Pose *pose)
 {
-	double ext_rodriques[3];
-	double ext_translate[3];
-	CvMat ext_rodriques_mat = cvMat(3, 1, CV_64F, ext_rodriques);
-	CvMat ext_translate_mat = cvMat(3, 1, CV_64F, ext_translate);
-	CvMat *object_points = cvCreateMat((int)pw.size(), 1, CV_32FC3);
-	CvMat *image_points = cvCreateMat((int)pi.size(), 1, CV_32FC2);
-	for (size_t i=0; i<pw.size(); i++) {
-		object_points->data.fl[i*3+0] = (float)pw[i].x;
-		object_points->data.fl[i*3+1] = (float)pw[i].y;
-		object_points->data.fl[i*3+2] = (float)pw[i].z;
-		image_points->data.fl[i*2+0]  = (float)pi[i].x;
-		image_points->data.fl[i*2+1]  = (float)pi[i].y;
-	}
-	//cvFindExtrinsicCameraParams2(object_points, image_points, &calib_K, &calib_D, &ext_rodriques_mat, &ext_translate_mat);
-	cvFindExtrinsicCameraParams2(object_points, image_points, &calib_K, NULL, &ext_rodriques_mat, &ext_translate_mat);
-    pose->SetRodriques(&ext_rodriques_mat);
-	pose->SetTranslation(&ext_translate_mat);
-	cvReleaseMat(&object_points);
-	cvReleaseMat(&image_points);
+	if (pi.empty()) return;
+	CalcExteriorOrientation(&pw[0], &pi[0], (int)pi.size(), pose, false);
 }
 
 void Camera::CalcExteriorOrientation(vector<CvPoint3D64f>& pw, vector<PointDouble >& pi,
 					CvMat *rodriques, CvMat *tra)
 {
 	//assert(pw.size() == pi.size());
+	if (pi.empty()) return;
+	CalcExteriorOrientation(&pw[0], &pi[0], (int)pi.size(), rodriques, tra);
+}
 
-	int size = (int)pi.size();
+void Camera::CalcExteriorOrientation(vector<PointDouble >& pw, vector<PointDouble >& pi,
+					CvMat *rodriques, CvMat *tra)
+{
+	//assert(pw.size() == pi.size());
+	if (pi.empty()) return;
+	CalcExteriorOrientation(&pw[0], &pi[0], (int)pi.size(), rodriques, tra);
+}
+
+void Camera::CalcExteriorOrientation(vector<PointDouble>& pw, vector<PointDouble >& pi, Pose *pose)
+{
+	if (pi.empty()) return;
+	CalcExteriorOrientation(&pw[0], &pi[0], (int)pi.size(), pose);
+}
 
-	CvPoint3D64f *world_pts = new CvPoint3D64f[size];
-	CvPoint2D64f *image_pts = new CvPoint2D64f[size];
-
-	for(int i = 0; i < size; i++){
-		world_pts[i].x = pw[i].x;
-		world_pts[i].y = pw[i].y;
-		world_pts[i].z = pw[i].z;
-		// flip image points! Why???
-		//image_pts[i].x = x_res - pi[i].x;
-		//image_pts[i].y = y_res - pi[i].y;
-		image_pts[i].x = pi[i].x;
-		image_pts[i].y = pi[i].y;
+// Sets the pose from a row-major rotation and a translation
+static void SetPlanarPose(Pose *pose, const double rot[9], const double tra[3]) {
+	double mat[16] = {
+		rot[0], rot[1], rot[2], tra[0],
+		rot[3], rot[4], rot[5], tra[1],
+		rot[6], rot[7], rot[8], tra[2],
+		0, 0, 0, 1
+	};
+	CvMat mat_mat = cvMat(4, 4, CV_64F, mat);
+	pose->SetMatrix(&mat_mat);
+}
+
+// Gets the row-major rotation and the translation of the pose
+static void GetPlanarPose(Pose *pose, double rot[9], double tra[3]) {
+	double mat[16];
+	CvMat mat_mat = cvMat(4, 4, CV_64F, mat);
+	pose->GetMatrix(&mat_mat);
+	for (int i=0; i<3; i++) {
+		for (int j=0; j<3; j++) rot[i*3+j] = mat[i*4+j];
+		tra[i] = mat[i*4+3];
 	}
+}
 
-	double rot[3]; // rotation vector
-	CvMat world_mat, image_mat, rot_vec;
-	cvInitMatHeader(&world_mat, size, 1, CV_64FC3, world_pts);
-	cvInitMatHeader(&image_mat, size, 1, CV_64FC2, image_pts);
-	cvInitMatHeader(&rot_vec, 3, 1, CV_64FC1, rot);
+int Camera::NormalizePlanarPoints(const vector<PointDouble>& pw, const vector<PointDouble>& pi,
+					double *model, double *image) const
+{
+	int size = (int)pi.size();
+	if ((size < 4) || (pw.size() != pi.size()) || (size > PlanarPose::MAX_POINTS)) return 0;
 
-	cvZero(tra);
-	//cvmodFindExtrinsicCameraParams2(&world_mat, &image_mat, &calib_K, &calib_D, rodriques, tra, error);
-	cvFindExtrinsicCameraParams2(&world_mat, &image_mat, &calib_K, &calib_D, rodriques, tra);
-	
-	delete[] world_pts;
-	delete[] image_pts;
+	// The points on normalized image plane without the lens distortion, pi are raw image coordinates
+	double fx = calib_K_data[0][0], fy = calib_K_data[1][1];
+	double skew = calib_K_data[0][1], cx = calib_K_data[0][2], cy = calib_K_data[1][2];
+	bool distortion = (calib_D_data[0] != 0) || (calib_D_data[1] != 0) || (calib_D_data[2] != 0) || (calib_D_data[3] != 0);
+	for (int i=0; i<size; i++) {
+		model[2*i] = pw[i].x;
+		model[2*i+1] = pw[i].y;
+		double y = (pi[i].y - cy)/fy;
+		double x = (pi[i].x - cx - skew*y)/fx;
+		if (distortion) DistortionMap::UndistortNormalized(calib_D_data, x, y);
+		image[2*i] = x;
+		image[2*i+1] = y;
+	}
+	return size;
 }
 
-void Camera::CalcExteriorOrientation(vector<PointDouble >& pw, vector<PointDouble >& pi,
-					CvMat *rodriques, CvMat *tra)
+double Camera::PlanarReprojectionError(const double *model, const vector<PointDouble>& pi,
+					const double rot[9], const double tra[3]) const
 {
-	//assert(pw.size() == pi.size());
+	// The reprojection error in pixels with the lens distortion
 	int size = (int)pi.size();
-
-	vector<CvPoint3D64f> pw3;
-	pw3.resize(size);
+	double fx = calib_K_data[0][0], fy = calib_K_data[1][1];
+	double skew = calib_K_data[0][1], cx = calib_K_data[0][2], cy = calib_K_data[1][2];
+	bool distortion = (calib_D_data[0] != 0) || (calib_D_data[1] != 0) || (calib_D_data[2] != 0) || (calib_D_data[3] != 0);
+	double sum = 0;
 	for (int i=0; i<size; i++) {
-		pw3[i].x = pw[i].x;
-		pw3[i].y = pw[i].y;
-		pw3[i].z = 0;
+		double X = model[2*i], Y = model[2*i+1];
+		double Z = rot[6]*X + rot[7]*Y + tra[2];
+		double x = (rot[0]*X + rot[1]*Y + tra[0])/Z;
+		double y = (rot[3]*X + rot[4]*Y + tra[1])/Z;
+		if (distortion) DistortionMap::DistortNormalized(calib_D_data, x, y);
+		double dx = fx*x + skew*y + cx - pi[i].x;
+		double dy = fy*y + cy - pi[i].y;
+		sum += dx*dx + dy*dy;
 	}
+	return sqrt(sum/size);
+}
 
-	CalcExteriorOrientation(pw3, pi, rodriques, tra);
+bool Camera::CalcExteriorOrientationPlanar(const vector<PointDouble>& pw, const vector<PointDouble>& pi,
+					Pose *pose, double *error, Pose *pose2, double *error2)
+{
+	double model[2*PlanarPose::MAX_POINTS], image[2*PlanarPose::MAX_POINTS];
+	int size = NormalizePlanarPoints(pw, pi, model, image);
+	if (size == 0) return false;
+
+	double rot[2][9], tra[2][3], sq_error[2];
+	int n = PlanarPose::Solve(model, image, size, rot, tra, sq_error);
+	if (n == 0) return false;
+
+	for (int k=0; k<n; k++) {
+		Pose *p = (k == 0 ? pose : pose2);
+		double *e = (k == 0 ? error : error2);
+		if (p) SetPlanarPose(p, rot[k], tra[k]);
+		if (e) *e = PlanarReprojectionError(model, pi, rot[k], tra[k]);
+	}
+	if ((n == 1) && error2) *error2 = -1;
+	return true;
 }
 
-void Camera::CalcExteriorOrientation(vector<PointDouble>& pw, vector<PointDouble >& pi, Pose *pose)
+bool Camera::RefineExteriorOrientationPlanar(const vector<PointDouble>& pw, const vector<PointDouble>& pi,
+					Pose *pose, double *error, int iterations)
 {
-	double ext_rodriques[3];
-	double ext_translate[3];
-	CvMat ext_rodriques_mat = cvMat(3, 1, CV_64F, ext_rodriques);
-	CvMat ext_translate_mat = cvMat(3, 1, CV_64F, ext_translate);
-	CalcExteriorOrientation(pw, pi, &ext_rodriques_mat, &ext_translate_mat);
-	pose->SetRodriques(&ext_rodriques_mat);
-	pose->SetTranslation(&ext_translate_mat);
+	double model[2*PlanarPose::MAX_POINTS], image[2*PlanarPose::MAX_POINTS];
+	int size = NormalizePlanarPoints(pw, pi, model, image);
+	if (size == 0) return false;
+
+	double rot[9], tra[3];
+	GetPlanarPose(pose, rot, tra);
+	// The previous pose must have the target in front of the camera
+	if (tra[2] <= 0) return false;
+
+	double sq_error = PlanarPose::Refine(model, image, size, rot, tra, iterations);
+	if (!(sq_error < HUGE_VAL)) return false;
+
+	SetPlanarPose(pose, rot, tra);
+	if (error) *error = PlanarReprojectionError(model, pi, rot, tra);
+	return true;
+}
+
+bool Camera::CalcExteriorOrientationCovariance(const vector<PointDouble>& pw, const vector<PointDouble>& pi,
+					Pose *pose, double cov[36], double min_sigma)
+{
+	double model[2*PlanarPose::MAX_POINTS], image[2*PlanarPose::MAX_POINTS];
+	int size = NormalizePlanarPoints(pw, pi, model, image);
+	if (size == 0) return false;
+	double rot[9], tra[3];
+	GetPlanarPose(pose, rot, tra);
+
+	// The image noise is estimated from the residual of the 2n coordinates and six parameters,
+	// but not below min_sigma pixels
+	double variance = min_sigma*min_sigma;
+	if (size > 3) {
+		double rms = PlanarReprojectionError(model, pi, rot, tra);
+		double residual = rms*rms*size/(2*(size - 3));
+		if (residual > variance) variance = residual;
+	}
+	// From pixels to normalized image plane
+	variance /= calib_K_data[0][0]*calib_K_data[1][1];
+	return PlanarPose::Covariance(model, size, rot, tra, variance, cov);
 }
 
 bool Camera::CalcExteriorOrientation(const CvMat* object_points, CvMat* image_points, CvMat *rodriques, CvMat *tra) {
@@ -830,10 +763,95 @@ Homography::Homography() {
 	cvInitMatHeader(&H, 3, 3, CV_64F, H_data);
 }
 
+// The relative size below which a quantity is taken to be zero after cancellation
+static const double DEGENERATE_EPSILON = 1e-10;
+
+// Is the 3x3 matrix h singular compared to the lengths of its columns (see Hadamard's inequality)
+static bool IsSingular(const double h[9]) {
+	double det = h[0]*(h[4]*h[8] - h[5]*h[7]) - h[1]*(h[3]*h[8] - h[5]*h[6]) + h[2]*(h[3]*h[7] - h[4]*h[6]);
+	double bound = 1;
+	for (int j=0; j<3; j++) bound *= sqrt(h[j]*h[j] + h[3+j]*h[3+j] + h[6+j]*h[6+j]);
+	return !(fabs(det) > DEGENERATE_EPSILON*bound);
+}
+
+// The homography from the unit square (0,0), (1,0), (1,1), (0,1) to the quad q. The quad is first
+// moved to its centroid (n[0], n[1]) and scaled by 1/n[2], so that the thresholds do not depend on
+// where the quad is or how large it is.
+static bool SquareToQuad(const PointDouble q_in[4], double h[9], double n[3]) {
+	n[0] = (q_in[0].x + q_in[1].x + q_in[2].x + q_in[3].x)/4;
+	n[1] = (q_in[0].y + q_in[1].y + q_in[2].y + q_in[3].y)/4;
+	n[2] = 0;
+	for (int i=0; i<4; i++) n[2] = max(n[2], max(fabs(q_in[i].x - n[0]), fabs(q_in[i].y - n[1])));
+	if (!(n[2] > 0)) return false;
+	PointDouble q[4];
+	for (int i=0; i<4; i++) {
+		q[i].x = (q_in[i].x - n[0])/n[2];
+		q[i].y = (q_in[i].y - n[1])/n[2];
+	}
+
+	double dx1 = q[1].x - q[2].x, dx2 = q[3].x - q[2].x;
+	double dy1 = q[1].y - q[2].y, dy2 = q[3].y - q[2].y;
+	double sx = q[0].x - q[1].x + q[2].x - q[3].x;
+	double sy = q[0].y - q[1].y + q[2].y - q[3].y;
+	double g = 0, hh = 0;
+	if ((sx != 0) || (sy != 0)) {
+		// The edges at q[2] are (nearly) parallel if den is small compared to their lengths
+		double den = dx1*dy2 - dx2*dy1;
+		if (!(fabs(den) > DEGENERATE_EPSILON*sqrt((dx1*dx1 + dy1*dy1)*(dx2*dx2 + dy2*dy2)))) return false;
+		g = (sx*dy2 - dx2*sy)/den;
+		hh = (dx1*sy - sx*dy1)/den;
+	}
+	h[0] = q[1].x - q[0].x + g*q[1].x;
+	h[1] = q[3].x - q[0].x + hh*q[3].x;
+	h[2] = q[0].x;
+	h[3] = q[1].y - q[0].y + g*q[1].y;
+	h[4] = q[3].y - q[0].y + hh*q[3].y;
+	h[5] = q[0].y;
+	h[6] = g;
+	h[7] = hh;
+	h[8] = 1;
+	return !IsSingular(h);
+}
+
+bool Homography::Find(const PointDouble pw[4], const PointDouble pi[4])
+{
+	double a[9], b[9], na[3], nb[3];
+	if (!SquareToQuad(pw, a, na) || !SquareToQuad(pi, b, nb)) return false;
+
+	// The inverse of a up to scale is its adjugate
+	double inv[9] = {
+		a[4]*a[8] - a[5]*a[7], a[2]*a[7] - a[1]*a[8], a[1]*a[5] - a[2]*a[4],
+		a[5]*a[6] - a[3]*a[8], a[0]*a[8] - a[2]*a[6], a[2]*a[3] - a[0]*a[5],
+		a[3]*a[7] - a[4]*a[6], a[1]*a[6] - a[0]*a[7], a[0]*a[4] - a[1]*a[3]
+	};
+	double h[9];
+	for (int i=0; i<3; i++) {
+		for (int j=0; j<3; j++) {
+			h[i*3+j] = b[i*3+0]*inv[0*3+j] + b[i*3+1]*inv[1*3+j] + b[i*3+2]*inv[2*3+j];
+		}
+	}
+	if (IsSingular(h)) return false;
+
+	// Undo the normalizations: the points of pw are normalized before h and the result is scaled back to pi
+	for (int i=0; i<3; i++) {
+		h[i*3+2] -= (na[0]*h[i*3+0] + na[1]*h[i*3+1])/na[2];
+		h[i*3+0] /= na[2];
+		h[i*3+1] /= na[2];
+	}
+	for (int j=0; j<3; j++) {
+		h[0*3+j] = nb[2]*h[0*3+j] + nb[0]*h[2*3+j];
+		h[1*3+j] = nb[2]*h[1*3+j] + nb[1]*h[2*3+j];
+	}
+	if (h[8] == 0) return false;
+	for (int i=0; i<9; i++) H_data[i/3][i%3] = h[i]/h[8];
+	return true;
+}
+
 void Homography::Find(const vector<PointDouble  >& pw, const vector<PointDouble  >& pi)
 {
 	assert(pw.size() == pi.size());
 	int size = (int)pi.size();
+	if ((size == 4) && Find(&pw[0], &pi[0])) return;
 
 	CvPoint2D64f *srcp = new CvPoint2D64f[size];
 	CvPoint2D64f *dstp = new CvPoint2D64f[size];
@@ -894,4 +912,17 @@ void Homography::ProjectPoints(const vector<PointDouble>& from, vector<PointDoub
 	delete[] dstp;
 }
 
+void Homography::ProjectPoints(const PointDouble *from, PointDouble *to, int count) const
+{
+	const double *h = &H_data[0][0];
+	for(int i = 0; i < count; ++i)
+	{
+		double x = from[i].x;
+		double y = from[i].y;
+		double w = 1.0/(h[6]*x + h[7]*y + h[8]);
+		to[i].x = (h[0]*x + h[1]*y + h[2])*w;
+		to[i].y = (h[3]*x + h[4]*y + h[5])*w;
+	}
+}
+
 } // namespace alvar
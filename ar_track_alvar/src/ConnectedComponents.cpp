@@ -23,7 +23,12 @@
 
 #include "ar_track_alvar/ConnectedComponents.h"
 #include "ar_track_alvar/Draw.h"
+#include "ar_track_alvar/WorkerPool.h"
 #include <cassert>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -33,34 +38,299 @@ using namespace std;
 Labeling::Labeling()
 {
 	gray = 0;
+	gray_buffer = 0;
 	bw	 = 0;
 	cam  = 0;
 	thresh_param1 = 31;
 	thresh_param2 = 5;
+	thresh_method = ADAPT;
+	pixel_format = PIXEL_AUTO;
+	detect_pose_grayscale = false;
 }
 
 Labeling::~Labeling()
 {
-	if(gray)
-		cvReleaseImage(&gray);
+	if(gray_buffer)
+		cvReleaseImage(&gray_buffer);
 	if(bw)
 		cvReleaseImage(&bw);
 }
 
+// Image header for the rect inside img, sharing the pixel data of img
+static IplImage* SubImageHeader(IplImage* img, CvRect rect, IplImage* header)
+{
+	cvInitImageHeader(header, cvSize(rect.width, rect.height), img->depth, img->nChannels, img->origin);
+	header->widthStep = img->widthStep;
+	header->imageSize = img->widthStep*rect.height;
+	header->imageData = img->imageData + rect.y*img->widthStep + rect.x*img->nChannels*((img->depth & 255)/8);
+	header->imageDataOrigin = header->imageData;
+	return header;
+}
+
+static void ConvertColor(IplImage* src, IplImage* dst)
+{
+	if(src->nChannels == 4)
+		cvCvtColor(src, dst, CV_RGBA2GRAY);
+	else if(src->nChannels == 3)
+		cvCvtColor(src, dst, CV_RGB2GRAY);
+	else if(src->nChannels == 1)
+		cvCopy(src, dst);
+	else {
+		cerr<<"Unsupported image format"<<endl;
+	}
+}
+
+// The luma of the packed UYVY pixels is every second byte
+static void ExtractLuma(IplImage* src, IplImage* dst)
+{
+	for (int y=0; y<src->height; y++) {
+		const unsigned char *s = (const unsigned char *)(src->imageData + y*src->widthStep) + 1;
+		unsigned char *d = (unsigned char *)(dst->imageData + y*dst->widthStep);
+		for (int x=0; x<src->width; x++) d[x] = s[2*x];
+	}
+}
+
+// Takes the green channel of the Bayer image inside rect. On the red and blue sites the green
+// is the average of the four neighbours, which are mirrored at the image border.
+static void DemosaicGreen(IplImage* src, IplImage* dst, CvRect rect, bool green_odd)
+{
+	int width = src->width, height = src->height;
+	if ((width < 2) || (height < 2)) {
+		IplImage src_header, dst_header;
+		cvCopy(SubImageHeader(src, rect, &src_header), SubImageHeader(dst, rect, &dst_header));
+		return;
+	}
+	for (int y=rect.y; y<rect.y+rect.height; y++) {
+		const unsigned char *row = (const unsigned char *)(src->imageData + y*src->widthStep);
+		const unsigned char *up = (const unsigned char *)(src->imageData + (y > 0 ? y-1 : y+1)*src->widthStep);
+		const unsigned char *down = (const unsigned char *)(src->imageData + (y < height-1 ? y+1 : y-1)*src->widthStep);
+		unsigned char *d = (unsigned char *)(dst->imageData + y*dst->widthStep);
+		for (int x=rect.x; x<rect.x+rect.width; x++) {
+			if (((x+y)&1) == (green_odd ? 1 : 0)) {
+				d[x] = row[x];
+			} else {
+				int left = (x > 0 ? x-1 : x+1);
+				int right = (x < width-1 ? x+1 : x-1);
+				d[x] = (unsigned char)((row[left] + row[right] + up[x] + down[x] + 2) >> 2);
+			}
+		}
+	}
+}
+
+bool Labeling::WrapsGray(IplImage* image)
+{
+	if ((image->depth != IPL_DEPTH_8U) || (image->nChannels != 1)) return false;
+	return (pixel_format == PIXEL_MONO8);
+}
+
+void Labeling::AllocateImages(IplImage* image)
+{
+	if (bw && ((bw->width != image->width) || (bw->height != image->height))) {
+		cvReleaseImage(&bw); bw=NULL;
+		if (gray_buffer) cvReleaseImage(&gray_buffer); gray_buffer=NULL;
+	}
+	if (bw == NULL) {
+		bw = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
+		bw->origin = image->origin;
+	}
+
+	// The 8-bit mono images are used as such when PIXEL_MONO8 is selected
+	if (WrapsGray(image)) {
+		gray = image;
+		return;
+	}
+	if (gray_buffer == NULL) {
+		gray_buffer = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
+		gray_buffer->origin = image->origin;
+	}
+	gray = gray_buffer;
+}
+
+void Labeling::ConvertGray(IplImage* image, CvRect rect)
+{
+	if (gray == image) return;
+
+	IplImage image_header, gray_header;
+	switch (pixel_format)
+	{
+		case PIXEL_YUV422 :
+			ExtractLuma(SubImageHeader(image, rect, &image_header), SubImageHeader(gray, rect, &gray_header));
+			break;
+		case PIXEL_BAYER_RGGB :
+		case PIXEL_BAYER_BGGR :
+			DemosaicGreen(image, gray, rect, true);
+			break;
+		case PIXEL_BAYER_GBRG :
+		case PIXEL_BAYER_GRBG :
+			DemosaicGreen(image, gray, rect, false);
+			break;
+		default :
+			ConvertColor(SubImageHeader(image, rect, &image_header), SubImageHeader(gray, rect, &gray_header));
+			break;
+	}
+}
+
+void Labeling::PrepareGray(IplImage* image, const CvRect* rect)
+{
+	AllocateImages(image);
+
+	// Convert grayscale
+	ConvertGray(image, rect ? *rect : cvRect(0, 0, image->width, image->height));
+}
+
+void Labeling::UpdateGray(IplImage* image)
+{
+	PrepareGray(image);
+	blob_corners.clear();
+}
+
+void Labeling::GetLabelingRegions(int width, int height, vector<CvRect> &rects)
+{
+	// With this padding the threshold window of every pixel near a square stays inside the region
+	int pad = thresh_param1/2+2;
+	rects.clear();
+	for (size_t i=0; i<regions.size(); i++) {
+		int x0 = max(regions[i].x-pad, 0);
+		int y0 = max(regions[i].y-pad, 0);
+		int x1 = min(regions[i].x+regions[i].width+pad, width);
+		int y1 = min(regions[i].y+regions[i].height+pad, height);
+		if ((x1-x0 < 3) || (y1-y0 < 3)) continue;
+		rects.push_back(cvRect(x0, y0, x1-x0, y1-y0));
+	}
+
+	// Merge the overlapping regions until there is nothing to merge
+	bool merged = true;
+	while (merged) {
+		merged = false;
+		for (size_t i=0; i<rects.size() && !merged; i++) {
+			for (size_t j=i+1; j<rects.size() && !merged; j++) {
+				CvRect &a = rects[i], &b = rects[j];
+				if ((a.x < b.x+b.width) && (b.x < a.x+a.width) &&
+					(a.y < b.y+b.height) && (b.y < a.y+a.height))
+				{
+					int x0 = min(a.x, b.x), y0 = min(a.y, b.y);
+					int x1 = max(a.x+a.width, b.x+b.width), y1 = max(a.y+a.height, b.y+b.height);
+					a = cvRect(x0, y0, x1-x0, y1-y0);
+					rects.erase(rects.begin()+j);
+					merged = true;
+				}
+			}
+		}
+	}
+}
+
+void Labeling::Threshold()
+{
+	Threshold(gray, bw, thresh_param1);
+}
+
+void Labeling::Threshold(IplImage* src, IplImage* dst, int block_size)
+{
+	Threshold(src, dst, block_size, integral_threshold);
+}
+
+void Labeling::Threshold(IplImage* src, IplImage* dst, int block_size, IntegralThreshold &integral)
+{
+	switch (thresh_method)
+	{
+		case ADAPT_INTEGRAL :
+			integral.Threshold(src, dst, block_size, thresh_param2);
+			break;
+		case ADAPT :
+		default :
+			cvAdaptiveThreshold(src, dst, 255, CV_ADAPTIVE_THRESH_MEAN_C, CV_THRESH_BINARY_INV, block_size, thresh_param2);
+			break;
+	}
+}
+
+static void VisualizeCorners(IplImage* image, const vector<PointDouble> &corners)
+{
+	static const CvScalar colors[4] = {CV_RGB(255, 255, 255), CV_RGB(255, 0, 0), CV_RGB(0, 255, 0), CV_RGB(0, 0, 255)};
+	for(size_t j = 0; j < 4; ++j) {
+		const PointDouble &intc = corners[j];
+		cvCircle(image, cvPoint(int(intc.x), int(intc.y)), 5, colors[j]);
+	}
+}
+
 bool Labeling::CheckBorder(CvSeq* contour, int width, int height)
+{
+	return CheckBorder(contour, cvRect(0, 0, width, height));
+}
+
+bool Labeling::CheckBorder(CvSeq* contour, CvRect rect)
 {
 	bool ret = true;
 	for(int i = 0; i < contour->total; ++i)
 	{
 		CvPoint* pt = (CvPoint*)cvGetSeqElem(contour, i);
-		if((pt->x <= 1) || (pt->x >= width-2) || (pt->y <= 1) || (pt->y >= height-2)) ret = false;
+		if((pt->x <= rect.x+1) || (pt->x >= rect.x+rect.width-2) ||
+		   (pt->y <= rect.y+1) || (pt->y >= rect.y+rect.height-2)) ret = false;
 	}
 	return ret;
 }
 
+/**
+ * \brief Horizontal band of the image that is labeled by one worker in \e LabelingCvSeq.
+ *
+ * The band owns the contours whose topmost row is in [y0, y1). It labels the rows in
+ * \e rect, which starts two rows above y0 (so that the owned contours are complete from
+ * the top) and continues \e band_overlap rows below y1. The owned contours that reach
+ * the bottom of \e rect may continue outside it and they are left for a second pass.
+ */
+class LabelingBand
+{
+public:
+	int y0, y1;
+	CvRect rect;
+	IplImage *buffer;
+	CvMemStorage *storage;
+	IntegralThreshold integral_threshold;
+	EdgeFitBuffer edge_buffer;
+	std::vector<std::vector<PointDouble> > corners;
+	std::vector<std::vector<Line> > lines;
+	bool overflow;
+
+	LabelingBand() : y0(0), y1(0), buffer(0), overflow(false)
+	{
+		storage = cvCreateMemStorage(0);
+	}
+	~LabelingBand()
+	{
+		if (buffer) cvReleaseImage(&buffer);
+		cvReleaseMemStorage(&storage);
+	}
+	// Returns a header for a buffer of the given size
+	IplImage* Buffer(int width, int height, IplImage* header)
+	{
+		if (buffer && ((buffer->width != width) || (buffer->height < height))) {
+			cvReleaseImage(&buffer);
+		}
+		if (buffer == NULL) {
+			buffer = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+		}
+		return SubImageHeader(buffer, cvRect(0, 0, width, height), header);
+	}
+	// Does the contour with this bounding box belong to the band?
+	bool Owns(const CvRect &box) const
+	{
+		return (box.y >= y0) && (box.y < y1);
+	}
+	// Can the contour with this bounding box continue below rect?
+	bool Overflows(const CvRect &box, int bottom, int height) const
+	{
+		return (bottom < height) && (box.y+box.height-1 >= bottom-2);
+	}
+};
+
 LabelingCvSeq::LabelingCvSeq() : _n_blobs(0), _min_edge(20), _min_area(25)
 {
-	SetOptions();
+	SetPyramid();
+	gray_small = 0;
+	bw_small = 0;
+	pool = 0;
+	band_image = 0;
+	n_threads = 1;
+	SetThreads();
 	storage = cvCreateMemStorage(0);
 }
 
@@ -68,200 +338,613 @@ LabelingCvSeq::~LabelingCvSeq()
 {
 	if(storage)
 		cvReleaseMemStorage(&storage);
+	if(gray_small)
+		cvReleaseImage(&gray_small);
+	if(bw_small)
+		cvReleaseImage(&bw_small);
+	if(pool)
+		delete pool;
+	for (size_t i=0; i<bands.size(); i++)
+		delete bands[i];
+}
+
+void LabelingCvSeq::SetPyramid(int levels, double tolerance) {
+    pyramid_levels = (levels < 0 ? 0 : levels);
+    pyramid_tolerance = tolerance;
+}
+
+void LabelingCvSeq::SetThreads(int threads, int overlap) {
+    band_overlap = (overlap < 0 ? 0 : overlap);
+    if (threads == n_threads && (threads <= 1 || pool)) return;
+    n_threads = threads;
+    if (pool) {
+        delete pool;
+        pool = 0;
+    }
+    if (n_threads > 1) pool = new WorkerPool(n_threads);
+}
+
+bool LabelingCvSeq::ApproxSquare(CvSeq* contour, CvRect rect, CvMemStorage* mem, CvSeq** result)
+{
+    if(contour->total < _min_edge) return false;
+
+    *result = cvApproxPoly(contour, sizeof(CvContour), mem,
+                           CV_POLY_APPROX_DP, cvContourPerimeter(contour)*0.035, 0 ); // TODO: Parameters?
+
+    return ((*result)->total == 4 && CheckBorder(*result, rect) && 
+            fabs(cvContourArea(*result,CV_WHOLE_SEQ)) > _min_area && // TODO check limits
+            cvCheckContourConvexity(*result) ); // ttehop: Changed to 'contours' instead of 'result'
+}
+
+void LabelingCvSeq::FindSquares(IplImage* bw_img, CvRect rect, CvSeq* squares, CvSeq* square_contours)
+{
+    CvSeq* contours;
+    cvFindContours(bw_img, storage, &contours, sizeof(CvContour),
+        CV_RETR_LIST, CV_CHAIN_APPROX_NONE, cvPoint(rect.x, rect.y));
+
+    while(contours)
+    {
+        CvSeq* result;
+        if (ApproxSquare(contours, rect, storage, &result))
+        {
+                cvSeqPush(squares, result);
+                cvSeqPush(square_contours, contours);
+        }
+        contours = contours->h_next;
+    }
+}
+
+void LabelingCvSeq::FitSquareCorners(CvSeq* sq, CvSeq* square_contour, vector<PointDouble> &corners, vector<Line> &fitted_lines, EdgeFitBuffer &buffer)
+{
+    // Copy the contour into a contiguous array once
+    int total = square_contour->total;
+    buffer.contour.resize(total);
+    cvCvtSeqToArray(square_contour, &buffer.contour[0], CV_WHOLE_SEQ);
+    const CvPoint *contour = &buffer.contour[0];
+
+    // Map the polygon vertices back to the contour indices in one pass
+    CvPoint vertices[4];
+    int k[4] = {-1, -1, -1, -1};
+    for(int j = 0; j < 4; ++j) vertices[j] = *(CvPoint*)cvGetSeqElem(sq, j);
+    for (int i = 0; i < total; i++) {
+        for(int j = 0; j < 4; ++j) {
+            if ((vertices[j].x == contour[i].x) && (vertices[j].y == contour[i].y)) k[j]=i;
+        }
+    }
+
+    FitQuadCorners(contour, total, k, corners, fitted_lines, buffer);
 }
 
-void LabelingCvSeq::SetOptions(bool _detect_pose_grayscale) {
-    detect_pose_grayscale = _detect_pose_grayscale;
+// The window of the grayscale edge refinement along the edge normal
+static const int gray_win_size = 5;
+
+// Reads the window around the point, returns false if the window leaves the image
+static inline bool SampleGrayWindow(IplImage *gray, const CvPoint2D32f &p, const int offsets[gray_win_size],
+                                    int margin, int samples[gray_win_size])
+{
+    int x = cvRound(p.x), y = cvRound(p.y);
+    if ((x < margin) || (y < margin) || (x >= gray->width-margin) || (y >= gray->height-margin)) return false;
+    const unsigned char *row = (const unsigned char *)(gray->imageData + y*gray->widthStep);
+    for (int i=0; i<gray_win_size; i++) samples[i] = row[x+offsets[i]];
+    return true;
+}
+
+// Moves the edge points along the edge normal to the centroid of the intensity differences.
+// The normal is quantized to whole pixel steps, so the window is the same set of offsets
+// for every point of the edge. The points whose window leaves the image are not moved.
+static void FitLineGray(CvPoint2D32f *points, int count, IplImage *gray)
+{
+    if (count < 2) return;
+
+    // Discover 1st the line normal direction
+    double dx = +(points[count-1].y - points[0].y);
+    double dy = -(points[count-1].x - points[0].x);
+    double d = max(fabs(dx), fabs(dy));
+    if (d == 0) return;
+    dx /= d; dy /= d;
+
+    // Build normal search table
+    const int win_mid = gray_win_size/2;
+    const int diff_win_size = gray_win_size-1;
+    int xx[gray_win_size], yy[gray_win_size], offsets[gray_win_size];
+    float dxx[diff_win_size], dyy[diff_win_size];
+    xx[win_mid] = 0; yy[win_mid] = 0;
+    for (int i=1; i<=win_mid; i++) {
+        xx[win_mid + i] = cvRound(i*dx);
+        xx[win_mid - i] = -xx[win_mid + i];
+        yy[win_mid + i] = cvRound(i*dy);
+        yy[win_mid - i] = -yy[win_mid + i];
+    }
+    int margin = 0;
+    for (int i=0; i<gray_win_size; i++) {
+        offsets[i] = yy[i]*gray->widthStep + xx[i];
+        margin = max(margin, max(abs(xx[i]), abs(yy[i])));
+    }
+    for (int i=0; i<diff_win_size; i++) {
+        dxx[i] = (xx[i]+xx[i+1])/2.f;
+        dyy[i] = (yy[i]+yy[i+1])/2.f;
+    }
+
+    int l = 0;
+#if defined(__SSE2__)
+    // Four points at a time, the points outside the image get zero weights
+    const __m128 sign = _mm_set1_ps(-0.f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    for (; l+4 <= count; l+=4) {
+        int c[4][gray_win_size];
+        for (int p=0; p<4; p++) {
+            if (!SampleGrayWindow(gray, points[l+p], offsets, margin, c[p]))
+                for (int i=0; i<gray_win_size; i++) c[p][i] = 0;
+        }
+        __m128 c1 = _mm_setr_ps(float(c[0][0]), float(c[1][0]), float(c[2][0]), float(c[3][0]));
+        __m128 sx = zero, sy = zero, sw = zero;
+        for (int i=0; i<diff_win_size; i++) {
+            __m128 c2 = _mm_setr_ps(float(c[0][i+1]), float(c[1][i+1]), float(c[2][i+1]), float(c[3][i+1]));
+            __m128 w = _mm_andnot_ps(sign, _mm_sub_ps(c2, c1));
+            sx = _mm_add_ps(sx, _mm_mul_ps(_mm_set1_ps(dxx[i]), w));
+            sy = _mm_add_ps(sy, _mm_mul_ps(_mm_set1_ps(dyy[i]), w));
+            sw = _mm_add_ps(sw, w);
+            c1 = c2;
+        }
+        __m128 valid = _mm_cmpgt_ps(sw, zero);
+        __m128 inv = _mm_and_ps(valid, _mm_div_ps(one, _mm_or_ps(_mm_and_ps(valid, sw), _mm_andnot_ps(valid, one))));
+        float ox[4], oy[4];
+        _mm_storeu_ps(ox, _mm_mul_ps(sx, inv));
+        _mm_storeu_ps(oy, _mm_mul_ps(sy, inv));
+        for (int p=0; p<4; p++) {
+            points[l+p].x += ox[p];
+            points[l+p].y += oy[p];
+        }
+    }
+#endif
+    for (; l<count; l++) {
+        int c[gray_win_size];
+        if (!SampleGrayWindow(gray, points[l], offsets, margin, c)) continue;
+        float sx=0, sy=0, sw=0;
+        for (int i=0; i<diff_win_size; i++) {
+            float w = float(abs(c[i+1]-c[i]));
+            sx += dxx[i]*w;
+            sy += dyy[i]*w;
+            sw += w;
+        }
+        if (sw > 0) {
+            points[l].x += sx/sw;
+            points[l].y += sy/sw;
+        }
+    }
+}
+
+void Labeling::FitQuadCorners(const CvPoint* contour, int total, const int k[4],
+    vector<PointDouble> &corners, vector<Line> &fitted_lines, EdgeFitBuffer &buffer)
+{
+    fitted_lines.resize(4);
+    corners.resize(4);
+
+    for(int j = 0; j < 4; ++j)
+    {
+        int k0 = k[j], k1 = k[(j+1)%4];
+        int len;
+        if (k1 >= k0) len = k1-k0-1; // neither k0 nor k1 are included
+        else len = total-k0+k1-1;
+        if (len == 0) len = 1;
+
+        buffer.points.resize(len);
+        CvPoint2D32f *points = &buffer.points[0];
+        for (int l=0; l<len; l++) {
+            const CvPoint &p = contour[(k0+l+1)%total];
+            points[l].x = float(p.x);
+            points[l].y = float(p.y);
+        }
+
+        // The gray image is sampled in the distorted coordinates
+        if (detect_pose_grayscale && gray)
+            FitLineGray(points, len, gray);
+
+        // Undistort
+        if(cam) cam->Undistort(points, len);
+
+        // Fit edge and put to vector of edges
+        float params[4] = {0};
+        FitLine(points, len, params);
+
+        //cvFitLine(line_data, CV_DIST_L2, 0, 0.01, 0.01, params);
+        ////cvFitLine(line_data, CV_DIST_HUBER, 0, 0.01, 0.01, params);
+        Line line = Line(params);
+        fitted_lines[j] = line;
+    }
+
+    // Calculated four intersection points
+    for(size_t j = 0; j < 4; ++j)
+    {
+        PointDouble intc = Intersection(fitted_lines[j],fitted_lines[(j+1)%4]);
+
+        // TODO: Instead, test OpenCV find corner in sub-pix...
+        //CvPoint2D32f pt = cvPoint2D32f(intc.x, intc.y);
+        //cvFindCornerSubPix(gray, &pt,
+        //                   1, cvSize(3,3), cvSize(-1,-1),
+        //                   cvTermCriteria(
+        //                   CV_TERMCRIT_ITER+CV_TERMCRIT_EPS,10,1e-4));
+        
+        // TODO: Now there is a wierd systematic 0.5 pixel error that is fixed here...
+        //intc.x += 0.5;
+        //intc.y += 0.5;
+
+        // The corners are stored in the raw image coordinates like the contour
+        if(cam) cam->Distort(intc);
+
+        // TODO: Should we make this always counter-clockwise or clockwise?
+        /*
+        if (image->origin && j == 1) corners[3] = intc;
+        else if (image->origin && j == 3) corners[1] = intc;
+        else corners[j] = intc;
+        */
+        corners[j] = intc;
+    }
 }
 
 void LabelingCvSeq::LabelSquares(IplImage* image, bool visualize)
 {
+    if (regions.empty() && (pyramid_levels > 0)) {
+        PrepareGray(image);
+        LabelSquaresPyramid(image, visualize);
+        return;
+    }
+    if (regions.empty() && pool) {
+        LabelSquaresParallel(image, visualize);
+        return;
+    }
 
-    if (gray && ((gray->width != image->width) || (gray->height != image->height))) {
-        cvReleaseImage(&gray); gray=NULL;
-        if (bw) cvReleaseImage(&bw); bw=NULL;
+    CvSeq* squares = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSeq), storage);
+    CvSeq* square_contours = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSeq), storage);
+
+    if (regions.empty()) {
+        PrepareGray(image);
+        Threshold();
+        //cvThreshold(gray, bw, 127, 255, CV_THRESH_BINARY_INV);
+        FindSquares(bw, cvRect(0, 0, image->width, image->height), squares, square_contours);
+    } else {
+        // Convert, threshold and label only the requested regions
+        vector<CvRect> rects;
+        GetLabelingRegions(image->width, image->height, rects);
+        for (size_t r = 0; r < rects.size(); ++r) {
+            IplImage gray_header, bw_header;
+            PrepareGray(image, &rects[r]);
+            Threshold(SubImageHeader(gray, rects[r], &gray_header), SubImageHeader(bw, rects[r], &bw_header), thresh_param1);
+            FindSquares(&bw_header, rects[r], squares, square_contours);
+        }
     }
-    if (gray == NULL) {
-        gray = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
-        gray->origin = image->origin;
-        bw = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
-        bw->origin = image->origin;
+
+    _n_blobs = squares->total;
+    blob_corners.resize(_n_blobs);
+
+    // For every detected 4-corner blob
+    vector<Line> fitted_lines(4);
+    for(int i = 0; i < _n_blobs; ++i)
+    {
+        CvSeq* sq = (CvSeq*)cvGetSeqElem(squares, i);
+        CvSeq* square_contour = (CvSeq*)cvGetSeqElem(square_contours, i);
+        FitSquareCorners(sq, square_contour, blob_corners[i], fitted_lines, edge_buffer);
+        if (visualize) {
+            for(int j = 0; j < 4; ++j) DrawLine(image, fitted_lines[j]);
+            VisualizeCorners(image, blob_corners[i]);
+        }
+    }
+
+    cvClearMemStorage(storage);
+}
+
+void LabelingCvSeq::ConvertBand(void *labeling, int band)
+{
+    LabelingCvSeq *l = (LabelingCvSeq *)labeling;
+    LabelingBand *b = l->bands[band];
+    if (b->y1 <= b->y0) return;
+    l->ConvertGray(l->band_image, cvRect(0, b->y0, l->gray->width, b->y1-b->y0));
+}
+
+void LabelingCvSeq::ThresholdBand(void *labeling, int band)
+{
+    LabelingCvSeq *l = (LabelingCvSeq *)labeling;
+    LabelingBand *b = l->bands[band];
+    if (b->y1 <= b->y0) return;
+    int width = l->gray->width;
+
+    // Threshold the owned rows with the rows covered by the threshold window
+    int radius = l->thresh_param1/2;
+    int top = max(b->y0-radius, 0);
+    int bottom = min(b->y1+radius, l->gray->height);
+    IplImage gray_header, buffer_header, src_header, dst_header;
+    IplImage *buffer = b->Buffer(width, bottom-top, &buffer_header);
+    l->Threshold(SubImageHeader(l->gray, cvRect(0, top, width, bottom-top), &gray_header), buffer, l->thresh_param1, b->integral_threshold);
+    cvCopy(SubImageHeader(buffer, cvRect(0, b->y0-top, width, b->y1-b->y0), &src_header),
+           SubImageHeader(l->bw, cvRect(0, b->y0, width, b->y1-b->y0), &dst_header));
+}
+
+void LabelingCvSeq::LabelBand(void *labeling, int band)
+{
+    LabelingCvSeq *l = (LabelingCvSeq *)labeling;
+    LabelingBand *b = l->bands[band];
+    if (b->y1 <= b->y0) return;
+    int width = l->bw->width;
+    int height = l->bw->height;
+    CvRect image_rect = cvRect(0, 0, width, height);
+
+    b->corners.clear();
+    b->lines.clear();
+
+    // The owned contours that reach the bottom are labeled again from a taller band
+    int top = max(b->y0-2, 0);
+    int bottom = min(b->y1+l->band_overlap, height);
+    int prev_bottom = -1;
+    for (;;) {
+        IplImage buffer_header, bw_header;
+        b->rect = cvRect(0, top, width, bottom-top);
+        IplImage *buffer = b->Buffer(width, b->rect.height, &buffer_header);
+        cvCopy(SubImageHeader(l->bw, b->rect, &bw_header), buffer);
+
+        CvSeq* contours;
+        cvFindContours(buffer, b->storage, &contours, sizeof(CvContour),
+            CV_RETR_LIST, CV_CHAIN_APPROX_NONE, cvPoint(b->rect.x, b->rect.y));
+
+        b->overflow = false;
+        for (; contours; contours = contours->h_next)
+        {
+            CvRect box = cvBoundingRect(contours, 1);
+            if (!b->Owns(box)) continue;
+            // Skip the contours that were complete already in the previous pass
+            if ((prev_bottom >= 0) && !b->Overflows(box, prev_bottom, height)) continue;
+            if (b->Overflows(box, bottom, height)) {
+                b->overflow = true;
+                continue;
+            }
+
+            CvSeq* result;
+            if (!l->ApproxSquare(contours, image_rect, b->storage, &result)) continue;
+            b->corners.push_back(vector<PointDouble>(4));
+            b->lines.push_back(vector<Line>(4));
+            l->FitSquareCorners(result, contours, b->corners.back(), b->lines.back(), b->edge_buffer);
+        }
+        cvClearMemStorage(b->storage);
+
+        if (!b->overflow) break;
+        prev_bottom = bottom;
+        bottom = min(bottom+max(bottom-top, l->band_overlap), height);
+    }
+}
+
+void LabelingCvSeq::LabelSquaresParallel(IplImage* image, bool visualize)
+{
+    AllocateImages(image);
+
+    // Split the image into bands, at least a few threshold blocks high
+    int height = image->height;
+    int n_bands = min(pool->size(), max(height/(2*thresh_param1), 1));
+    while ((int)bands.size() < n_bands) bands.push_back(new LabelingBand());
+    int band_height = (height+n_bands-1)/n_bands;
+    for (int i=0; i<n_bands; i++) {
+        bands[i]->y0 = min(i*band_height, height);
+        bands[i]->y1 = min((i+1)*band_height, height);
+    }
+
+    band_image = image;
+    pool->run(ConvertBand, this, n_bands);
+    pool->run(ThresholdBand, this, n_bands);
+    pool->run(LabelBand, this, n_bands);
+    band_image = 0;
+
+    blob_corners.clear();
+    for (int i=0; i<n_bands; i++) {
+        LabelingBand *b = bands[i];
+        for (size_t j=0; j<b->corners.size(); j++) {
+            blob_corners.push_back(b->corners[j]);
+            if (visualize) {
+                for(int k = 0; k < 4; ++k) DrawLine(image, b->lines[j][k]);
+                VisualizeCorners(image, b->corners[j]);
+            }
+        }
     }
+    _n_blobs = (int)blob_corners.size();
+}
 
-    // Convert grayscale and threshold
-    if(image->nChannels == 4)
-        cvCvtColor(image, gray, CV_RGBA2GRAY);
-    else if(image->nChannels == 3)
-        cvCvtColor(image, gray, CV_RGB2GRAY);
-    else if(image->nChannels == 1)
-        cvCopy(image, gray);
-    else {
-        cerr<<"Unsupported image format"<<endl;
+void LabelingCvSeq::LabelSquaresPyramid(IplImage* image, bool visualize)
+{
+    int scale = 1<<pyramid_levels;
+    CvSize small_size = cvSize(gray->width/scale, gray->height/scale);
+    if (gray_small && ((gray_small->width != small_size.width) || (gray_small->height != small_size.height))) {
+        cvReleaseImage(&gray_small); gray_small=NULL;
+        if (bw_small) cvReleaseImage(&bw_small); bw_small=NULL;
+    }
+    if (gray_small == NULL) {
+        gray_small = cvCreateImage(small_size, IPL_DEPTH_8U, 1);
+        gray_small->origin = gray->origin;
+        bw_small = cvCreateImage(small_size, IPL_DEPTH_8U, 1);
+        bw_small->origin = gray->origin;
     }
 
-    cvAdaptiveThreshold(gray, bw, 255, CV_ADAPTIVE_THRESH_MEAN_C, CV_THRESH_BINARY_INV, thresh_param1, thresh_param2);
-    //cvThreshold(gray, bw, 127, 255, CV_THRESH_BINARY_INV);
+    // Downsample and threshold using a block size that covers the same area as in full resolution
+    cvResize(gray, gray_small, CV_INTER_AREA);
+    int block_size = (thresh_param1/scale) | 1;
+    if (block_size < 3) block_size = 3;
+    Threshold(gray_small, bw_small, block_size);
 
     CvSeq* contours;
     CvSeq* squares = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSeq), storage);
-    CvSeq* square_contours = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSeq), storage);
+    vector<bool> holes;
 
-    cvFindContours(bw, storage, &contours, sizeof(CvContour),
+    cvFindContours(bw_small, storage, &contours, sizeof(CvContour),
         CV_RETR_LIST, CV_CHAIN_APPROX_NONE, cvPoint(0,0));
 
+    int min_edge = _min_edge/scale;
+    int min_area = _min_area/(scale*scale);
     while(contours)
     {
-        if(contours->total < _min_edge)
+        if(contours->total < min_edge)
         {
             contours = contours->h_next;
             continue;
         }
 
         CvSeq* result = cvApproxPoly(contours, sizeof(CvContour), storage,
-                                     CV_POLY_APPROX_DP, cvContourPerimeter(contours)*0.035, 0 ); // TODO: Parameters?
+                                     CV_POLY_APPROX_DP, cvContourPerimeter(contours)*0.035, 0 );
 
-        if( result->total == 4 && CheckBorder(result, image->width, image->height) && 
-            fabs(cvContourArea(result,CV_WHOLE_SEQ)) > _min_area && // TODO check limits
-            cvCheckContourConvexity(result) ) // ttehop: Changed to 'contours' instead of 'result'
+        if( result->total == 4 && CheckBorder(result, small_size.width, small_size.height) &&
+            fabs(cvContourArea(result,CV_WHOLE_SEQ)) > min_area &&
+            cvCheckContourConvexity(result) )
         {
                 cvSeqPush(squares, result);
-                cvSeqPush(square_contours, contours);
+                holes.push_back(CV_IS_SEQ_HOLE(contours));
         }
         contours = contours->h_next;
     }
 
-    _n_blobs = squares->total;
-    blob_corners.resize(_n_blobs);
-
-    // For every detected 4-corner blob
-    for(int i = 0; i < _n_blobs; ++i)
+    // The coarse vertices are within about one coarse pixel from the real edges
+    int search = scale+2;
+    vector<Line> fitted_lines(4);
+    blob_corners.clear();
+    for(int i = 0; i < squares->total; ++i)
     {
-        vector<Line> fitted_lines(4);
-        blob_corners[i].resize(4);
         CvSeq* sq = (CvSeq*)cvGetSeqElem(squares, i);
-        CvSeq* square_contour = (CvSeq*)cvGetSeqElem(square_contours, i);
-        
+        PointDouble vertices[4];
         for(int j = 0; j < 4; ++j)
         {
-            CvPoint* pt0 = (CvPoint*)cvGetSeqElem(sq, j);
-            CvPoint* pt1 = (CvPoint*)cvGetSeqElem(sq, (j+1)%4);
-            int k0=-1, k1=-1;
-            for (int k = 0; k<square_contour->total; k++) {
-                CvPoint* pt2 = (CvPoint*)cvGetSeqElem(square_contour, k);
-                if ((pt0->x == pt2->x) && (pt0->y == pt2->y)) k0=k;
-                if ((pt1->x == pt2->x) && (pt1->y == pt2->y)) k1=k;
-            }
-            int len;
-            if (k1 >= k0) len = k1-k0-1; // neither k0 nor k1 are included
-            else len = square_contour->total-k0+k1-1;
-            if (len == 0) len = 1;
-
-            CvMat* line_data = cvCreateMat(1, len, CV_32FC2);
-            for (int l=0; l<len; l++) {
-                int ll = (k0+l+1)%square_contour->total;
-                CvPoint* p = (CvPoint*)cvGetSeqElem(square_contour, ll);
-                CvPoint2D32f pp;
-                pp.x = float(p->x);
-                pp.y = float(p->y);
+            CvPoint* pt = (CvPoint*)cvGetSeqElem(sq, j);
+            vertices[j].x = (pt->x+0.5)*scale-0.5;
+            vertices[j].y = (pt->y+0.5)*scale-0.5;
+        }
+        if (!RefineQuad(vertices, fitted_lines, search, holes[i])) continue;
 
-                // Undistort
-                if(cam)
-                    cam->Undistort(pp);
+        // Corner j is the intersection of the edges j and j+1 as in LabelSquares
+        vector<PointDouble> corners(4);
+        for(int j = 0; j < 4; ++j) corners[j] = vertices[(j+1)%4];
+        blob_corners.push_back(corners);
 
-                CV_MAT_ELEM(*line_data, CvPoint2D32f, 0, l) = pp;
-            }
+        if (visualize) {
+            for(int j = 0; j < 4; ++j) DrawLine(image, fitted_lines[j]);
+            VisualizeCorners(image, corners);
+        }
+    }
+    _n_blobs = (int)blob_corners.size();
 
-            // Fit edge and put to vector of edges
-            float params[4] = {0};
+    cvClearMemStorage(storage);
+}
 
-            // TODO: The detect_pose_grayscale is still under work...
-            /*
-            if (detect_pose_grayscale &&
-                (pt0->x > 3) && (pt0->y > 3) &&
-                (pt0->x < (gray->width-4)) &&
-                (pt0->y < (gray->height-4)))
-            {
-                // ttehop: Grayscale experiment
-                FitLineGray(line_data, params, gray);
-            }
-            */
-            cvFitLine(line_data, CV_DIST_L2, 0, 0.01, 0.01, params);
+// Bilinear interpolation, (x, y) must be inside [0, width-1) x [0, height-1)
+static inline double SampleGray(IplImage *img, double x, double y)
+{
+    int ix = int(x), iy = int(y);
+    double fx = x-ix, fy = y-iy;
+    const unsigned char *p0 = (const unsigned char *)(img->imageData + iy*img->widthStep) + ix;
+    const unsigned char *p1 = p0 + img->widthStep;
+    return (1-fy)*((1-fx)*p0[0] + fx*p0[1]) + fy*((1-fx)*p1[0] + fx*p1[1]);
+}
 
-            //cvFitLine(line_data, CV_DIST_L2, 0, 0.01, 0.01, params);
-            ////cvFitLine(line_data, CV_DIST_HUBER, 0, 0.01, 0.01, params);
-            Line line = Line(params);
-            if(visualize) DrawLine(image, line);
-            fitted_lines[j] = line;
+// Searches the dark-to-bright transition along the outwards normal (nx, ny) through (px, py).
+// The level is the middle of the profile minus the threshold constant, and the returned point
+// is half a pixel inside the crossing to match the contour pixels used by LabelSquares.
+static bool FindEdgePoint(IplImage *gray, double px, double py, double nx, double ny,
+                          int search, int thresh_param, CvPoint2D32f &edge)
+{
+    const int max_search = 32;
+    double v[2*max_search+1];
+    if (search > max_search) search = max_search;
+    int n = 2*search+1;
 
-            cvReleaseMat(&line_data);
-        }
+    double x0 = px-search*nx, y0 = py-search*ny;
+    double x1 = px+search*nx, y1 = py+search*ny;
+    if ((x0 < 0) || (y0 < 0) || (x1 < 0) || (y1 < 0) ||
+        (x0 >= gray->width-1) || (x1 >= gray->width-1) ||
+        (y0 >= gray->height-1) || (y1 >= gray->height-1)) return false;
 
-        // Calculated four intersection points
-        for(size_t j = 0; j < 4; ++j)
-        {
-            PointDouble intc = Intersection(fitted_lines[j],fitted_lines[(j+1)%4]);
+    double lo = 255, hi = 0;
+    for (int k=0; k<n; k++) {
+        v[k] = SampleGray(gray, x0+k*nx, y0+k*ny);
+        if (v[k] < lo) lo = v[k];
+        if (v[k] > hi) hi = v[k];
+    }
+    if (hi-lo < 2*thresh_param+10) return false;
+    double level = (lo+hi)/2 - thresh_param;
 
-            // TODO: Instead, test OpenCV find corner in sub-pix...
-            //CvPoint2D32f pt = cvPoint2D32f(intc.x, intc.y);
-            //cvFindCornerSubPix(gray, &pt,
-            //                   1, cvSize(3,3), cvSize(-1,-1),
-            //                   cvTermCriteria(
-            //                   CV_TERMCRIT_ITER+CV_TERMCRIT_EPS,10,1e-4));
-            
-            // TODO: Now there is a wierd systematic 0.5 pixel error that is fixed here...
-            //intc.x += 0.5;
-            //intc.y += 0.5;
+    // Start from the strongest rising gradient and walk to the nearest level crossing
+    int k = -1;
+    double best_diff = 0;
+    for (int i=0; i<n-1; i++) {
+        if (v[i+1]-v[i] > best_diff) { best_diff = v[i+1]-v[i]; k = i; }
+    }
+    if (k < 0) return false;
+    while ((k > 0) && (v[k] > level)) k--;
+    while ((k < n-2) && (v[k+1] <= level)) k++;
+    if ((v[k] > level) || (v[k+1] <= level)) return false;
 
-            if(cam) cam->Distort(intc);
+    double t = k + (level-v[k])/(v[k+1]-v[k]) - 0.5 - search;
+    edge.x = float(px + t*nx);
+    edge.y = float(py + t*ny);
+    return true;
+}
 
-            // TODO: Should we make this always counter-clockwise or clockwise?
-            /*
-            if (image->origin && j == 1) blob_corners[i][3] = intc;
-            else if (image->origin && j == 3) blob_corners[i][1] = intc;
-            else blob_corners[i][j] = intc;
-            */
-            blob_corners[i][j] = intc;
-        }
-        if (visualize) {
-            for(size_t j = 0; j < 4; ++j) {
-                PointDouble &intc = blob_corners[i][j];
-                if (j == 0) cvCircle(image, cvPoint(int(intc.x), int(intc.y)), 5, CV_RGB(255, 255, 255));
-                if (j == 1) cvCircle(image, cvPoint(int(intc.x), int(intc.y)), 5, CV_RGB(255, 0, 0));
-                if (j == 2) cvCircle(image, cvPoint(int(intc.x), int(intc.y)), 5, CV_RGB(0, 255, 0));
-                if (j == 3) cvCircle(image, cvPoint(int(intc.x), int(intc.y)), 5, CV_RGB(0, 0, 255));
+bool LabelingCvSeq::RefineQuad(PointDouble vertices[4], vector<Line> &fitted_lines, int search, bool hole)
+{
+    const int max_iterations = 5;
+    vector<CvPoint2D32f> &edge_points = edge_buffer.points;
+    for (int iter=0; iter<max_iterations; iter++)
+    {
+        double cx = (vertices[0].x+vertices[1].x+vertices[2].x+vertices[3].x)/4;
+        double cy = (vertices[0].y+vertices[1].y+vertices[2].y+vertices[3].y)/4;
+        for(int j = 0; j < 4; ++j)
+        {
+            const PointDouble &p0 = vertices[j];
+            const PointDouble &p1 = vertices[(j+1)%4];
+            double dx = p1.x-p0.x, dy = p1.y-p0.y;
+            double len = sqrt(dx*dx+dy*dy);
+            // Keep the search windows away from the neighbouring edges
+            double skip = search+1;
+            if (len < 2*skip+2) return false;
+            dx /= len; dy /= len;
+            double nx = dy, ny = -dx;
+            if (((p0.x+p1.x)/2-cx)*nx + ((p0.y+p1.y)/2-cy)*ny < 0) { nx = -nx; ny = -ny; }
+            // A hole is dark outside, so its edges rise towards the centre
+            if (hole) { nx = -nx; ny = -ny; }
+
+            edge_points.clear();
+            for (double t=skip; t<=len-skip; t+=1.0) {
+                CvPoint2D32f pp;
+                if (!FindEdgePoint(gray, p0.x+t*dx, p0.y+t*dy, nx, ny, search, thresh_param2, pp)) continue;
+                if(cam)
+                    cam->Undistort(pp);
+                edge_points.push_back(pp);
             }
+            // Require support from at least half of the edge
+            if (edge_points.size() < 2 || edge_points.size() < (len-2*skip)/2) return false;
+
+            float params[4] = {0};
+            FitLine(&edge_points[0], (int)edge_points.size(), params);
+            fitted_lines[j] = Line(params);
         }
-    }
 
-    cvClearMemStorage(storage);
+        double max_shift = 0;
+        for(int j = 0; j < 4; ++j)
+        {
+            PointDouble intc = Intersection(fitted_lines[j],fitted_lines[(j+1)%4]);
+            // Back to the raw image coordinates of the vertices
+            if(cam) cam->Distort(intc);
+            PointDouble &v = vertices[(j+1)%4];
+            double shift = sqrt((intc.x-v.x)*(intc.x-v.x) + (intc.y-v.y)*(intc.y-v.y));
+            if (shift > max_shift) max_shift = shift;
+            v = intc;
+        }
+        if (max_shift < pyramid_tolerance) return true;
+
+        // The next windows need to cover only the remaining uncertainty
+        int next_search = int(ceil(max_shift))+2;
+        if (next_search < search) search = next_search;
+    }
+    return false;
 }
 
 CvSeq* LabelingCvSeq::LabelImage(IplImage* image, int min_size, bool approx)
 {
 	assert(image->origin == 0); // Currently only top-left origin supported
-	if (gray && ((gray->width != image->width) || (gray->height != image->height))) {
-		cvReleaseImage(&gray); gray=NULL;
-		if (bw) cvReleaseImage(&bw); bw=NULL;
-	}
-	if (gray == NULL) {
-		gray = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
-		gray->origin = image->origin;
-		bw = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
-		bw->origin = image->origin;
-	}
-
-	// Convert grayscale and threshold
-	if(image->nChannels == 4)
-		cvCvtColor(image, gray, CV_RGBA2GRAY);
-	else if(image->nChannels == 3)
-		cvCvtColor(image, gray, CV_RGB2GRAY);
-	else if(image->nChannels == 1)
-		cvCopy(image, gray);
-	else {
-		cerr<<"Unsupported image format"<<endl;
-	}
-
-	cvAdaptiveThreshold(gray, bw, 255, CV_ADAPTIVE_THRESH_MEAN_C, CV_THRESH_BINARY_INV, thresh_param1, thresh_param2);
+	PrepareGray(image);
+	Threshold();
 
 	CvSeq* contours;
 	CvSeq* edges = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSeq), storage);
@@ -302,107 +985,279 @@ CvSeq* LabelingCvSeq::LabelImage(IplImage* image, int min_size, bool approx)
 	return squares;
 }
 
-inline int round(double x) {
-	return (x)>=0?(int)((x)+0.5):(int)((x)-0.5);
+// Chain code directions as in cvFindContours: 0 is right and the codes turn counter-clockwise
+static const int chain_dx[8] = { 1,  1,  0, -1, -1, -1,  0,  1 };
+static const int chain_dy[8] = { 0, -1, -1, -1,  0,  1,  1,  1 };
+
+int LabelingRle::FindRoot(int i)
+{
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent; // Path halving
+        i = runs[i].parent;
+    }
+    return i;
 }
 
-template<class T>
-inline T absdiff(T c1, T c2) {
-	return (c2>c1?c2-c1:c1-c2);
+LabelingRle::LabelingRle() : _n_blobs(0), _min_edge(20), _min_area(25)
+{
 }
 
-//#define SHOW_DEBUG
-#ifdef SHOW_DEBUG
-#include "highgui.h"
-#endif
+LabelingRle::~LabelingRle()
+{
+}
 
-// TODO: This should be in LabelingCvSeq ???
-void FitLineGray(CvMat *line_data, float params[4], IplImage *gray) {
-	// this very simple approach works...
-	/*
-	float *cx = &(params[2]);
-	float *cy = &(params[3]);
-	float *sx = &(params[0]);
-	float *sy = &(params[1]);
-	CvPoint2D32f *p1 = (CvPoint2D32f*)CV_MAT_ELEM_PTR_FAST(*line_data, 0, 0, sizeof(CvPoint2D32f));
-	CvPoint2D32f *p2 = (CvPoint2D32f*)CV_MAT_ELEM_PTR_FAST(*line_data, 0, line_data->cols-1, sizeof(CvPoint2D32f));
-	*cx = p1->x; *cy = p1->y;
-	*sx = p2->x - p1->x; *sy = p2->y - p1->y;
-	return;
-	*/
-
-#ifdef SHOW_DEBUG
-	IplImage *tmp = cvCreateImage(cvSize(gray->width, gray->height), IPL_DEPTH_8U, 3);
-	IplImage *tmp2 = cvCreateImage(cvSize(gray->width*5, gray->height*5), IPL_DEPTH_8U, 3);
-	cvCvtColor(gray, tmp, CV_GRAY2RGB);
-	cvResize(tmp, tmp2, CV_INTER_NN);
-#endif
+void LabelingRle::EncodeRuns(CvRect rect)
+{
+    runs.clear();
+    int prev_begin = 0, prev_end = 0;
+    for (int y = rect.y; y < rect.y+rect.height; y++)
+    {
+        const unsigned char *row = (const unsigned char *)(bw->imageData + y*bw->widthStep);
+        int begin = (int)runs.size();
+        int x = rect.x, x_end = rect.x+rect.width;
+        while (x < x_end)
+        {
+            while ((x < x_end) && (row[x] == 0)) x++;
+            if (x == x_end) break;
+            Run r;
+            r.x0 = x;
+            while ((x < x_end) && (row[x] != 0)) x++;
+            r.x1 = x;
+            r.y = y;
+            r.parent = (int)runs.size();
+            runs.push_back(r);
+        }
+        int end = (int)runs.size();
 
-	// Discover 1st the line normal direction
-	CvPoint2D32f *p1 = (CvPoint2D32f*)CV_MAT_ELEM_PTR_FAST(*line_data, 0, 0, sizeof(CvPoint2D32f));
-	CvPoint2D32f *p2 = (CvPoint2D32f*)CV_MAT_ELEM_PTR_FAST(*line_data, 0, line_data->cols-1, sizeof(CvPoint2D32f));
-	double dx = +(p2->y - p1->y);
-	double dy = -(p2->x - p1->x);
-	if ((dx == 0) && (dy == 0)) return;
-	else if      (dx == 0) { dy /= dy; }
-	else if (dy == 0) { dx /= dx; }
-	else if (abs(dx) > abs(dy)) { dy /= dx; dx /= dx; }
-	else              { dx /= dy; dy /= dy; }
-
-	// Build normal search table
-	const int win_size=5;
-	const int win_mid=win_size/2;
-	const int diff_win_size=win_size-1;
-	double xx[win_size], yy[win_size];
-	double dxx[diff_win_size], dyy[diff_win_size];
-	xx[win_mid] = 0; yy[win_mid] = 0;
-	for (int i=1; i<=win_size/2; i++) {
-		xx[win_mid + i] = round(i*dx);
-		xx[win_mid - i] = -xx[win_mid + i];
-		yy[win_mid + i] = round(i*dy);
-		yy[win_mid - i] = -yy[win_mid + i];
-	}
-	for (int i=0; i<diff_win_size; i++) {
-		dxx[i] = (xx[i]+xx[i+1])/2;
-		dyy[i] = (yy[i]+yy[i+1])/2;
-	}
+        // Join with the 8-connected runs of the previous row, the root is always the first run
+        int j = prev_begin;
+        for (int i = begin; i < end; i++)
+        {
+            while ((j < prev_end) && (runs[j].x1 < runs[i].x0)) j++;
+            for (int k = j; (k < prev_end) && (runs[k].x0 <= runs[i].x1); k++)
+            {
+                int a = FindRoot(i);
+                int b = FindRoot(k);
+                if (a < b) runs[b].parent = a;
+                else if (b < a) runs[a].parent = b;
+            }
+        }
+        prev_begin = begin;
+        prev_end = end;
+    }
+}
 
-	// Adjust the points
-	for (int l=0; l<line_data->cols; l++) {
-		CvPoint2D32f *p = (CvPoint2D32f*)CV_MAT_ELEM_PTR_FAST(*line_data, 0, l, sizeof(CvPoint2D32f));
-
-		double dx=0, dy=0, ww=0;
-		for (int i=0; i<diff_win_size; i++) {
-			unsigned char c1 = (unsigned char)gray->imageData[int((p->y+yy[i])*gray->widthStep+(p->x+xx[i]))];
-			unsigned char c2 = (unsigned char)gray->imageData[int((p->y+yy[i+1])*gray->widthStep+(p->x+xx[i+1]))];
-#ifdef SHOW_DEBUG
-			cvCircle(tmp2, cvPoint((p->x+xx[i])*5+2,(p->y+yy[i])*5+2), 0, CV_RGB(0,0,255));
-			cvCircle(tmp2, cvPoint((p->x+xx[i+1])*5+2,(p->y+yy[i+1])*5+2), 0, CV_RGB(0,0,255));
-#endif
-			double w = absdiff(c1, c2);
-			dx += dxx[i]*w;
-			dy += dyy[i]*w;
-			ww += w;
-		}
-		if (ww > 0) {
-			dx /= ww; dy /= ww;
-		}
-#ifdef SHOW_DEBUG
-		cvLine(tmp2, cvPoint(p->x*5+2,p->y*5+2), cvPoint((p->x+dx)*5+2, (p->y+dy)*5+2), CV_RGB(0,255,0));
-		p->x += float(dx); p->y += float(dy);
-		cvCircle(tmp2, cvPoint(p->x*5+2,p->y*5+2), 0, CV_RGB(255,0,0));
-#else
-		p->x += float(dx); p->y += float(dy);
-#endif
-	}
+void LabelingRle::CollectBlobs(CvRect rect)
+{
+    blobs.clear();
+    for (int i = 0; i < (int)runs.size(); i++)
+    {
+        Run &r = runs[i];
+        if (r.parent == i) {
+            r.label = (int)blobs.size();
+            Blob b;
+            b.run = i;
+            b.x0 = r.x0; b.x1 = r.x1-1;
+            b.y0 = b.y1 = r.y;
+            blobs.push_back(b);
+            continue;
+        }
+        // The parents precede the runs, so the parent already points to the root
+        r.parent = runs[r.parent].parent;
+        r.label = runs[r.parent].label;
+        Blob &b = blobs[r.label];
+        if (r.x0 < b.x0) b.x0 = r.x0;
+        if (r.x1-1 > b.x1) b.x1 = r.x1-1;
+        b.y1 = r.y;
+    }
 
-#ifdef SHOW_DEBUG
-	cvNamedWindow("tmp");
-	cvShowImage("tmp",tmp2);
-	cvWaitKey(0);
-	cvReleaseImage(&tmp);
-	cvReleaseImage(&tmp2);
-#endif
+    // Keep the blobs that are large enough and stay away from the border as in CheckBorder
+    size_t n = 0;
+    for (size_t i = 0; i < blobs.size(); i++)
+    {
+        const Blob &b = blobs[i];
+        if ((b.x0 <= rect.x+1) || (b.x1 >= rect.x+rect.width-2) ||
+            (b.y0 <= rect.y+1) || (b.y1 >= rect.y+rect.height-2)) continue;
+        if ((b.x1-b.x0)*(b.y1-b.y0) <= _min_area) continue;
+        blobs[n++] = b;
+    }
+    blobs.resize(n);
+}
+
+void LabelingRle::TraceBorder(int x0, int y0, vector<CvPoint> &contour)
+{
+    // Follows icvFetchContour for the outer borders, so that the contour starts from the
+    // same pixel and runs in the same direction as with cvFindContours
+    const char *data = bw->imageData;
+    int step = bw->widthStep;
+    contour.clear();
+
+    // The neighbour preceding the start pixel is searched clockwise from the top-left
+    int s = 4;
+    do {
+        s = (s-1)&7;
+        if (data[(y0+chain_dy[s])*step + x0+chain_dx[s]] != 0) break;
+    } while (s != 4);
+    if (s == 4) {
+        contour.push_back(cvPoint(x0, y0));
+        return;
+    }
+    int x1 = x0+chain_dx[s], y1 = y0+chain_dy[s];
+
+    int x = x0, y = y0;
+    for (;;)
+    {
+        // The next pixel is searched counter-clockwise from the previous one
+        int nx, ny;
+        do {
+            s = (s+1)&7;
+            nx = x+chain_dx[s];
+            ny = y+chain_dy[s];
+        } while (data[ny*step + nx] == 0);
+        contour.push_back(cvPoint(x, y));
+        if ((nx == x0) && (ny == y0) && (x == x1) && (y == y1)) break;
+        x = nx; y = ny;
+        s = (s+4)&7;
+    }
+}
+
+void LabelingRle::ApproxPolygon(const vector<CvPoint> &contour, double eps)
+{
+    int n = (int)contour.size();
+    const CvPoint *pt = &contour[0];
+    polygon.clear();
+    double eps2 = eps*eps;
+
+    // Split the closed contour at two distant points
+    int a = 0, b = 0;
+    int max_dist = 0;
+    for (int iter = 0; iter < 3; iter++) {
+        max_dist = 0;
+        for (int i = 0; i < n; i++) {
+            int dx = pt[i].x-pt[a].x, dy = pt[i].y-pt[a].y;
+            int dist = dx*dx+dy*dy;
+            if (dist > max_dist) { max_dist = dist; b = i; }
+        }
+        if (iter < 2) a = b;
+    }
+    if (max_dist <= eps2) {
+        polygon.push_back(a);
+        return;
+    }
+    if (b < a) std::swap(a, b);
+
+    // Douglas-Peucker on both halves, the indices above n wrap around
+    dp_stack.clear();
+    dp_stack.push_back(b); dp_stack.push_back(a+n);
+    dp_stack.push_back(a); dp_stack.push_back(b);
+    while (!dp_stack.empty())
+    {
+        int end = dp_stack.back(); dp_stack.pop_back();
+        int start = dp_stack.back(); dp_stack.pop_back();
+        const CvPoint &p0 = pt[start%n], &p1 = pt[end%n];
+        double dx = p1.x-p0.x, dy = p1.y-p0.y;
+        double max_d = -1;
+        int k = -1;
+        for (int i = start+1; i < end; i++) {
+            const CvPoint &p = pt[i%n];
+            double d = (p.y-p0.y)*dx - (p.x-p0.x)*dy;
+            d = d*d;
+            if (d > max_d) { max_d = d; k = i; }
+        }
+        if ((k >= 0) && (max_d > eps2*(dx*dx+dy*dy))) {
+            dp_stack.push_back(k); dp_stack.push_back(end);
+            dp_stack.push_back(start); dp_stack.push_back(k);
+        } else {
+            polygon.push_back(start%n);
+        }
+    }
+
+    // Drop the vertices that are almost on the line between their neighbours as cvApproxPoly does
+    size_t count = polygon.size();
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (kept+count-i > 2) {
+            const CvPoint &p0 = pt[kept > 0 ? polygon[kept-1] : polygon[count-1]];
+            const CvPoint &p = pt[polygon[i]];
+            const CvPoint &p1 = pt[polygon[(i+1)%count]];
+            double dx = p1.x-p0.x, dy = p1.y-p0.y;
+            double d = (p.x-p0.x)*dy - (p.y-p0.y)*dx;
+            double inner = (p.x-p0.x)*(p1.x-p.x) + (p.y-p0.y)*(p1.y-p.y);
+            if ((d*d <= 0.5*eps2*(dx*dx+dy*dy)) && (dx != 0) && (dy != 0) && (inner >= 0)) continue;
+        }
+        polygon[kept++] = polygon[i];
+    }
+    polygon.resize(kept);
+}
+
+void LabelingRle::FindSquares(IplImage* image, CvRect rect, bool visualize)
+{
+    EncodeRuns(rect);
+    CollectBlobs(rect);
+
+    vector<CvPoint> &contour = edge_buffer.contour;
+    vector<Line> fitted_lines(4);
+    for (size_t i = 0; i < blobs.size(); i++)
+    {
+        const Run &r = runs[blobs[i].run];
+        TraceBorder(r.x0, r.y, contour);
+        int n = (int)contour.size();
+        if (n < _min_edge) continue;
+
+        // The perimeter of an 8-connected contour consists of unit and diagonal steps
+        int diagonal = 0;
+        for (int j = 0; j < n; j++) {
+            const CvPoint &p0 = contour[j], &p1 = contour[(j+1)%n];
+            if ((p0.x != p1.x) && (p0.y != p1.y)) diagonal++;
+        }
+        double perimeter = (n-diagonal) + diagonal*sqrt(2.0);
+
+        ApproxPolygon(contour, perimeter*0.035);
+        if (polygon.size() != 4) continue;
+
+        // The same checks as with cvContourArea and cvCheckContourConvexity
+        const CvPoint *v[4];
+        for (int j = 0; j < 4; j++) v[j] = &contour[polygon[j]];
+        double area = 0;
+        int positive = 0, negative = 0;
+        for (int j = 0; j < 4; j++) {
+            const CvPoint &p0 = *v[j], &p1 = *v[(j+1)%4], &p2 = *v[(j+2)%4];
+            area += p0.x*p1.y - p1.x*p0.y;
+            int cross = (p1.x-p0.x)*(p2.y-p1.y) - (p1.y-p0.y)*(p2.x-p1.x);
+            if (cross > 0) positive++;
+            else if (cross < 0) negative++;
+        }
+        if (fabs(area/2) <= _min_area) continue;
+        if (positive && negative) continue;
+
+        int k[4] = {polygon[0], polygon[1], polygon[2], polygon[3]};
+        blob_corners.push_back(vector<PointDouble>(4));
+        FitQuadCorners(&contour[0], n, k, blob_corners.back(), fitted_lines, edge_buffer);
+        if (visualize) {
+            for(int j = 0; j < 4; ++j) DrawLine(image, fitted_lines[j]);
+            VisualizeCorners(image, blob_corners.back());
+        }
+    }
+}
+
+void LabelingRle::LabelSquares(IplImage* image, bool visualize)
+{
+    blob_corners.clear();
+    if (regions.empty()) {
+        PrepareGray(image);
+        Threshold();
+        FindSquares(image, cvRect(0, 0, image->width, image->height), visualize);
+    } else {
+        vector<CvRect> rects;
+        GetLabelingRegions(image->width, image->height, rects);
+        for (size_t r = 0; r < rects.size(); ++r) {
+            IplImage gray_header, bw_header;
+            PrepareGray(image, &rects[r]);
+            Threshold(SubImageHeader(gray, rects[r], &gray_header), SubImageHeader(bw, rects[r], &bw_header), thresh_param1);
+            FindSquares(image, rects[r], visualize);
+        }
+    }
+    _n_blobs = (int)blob_corners.size();
 }
 
 } // namespace alvar
@@ -0,0 +1,188 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+
+#include "ar_track_alvar/DistortionMap.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace alvar {
+
+DistortionMap::DistortionMap() : step(1), inv_step(1), x0(0), y0(0), cols(0), rows(0) {
+	memset(K, 0, sizeof(K));
+	memset(D, 0, sizeof(D));
+}
+
+void DistortionMap::UndistortNormalized(const double D[4], double &x, double &y, int iterations) {
+	// compensate distortion iteratively
+	double xx = x, yy = y;
+	for (int j = 0; j < iterations; j++) {
+		double r2 = xx*xx + yy*yy;
+		double icdist = 1./(1 + D[0]*r2 + D[1]*r2*r2);
+		double delta_x = 2*D[2]*xx*yy + D[3]*(r2 + 2*xx*xx);
+		double delta_y = D[2]*(r2 + 2*yy*yy) + 2*D[3]*xx*yy;
+		xx = (x - delta_x)*icdist;
+		yy = (y - delta_y)*icdist;
+	}
+	x = xx;
+	y = yy;
+}
+
+void DistortionMap::DistortNormalized(const double D[4], double &x, double &y) {
+	double x2 = x*x, y2 = y*y, xy = x*y;
+	double r2 = x2 + y2;
+	double d = 1 + (D[0] + D[1]*r2)*r2;
+	double xx = x*d + 2*D[2]*xy + D[3]*(r2 + 2*x2);
+	double yy = y*d + D[2]*(r2 + 2*y2) + 2*D[3]*xy;
+	x = xx;
+	y = yy;
+}
+
+void DistortionMap::UndistortExact(const double K[3][3], const double D[4], double &x, double &y, int iterations) {
+	double xx = (x - K[0][2])/K[0][0], yy = (y - K[1][2])/K[1][1];
+	UndistortNormalized(D, xx, yy, iterations);
+	x = xx*K[0][0] + K[0][2];
+	y = yy*K[1][1] + K[1][2];
+}
+
+void DistortionMap::DistortExact(const double K[3][3], const double D[4], double &x, double &y) {
+	double xx = (x - K[0][2])/K[0][0], yy = (y - K[1][2])/K[1][1];
+	DistortNormalized(D, xx, yy);
+	x = xx*K[0][0] + K[0][2];
+	y = yy*K[1][1] + K[1][2];
+}
+
+void DistortionMap::Build(const double _K[3][3], const double _D[4], int width, int height, int _step) {
+	Clear();
+	memcpy(K, _K, sizeof(K));
+	memcpy(D, _D, sizeof(D));
+	if ((D[0] == 0) && (D[1] == 0) && (D[2] == 0) && (D[3] == 0)) return;
+	if ((K[0][0] == 0) || (K[1][1] == 0) || (width <= 0) || (height <= 0)) return;
+
+	// The grids reach an eighth of the image size over the borders
+	step = (_step < 1 ? 1 : _step);
+	inv_step = 1.0/step;
+	int border = ((max(width, height)/8 + step - 1)/step)*step;
+	x0 = -border;
+	y0 = -border;
+	cols = (width + 2*border + step - 1)/step + 1;
+	rows = (height + 2*border + step - 1)/step + 1;
+
+	undistort_grid.resize(2*cols*rows);
+	distort_grid.resize(2*cols*rows);
+	for (int j=0; j<rows; j++) {
+		for (int i=0; i<cols; i++) {
+			double nx = x0 + i*step, ny = y0 + j*step;
+			double ux = nx, uy = ny;
+			UndistortExact(K, D, ux, uy);
+			double dx = nx, dy = ny;
+			DistortExact(K, D, dx, dy);
+			size_t n = 2*(j*cols + i);
+			undistort_grid[n+0] = ux - nx;
+			undistort_grid[n+1] = uy - ny;
+			distort_grid[n+0] = dx - nx;
+			distort_grid[n+1] = dy - ny;
+		}
+	}
+}
+
+void DistortionMap::Clear() {
+	cols = 0;
+	rows = 0;
+	undistort_grid.clear();
+	distort_grid.clear();
+}
+
+inline bool DistortionMap::Interpolate(const vector<double> &grid, double &x, double &y) const {
+	double gx = (x - x0)*inv_step;
+	double gy = (y - y0)*inv_step;
+	if ((gx < 0) || (gy < 0)) return false;
+	int ix = int(gx), iy = int(gy);
+	if ((ix >= cols-1) || (iy >= rows-1)) return false;
+	double tx = gx - ix, ty = gy - iy;
+	const double *g = &grid[2*(iy*cols + ix)];
+#if defined(__SSE2__)
+	// The (dx, dy) offsets of a node are interpolated as one pair
+	__m128d a = _mm_loadu_pd(g);
+	__m128d b = _mm_loadu_pd(g+2);
+	__m128d c = _mm_loadu_pd(g+2*cols);
+	__m128d d = _mm_loadu_pd(g+2*cols+2);
+	__m128d wx = _mm_set1_pd(tx);
+	__m128d top = _mm_add_pd(a, _mm_mul_pd(wx, _mm_sub_pd(b, a)));
+	__m128d bottom = _mm_add_pd(c, _mm_mul_pd(wx, _mm_sub_pd(d, c)));
+	__m128d offset = _mm_add_pd(top, _mm_mul_pd(_mm_set1_pd(ty), _mm_sub_pd(bottom, top)));
+	double o[2];
+	_mm_storeu_pd(o, offset);
+	x += o[0];
+	y += o[1];
+#else
+	const double *h = g + 2*cols;
+	double top_x = g[0] + tx*(g[2] - g[0]), top_y = g[1] + tx*(g[3] - g[1]);
+	double bottom_x = h[0] + tx*(h[2] - h[0]), bottom_y = h[1] + tx*(h[3] - h[1]);
+	x += top_x + ty*(bottom_x - top_x);
+	y += top_y + ty*(bottom_y - top_y);
+#endif
+	return true;
+}
+
+void DistortionMap::Undistort(double &x, double &y) const {
+	if (IsEmpty()) return;
+	if (!Interpolate(undistort_grid, x, y)) UndistortExact(K, D, x, y);
+}
+
+void DistortionMap::Distort(double &x, double &y) const {
+	if (IsEmpty()) return;
+	if (!Interpolate(distort_grid, x, y)) DistortExact(K, D, x, y);
+}
+
+void DistortionMap::Undistort(PointDouble *points, int count) const {
+	if (IsEmpty()) return;
+	for (int i=0; i<count; i++) {
+		if (!Interpolate(undistort_grid, points[i].x, points[i].y)) UndistortExact(K, D, points[i].x, points[i].y);
+	}
+}
+
+void DistortionMap::Undistort(CvPoint2D32f *points, int count) const {
+	if (IsEmpty()) return;
+	for (int i=0; i<count; i++) {
+		double x = points[i].x, y = points[i].y;
+		if (!Interpolate(undistort_grid, x, y)) UndistortExact(K, D, x, y);
+		points[i].x = float(x);
+		points[i].y = float(y);
+	}
+}
+
+void DistortionMap::Distort(PointDouble *points, int count) const {
+	if (IsEmpty()) return;
+	for (int i=0; i<count; i++) {
+		if (!Interpolate(distort_grid, points[i].x, points[i].y)) DistortExact(K, D, points[i].x, points[i].y);
+	}
+}
+
+} // namespace alvar
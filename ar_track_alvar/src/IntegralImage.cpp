@@ -21,7 +21,13 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "IntegralImage.h"
+#include "ar_track_alvar/IntegralImage.h"
+#include <cstring>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace alvar {
 
@@ -191,4 +197,121 @@ void IntegralGradient::GetAveGradient(CvRect &rect, double *dirx, double *diry)
 	*diry /= count;
 }
 
+
+IntegralThreshold::IntegralThreshold() {
+	sum = 0;
+	radius = 0;
+}
+IntegralThreshold::~IntegralThreshold() {
+	if (sum) cvReleaseImage(&sum);
+}
+void IntegralThreshold::Update(IplImage *gray, int block_size) {
+	radius = block_size/2;
+	int width = gray->width + 2*radius;
+	int height = gray->height + 2*radius;
+	if ((sum == 0) ||
+		(sum->width != width+1) ||
+		(sum->height != height+1))
+	{
+		if (sum) cvReleaseImage(&sum);
+		sum = cvCreateImage(cvSize(width+1, height+1), IPL_DEPTH_32S, 1);
+	}
+	// The sums are allowed to wrap around: box sums are differences
+	// of the table entries and they are correct modulo 2^32.
+	memset(sum->imageData, 0, (width+1)*sizeof(unsigned int));
+	for (int j=0; j<height; j++) {
+		int sy = j - radius;
+		if (sy < 0) sy = 0;
+		if (sy > gray->height-1) sy = gray->height-1;
+		const unsigned char *src = (const unsigned char *)(gray->imageData + sy*gray->widthStep);
+		const unsigned int *prev = (const unsigned int *)(sum->imageData + j*sum->widthStep);
+		unsigned int *curr = (unsigned int *)(sum->imageData + (j+1)*sum->widthStep);
+		unsigned int acc = 0;
+		int i = 0;
+		curr[0] = 0;
+		for (; i<radius; i++) {
+			acc += src[0];
+			curr[i+1] = prev[i+1] + acc;
+		}
+		for (int x=0; x<gray->width; x++, i++) {
+			acc += src[x];
+			curr[i+1] = prev[i+1] + acc;
+		}
+		for (; i<width; i++) {
+			acc += src[gray->width-1];
+			curr[i+1] = prev[i+1] + acc;
+		}
+	}
+}
+void IntegralThreshold::Threshold(IplImage *gray, IplImage *bw, int block_size, int param) {
+	Update(gray, block_size);
+	const int width = gray->width;
+	const int area = block_size*block_size;
+	const int half = area/2;
+#if defined(__AVX2__)
+	const __m256i v_area = _mm256_set1_epi32(area);
+	const __m256i v_half = _mm256_set1_epi32(half);
+	const __m256i v_param = _mm256_set1_epi32(param);
+	const __m128i ones = _mm_set1_epi32(-1);
+#elif defined(__SSE2__)
+	// _mm_madd_epi16 gives the 32-bit product of the low 16-bit halves
+	const __m128i v_area = _mm_set1_epi32(area);
+	const __m128i v_half = _mm_set1_epi32(half);
+	const __m128i v_param = _mm_set1_epi16((short)param);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi32(-1);
+	const bool use_sse2 = (area < 32768) && (param > -32768) && (param < 32768-255);
+#endif
+	for (int j=0; j<gray->height; j++) {
+		const unsigned char *src = (const unsigned char *)(gray->imageData + j*gray->widthStep);
+		unsigned char *dst = (unsigned char *)(bw->imageData + j*bw->widthStep);
+		const unsigned int *top = (const unsigned int *)(sum->imageData + j*sum->widthStep);
+		const unsigned int *bottom = (const unsigned int *)(sum->imageData + (j+block_size)*sum->widthStep);
+		int x = 0;
+#if defined(__AVX2__)
+		for (; x <= width-16; x+=16) {
+			__m128i s8 = _mm_loadu_si128((const __m128i *)(src+x));
+			__m256i lhs0 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_cvtepu8_epi32(s8), v_param), v_area);
+			__m256i lhs1 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(s8, 8)), v_param), v_area);
+			__m256i box0 = _mm256_add_epi32(_mm256_sub_epi32(
+				_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(bottom+x+block_size)), _mm256_loadu_si256((const __m256i *)(bottom+x))),
+				_mm256_loadu_si256((const __m256i *)(top+x+block_size))), _mm256_loadu_si256((const __m256i *)(top+x)));
+			__m256i box1 = _mm256_add_epi32(_mm256_sub_epi32(
+				_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(bottom+x+8+block_size)), _mm256_loadu_si256((const __m256i *)(bottom+x+8))),
+				_mm256_loadu_si256((const __m256i *)(top+x+8+block_size))), _mm256_loadu_si256((const __m256i *)(top+x+8)));
+			__m256i gt0 = _mm256_cmpgt_epi32(lhs0, _mm256_add_epi32(box0, v_half));
+			__m256i gt1 = _mm256_cmpgt_epi32(lhs1, _mm256_add_epi32(box1, v_half));
+			// packs works inside the 128-bit lanes; reorder the 64-bit blocks back to pixel order
+			__m256i gt16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(gt0, gt1), 0xD8);
+			__m128i gt8 = _mm_packs_epi16(_mm256_castsi256_si128(gt16), _mm256_extracti128_si256(gt16, 1));
+			_mm_storeu_si128((__m128i *)(dst+x), _mm_xor_si128(gt8, ones));
+		}
+#elif defined(__SSE2__)
+		if (use_sse2) for (; x <= width-16; x+=16) {
+			__m128i s8 = _mm_loadu_si128((const __m128i *)(src+x));
+			__m128i s16[2] = {
+				_mm_add_epi16(_mm_unpacklo_epi8(s8, zero), v_param),
+				_mm_add_epi16(_mm_unpackhi_epi8(s8, zero), v_param)
+			};
+			__m128i gt[4];
+			for (int k=0; k<4; k++) {
+				const int xx = x+k*4;
+				__m128i v = ((k & 1) ? _mm_unpackhi_epi16(s16[k>>1], zero) : _mm_unpacklo_epi16(s16[k>>1], zero));
+				__m128i lhs = _mm_madd_epi16(v, v_area);
+				__m128i box = _mm_add_epi32(_mm_sub_epi32(
+					_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(bottom+xx+block_size)), _mm_loadu_si128((const __m128i *)(bottom+xx))),
+					_mm_loadu_si128((const __m128i *)(top+xx+block_size))), _mm_loadu_si128((const __m128i *)(top+xx)));
+				gt[k] = _mm_cmpgt_epi32(lhs, _mm_add_epi32(box, v_half));
+			}
+			__m128i gt8 = _mm_packs_epi16(_mm_packs_epi32(gt[0], gt[1]), _mm_packs_epi32(gt[2], gt[3]));
+			_mm_storeu_si128((__m128i *)(dst+x), _mm_xor_si128(gt8, ones));
+		}
+#endif
+		for (; x<width; x++) {
+			int box = (int)(bottom[x+block_size] - bottom[x] - top[x+block_size] + top[x]);
+			dst[x] = (((src[x]+param)*area <= box+half) ? 255 : 0);
+		}
+	}
+}
+
 } // namespace alvar
@@ -95,6 +95,36 @@ int FitLines(vector<Line> &lines,
 	return lines.size();
 }
 
+void FitLine(const CvPoint2D32f *points, int count, float params[4])
+{
+	double x = 0, y = 0, x2 = 0, y2 = 0, xy = 0;
+	for(int i = 0; i < count; ++i)
+	{
+		double px = points[i].x;
+		double py = points[i].y;
+		x += px;
+		y += py;
+		x2 += px*px;
+		y2 += py*py;
+		xy += px*py;
+	}
+	if(count > 0)
+	{
+		x /= count; y /= count;
+		x2 /= count; y2 /= count; xy /= count;
+	}
+
+	// The direction is the principal axis of the point covariance
+	double dx2 = x2 - x*x;
+	double dy2 = y2 - y*y;
+	double dxy = xy - x*y;
+	double t = atan2(2*dxy, dx2-dy2)/2;
+	params[0] = float(cos(t));
+	params[1] = float(sin(t));
+	params[2] = float(x);
+	params[3] = float(y);
+}
+
 PointDouble Intersection(const Line& l1, const Line& l2)
 {
 
@@ -23,7 +23,11 @@
 
 #include "ar_track_alvar/Alvar.h"
 #include "ar_track_alvar/Marker.h"
+#include "ar_track_alvar/Lock.h"
 #include "highgui.h"
+#include <map>
+#include <algorithm>
+#include <cstring>
 
 template class ALVAR_EXPORT alvar::MarkerIteratorImpl<alvar::Marker>;
 template class ALVAR_EXPORT alvar::MarkerIteratorImpl<alvar::MarkerData>;
@@ -185,82 +189,97 @@ bool Marker::UpdateContent(vector<PointDouble > &_marker_corners_img, IplImage *
 	return UpdateContentBasic(_marker_corners_img, gray, cam, frame_no);
 }
 
+// Reads the gray level nearest to (x, y) or interpolates it bilinearly, (x, y) must be inside the image
+static inline int SampleGray(const IplImage *gray, double x, double y, bool bilinear) {
+	if ((gray->depth != IPL_DEPTH_8U) || (gray->nChannels != 1)) {
+		return (int)cvGetReal2D(gray, (int)(0.5+y), (int)(0.5+x));
+	}
+	if (!bilinear) {
+		const unsigned char *row = (const unsigned char *)(gray->imageData + (int)(0.5+y)*gray->widthStep);
+		return row[(int)(0.5+x)];
+	}
+	int x0 = std::max(std::min((int)x, gray->width-2), 0);
+	int y0 = std::max(std::min((int)y, gray->height-2), 0);
+	double fx = x - x0;
+	double fy = y - y0;
+	const unsigned char *p0 = (const unsigned char *)(gray->imageData + y0*gray->widthStep) + x0;
+	const unsigned char *p1 = p0 + gray->widthStep;
+	double top = p0[0] + fx*(p0[1] - p0[0]);
+	double bottom = p1[0] + fx*(p1[1] - p1[0]);
+	return (int)(0.5 + top + fy*(bottom - top));
+}
+
 bool Marker::UpdateContentBasic(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/) {
-	vector<PointDouble > marker_corners_img_undist;
-	marker_corners_img_undist.resize(_marker_corners_img.size());
-	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img_undist.begin());
+	if (!marker_content || (res <= 0)) return false;
+	const vector<PointDouble> &marker_points = geometry->points;
+	const vector<PointDouble> &marker_margin_w = geometry->margin_w;
+	const vector<PointDouble> &marker_margin_b = geometry->margin_b;
 
-	// Figure out the marker point position in the image
+	// Figure out the marker point position in the image. The corners are in the raw image
+	// coordinates, the homography is found without the distortion and the samples are distorted back.
 	Homography H;
-	vector<PointDouble> marker_points_img(marker_points.size());
-	marker_points_img.resize(marker_points.size());
-	cam->Undistort(marker_corners_img_undist);
-	H.Find(marker_corners, marker_corners_img_undist);
-	H.ProjectPoints(marker_points, marker_points_img);
-	cam->Distort(marker_points_img);
+	if ((_marker_corners_img.size() == 4) && (marker_corners.size() == 4)) {
+		PointDouble corners_undist[4];
+		copy(_marker_corners_img.begin(), _marker_corners_img.end(), corners_undist);
+		cam->Undistort(corners_undist, 4);
+		if (!H.Find(&marker_corners[0], corners_undist)) return false;
+	} else {
+		vector<PointDouble > marker_corners_img_undist(_marker_corners_img);
+		cam->Undistort(marker_corners_img_undist);
+		H.Find(marker_corners, marker_corners_img_undist);
+	}
+
+	// Project the content points and the margin samples in one pass
+	size_t n_points = marker_points.size();
+	size_t n_white = marker_margin_w.size();
+	size_t n_black = marker_margin_b.size();
+	sample_points_img.resize(n_points + n_white + n_black);
+	PointDouble *marker_points_img = &sample_points_img[0];
+	PointDouble *marker_margin_w_img = marker_points_img + n_points;
+	PointDouble *marker_margin_b_img = marker_margin_w_img + n_white;
+	if (n_points) H.ProjectPoints(&marker_points[0], marker_points_img, (int)n_points);
+	if (n_white) H.ProjectPoints(&marker_margin_w[0], marker_margin_w_img, (int)n_white);
+	if (n_black) H.ProjectPoints(&marker_margin_b[0], marker_margin_b_img, (int)n_black);
+	cam->Distort(marker_points_img, (int)sample_points_img.size());
 	
 	ros_marker_points_img.clear();
 
     // Read the content
-    int x, y;
-	double min = 255.0, max = 0.0;
-	for (int j=0; j<marker_content->height; j++) {
-		for (int i=0; i<marker_content->width; i++) {
-			x = (int)(0.5+Limit(marker_points_img[(j*marker_content->width)+i].x, 1, gray->width-2));
-			y = (int)(0.5+Limit(marker_points_img[(j*marker_content->width)+i].y, 1, gray->height-2));
-			
-			marker_points_img[(j*marker_content->width)+i].val = (int)cvGetReal2D(gray, y, x);
-			
+	int x, y;
+	for (int j=0; j<marker_content->rows; j++) {
+		unsigned char *content_row = marker_content->data.ptr + j*marker_content->step;
+		for (int i=0; i<marker_content->cols; i++) {
+			PointDouble &p = marker_points_img[(j*marker_content->cols)+i];
+			double px = Limit(p.x, 1, gray->width-2);
+			double py = Limit(p.y, 1, gray->height-2);
+			x = (int)(0.5+px);
+			y = (int)(0.5+py);
+			p.val = SampleGray(gray, px, py, bilinear_sampling);
 			ros_marker_points_img.push_back(PointDouble(x,y));
-
-			/*
-			// Use median of 5 neighbor pixels
-			vector<int> vals;
-			vals.clear();
-			vals.push_back();
-			vals.push_back((int)cvGetReal2D(gray, y-1, x));
-			vals.push_back((int)cvGetReal2D(gray, y, x-1));
-			vals.push_back((int)cvGetReal2D(gray, y+1, x));
-			vals.push_back((int)cvGetReal2D(gray, y, x+1));
-			nth_element(vals.begin(), vals.begin()+2, vals.end());
-			tmp = vals[2];
-			*/
-
-			cvSet2D(marker_content, j, i, cvScalar(marker_points_img[(j*marker_content->width)+i].val));
-			if(marker_points_img[(j*marker_content->width)+i].val > max) max = marker_points_img[(j*marker_content->width)+i].val;
-			if(marker_points_img[(j*marker_content->width)+i].val < min) min = marker_points_img[(j*marker_content->width)+i].val;
+			content_row[i] = (unsigned char)p.val;
 		}
 	}
 
 	// Take few additional points from border and just 
 	// outside the border to make the right thresholding
-	vector<PointDouble> marker_margin_w_img(marker_margin_w.size());
-	vector<PointDouble> marker_margin_b_img(marker_margin_b.size());
-	H.ProjectPoints(marker_margin_w, marker_margin_w_img);
-	H.ProjectPoints(marker_margin_b, marker_margin_b_img);
-	cam->Distort(marker_margin_w_img);
-	cam->Distort(marker_margin_b_img);
-
-	min = max = 0; // Now min and max values are averages over black and white border pixels.
-	for (size_t i=0; i<marker_margin_w_img.size(); i++) {
-		x = (int)(0.5+Limit(marker_margin_w_img[i].x, 0, gray->width-1));
-		y = (int)(0.5+Limit(marker_margin_w_img[i].y, 0, gray->height-1));
-		marker_margin_w_img[i].val = (int)cvGetReal2D(gray, y, x);
+	double min = 0, max = 0; // Averages over black and white border pixels.
+	for (size_t i=0; i<n_white; i++) {
+		double px = Limit(marker_margin_w_img[i].x, 0, gray->width-1);
+		double py = Limit(marker_margin_w_img[i].y, 0, gray->height-1);
+		marker_margin_w_img[i].val = SampleGray(gray, px, py, bilinear_sampling);
 		max += marker_margin_w_img[i].val;
-		//if(marker_margin_w_img[i].val > max) max = marker_margin_w_img[i].val;
-		//if(marker_margin_w_img[i].val < min) min = marker_margin_w_img[i].val;
 	}
-	for (size_t i=0; i<marker_margin_b_img.size(); i++) {
-		x = (int)(0.5+Limit(marker_margin_b_img[i].x, 0, gray->width-1));
-		y = (int)(0.5+Limit(marker_margin_b_img[i].y, 0, gray->height-1));
-		marker_margin_b_img[i].val = (int)cvGetReal2D(gray, y, x);
+	for (size_t i=0; i<n_black; i++) {
+		double px = Limit(marker_margin_b_img[i].x, 0, gray->width-1);
+		double py = Limit(marker_margin_b_img[i].y, 0, gray->height-1);
+		x = (int)(0.5+px);
+		y = (int)(0.5+py);
+		marker_margin_b_img[i].val = SampleGray(gray, px, py, bilinear_sampling);
 		min += marker_margin_b_img[i].val;
-		//if(marker_margin_b_img[i].val > max) max = marker_margin_b_img[i].val;
-		//if(marker_margin_b_img[i].val < min) min = marker_margin_b_img[i].val;
         ros_marker_points_img.push_back(PointDouble(x,y));
 	}
-	max /= marker_margin_w_img.size();
-	min /= marker_margin_b_img.size();
+	max /= n_white;
+	min /= n_black;
 
 	// Threshold the marker content
 	cvThreshold(marker_content, marker_content, (max+min)/2.0, 255, CV_THRESH_BINARY);
@@ -268,34 +287,33 @@ bool Marker::UpdateContentBasic(vector<PointDouble > &_marker_corners_img, IplIm
 	// Count erroneous margin nodes
 	int erroneous = 0;
 	int total = 0;
-	for (size_t i=0; i<marker_margin_w_img.size(); i++) {
+	for (size_t i=0; i<n_white; i++) {
 		if (marker_margin_w_img[i].val < (max+min)/2.0) erroneous++;
 		total++;
 	}
-	for (size_t i=0; i<marker_margin_b_img.size(); i++) {
+	for (size_t i=0; i<n_black; i++) {
 		if (marker_margin_b_img[i].val > (max+min)/2.0) erroneous++;
 		total++;
 	}
 	margin_error = (double)erroneous/total;
-	track_error;
 
 #ifdef VISUALIZE_MARKER_POINTS
 	// Now we fill also this temporary debug table for visualizing marker code reading
 	// TODO: this whole vector is only for debug purposes
 	marker_allpoints_img.clear();
-	for (size_t i=0; i<marker_margin_w_img.size(); i++) {
+	for (size_t i=0; i<n_white; i++) {
 		PointDouble p = marker_margin_w_img[i];
 		if (p.val < (max+min)/2.0) p.val=255; // error
 		else p.val=0; // ok
 		marker_allpoints_img.push_back(p);
 	}
-	for (size_t i=0; i<marker_margin_b_img.size(); i++) {
+	for (size_t i=0; i<n_black; i++) {
 		PointDouble p = marker_margin_b_img[i];
 		if (p.val > (max+min)/2.0) p.val=255; // error
 		else p.val=0; // ok
 		marker_allpoints_img.push_back(p);
 	}
-	for (size_t i=0; i<marker_points_img.size(); i++) {
+	for (size_t i=0; i<n_points; i++) {
 		PointDouble p = marker_points_img[i];
 		p.val=128; // Unknown?
 		marker_allpoints_img.push_back(p);
@@ -311,7 +329,33 @@ void Marker::UpdatePose(vector<PointDouble > &_marker_corners_img, Camera *cam,
 	if(orientation > 0)
 		std::rotate(marker_corners_img.begin(), marker_corners_img.begin() + orientation, marker_corners_img.end());
 
-	if (update_pose) cam->CalcExteriorOrientation(marker_corners, marker_corners_img, &pose);
+	if (update_pose) {
+		// The generic solver is kept for the degenerate quads
+		if (!cam->CalcExteriorOrientationPlanar(marker_corners, marker_corners_img, &pose)) {
+			cam->CalcExteriorOrientation(marker_corners, marker_corners_img, &pose);
+		}
+		UpdatePoseCovariance(cam);
+	}
+}
+void Marker::UpdatePoseCovariance(Camera *cam) {
+	if (!cam->CalcExteriorOrientationCovariance(marker_corners, marker_corners_img, &pose, pose_covariance)) {
+		memset(pose_covariance, 0, sizeof(pose_covariance));
+	}
+}
+void Marker::RefinePose(vector<PointDouble > &_marker_corners_img, Camera *cam, int orientation, double max_error /* =2.0 */) {
+	marker_corners_img.resize(_marker_corners_img.size());
+	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img.begin());
+	if(orientation > 0)
+		std::rotate(marker_corners_img.begin(), marker_corners_img.begin() + orientation, marker_corners_img.end());
+
+	// The pose from the previous frame is the initial guess, solve from scratch if it has been lost
+	double error;
+	if (!cam->RefineExteriorOrientationPlanar(marker_corners, marker_corners_img, &pose, &error) || (error > max_error)) {
+		if (!cam->CalcExteriorOrientationPlanar(marker_corners, marker_corners_img, &pose)) {
+			cam->CalcExteriorOrientation(marker_corners, marker_corners_img, &pose);
+		}
+	}
+	UpdatePoseCovariance(cam);
 }
 bool Marker::DecodeContent(int *orientation) {
 	*orientation = 0;
@@ -353,11 +397,25 @@ void Marker::ScaleMarkerToImage(IplImage *image) const {
 	cvReleaseImage(&img);
 }
 
-void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
-	// TODO: Is this right place for default marker size?
-	edge_length = (_edge_length?_edge_length:1);
-	res = _res; //(_res?_res:10);
-	margin = (_margin?_margin:1);
+struct GeometryKey {
+	double edge_length;
+	int res;
+	double margin;
+	bool operator<(const GeometryKey &k) const {
+		if (edge_length != k.edge_length) return edge_length < k.edge_length;
+		if (res != k.res) return res < k.res;
+		return margin < k.margin;
+	}
+};
+
+// The geometries are never released, an application uses only a few marker sizes
+static Mutex geometry_mutex;
+static map<GeometryKey, MarkerGeometry*> geometry_cache;
+
+static void BuildGeometry(MarkerGeometry &g) {
+	double edge_length = g.edge_length;
+	int res = g.res;
+	double margin = g.margin;
 	double x_min = -0.5*edge_length;
 	double y_min = -0.5*edge_length;
 	double x_max = 0.5*edge_length;
@@ -368,72 +426,69 @@ void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
 	double cy_max = (y_max * res)/(res + margin + margin);
 	double step = edge_length / (res + margin + margin);
 
-	// marker_corners
-	marker_corners_img.resize(4);
-
-	// Same order as the detected corners
-	marker_corners.clear();
-	marker_corners.push_back(PointDouble(x_min, y_min));
-	marker_corners.push_back(PointDouble(x_max, y_min));
-	marker_corners.push_back(PointDouble(x_max, y_max));
-	marker_corners.push_back(PointDouble(x_min, y_max));
+	// marker_corners in the same order as the detected corners
+	g.corners.clear();
+	g.corners.push_back(PointDouble(x_min, y_min));
+	g.corners.push_back(PointDouble(x_max, y_min));
+	g.corners.push_back(PointDouble(x_max, y_max));
+	g.corners.push_back(PointDouble(x_min, y_max));
 
 	// Rest can be done only if we have existing resolution
 	if (res <= 0) return;
 
 	// marker_points
-	marker_points.clear();
+	g.points.clear();
 	for(int j = 0; j < res; ++j) {
 		for(int i = 0; i < res; ++i) {
 			PointDouble  pt;
 			pt.y = cy_max - (step*j) - (step/2);
 			pt.x = cx_min + (step*i) + (step/2);
-			marker_points.push_back(pt);
+			g.points.push_back(pt);
 		}
 	}
 
 	// Samples to be used in margins
 	// TODO: Now this works only if the "margin" is without decimals
 	// TODO: This should be made a lot cleaner
-	marker_margin_w.clear();
-	marker_margin_b.clear();
+	g.margin_w.clear();
+	g.margin_b.clear();
 	for(int j = -1; j<=margin-1; j++) {
 		PointDouble  pt;
 		// Sides
 		for (int i=0; i<res; i++) {
 			pt.x = cx_min + step*i + step/2;
 			pt.y = y_min + step*j + step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 			pt.y = y_max - step*j - step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 			pt.y = cy_min + step*i + step/2;
 			pt.x = x_min + step*j + step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 			pt.x = x_max - step*j - step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 		}
 		// Corners
 		for(int i = -1; i<=margin-1; i++) {
 			pt.x = x_min + step*i + step/2;
 			pt.y = y_min + step*j + step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 			pt.x = x_min + step*i + step/2;
 			pt.y = y_max - step*j - step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 			pt.x = x_max - step*i - step/2;
 			pt.y = y_max - step*j - step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 			pt.x = x_max - step*i - step/2;
 			pt.y = y_min + step*j + step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) g.margin_w.push_back(pt);
+			else g.margin_b.push_back(pt);
 		}
 	}
 	/*
@@ -445,13 +500,13 @@ void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
 			if ((pt.x < x_min) || (pt.y < y_min) ||
 				(pt.x > x_max) || (pt.y > y_max))
 			{
-				marker_margin_w.push_back(pt);
+				g.margin_w.push_back(pt);
 			}
 			else 
 			if ((pt.x < cx_min) || (pt.y < cy_min) ||
 				(pt.x > cx_max) || (pt.y > cy_max))
 			{
-				marker_margin_b.push_back(pt);
+				g.margin_b.push_back(pt);
 			}
 		}
 	}
@@ -465,51 +520,83 @@ void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
 			if ((pt.x < x_min) || (pt.y < y_min) ||
 				(pt.x > x_max) || (pt.y > y_max))
 			{
-				marker_margin_w.push_back(pt);
+				g.margin_w.push_back(pt);
 			}
 			else 
 			if ((pt.x < cx_min) || (pt.y < cy_min) ||
 				(pt.x > cx_max) || (pt.y > cy_max))
 			{
-				marker_margin_b.push_back(pt);
+				g.margin_b.push_back(pt);
 			}
 		}
 	}
 	*/
 	/*
-	marker_margin_w.clear();
-	marker_margin_b.clear();
+	g.margin_w.clear();
+	g.margin_b.clear();
 	for (double y=y_min-(step/2); y<y_max+(step/2); y+=step) {
 		for (double x=x_min-(step/2); x<x_max+(step/2); x+=step) {
 			PointDouble pt(x, y);
 			if ((x < x_min) || (y < y_min) ||
 				(x > x_max) || (y > y_max))
 			{
-				marker_margin_w.push_back(pt);
+				g.margin_w.push_back(pt);
 			} 
 			else 
 			if ((x < cx_min) || (y < cy_min) ||
 				(x > cx_max) || (y > cy_max))
 			{
-				marker_margin_b.push_back(pt);
+				g.margin_b.push_back(pt);
 			}
 		}
 	}
 	*/
 	/*
-	marker_points.clear();
-	marker_margin_w.clear();
-	marker_margin_b.clear();
+	g.points.clear();
+	g.margin_w.clear();
+	g.margin_b.clear();
 	for(int j = 0; j < res+margin+margin+2; ++j) {
 		for(int i = 0; i < res+margin+margin+2; ++i) {
 			PointDouble  pt;
 		}
 	}
 	*/
+}
 
-	// marker content
-	if (marker_content) cvReleaseMat(&marker_content);
-	marker_content = cvCreateMat(res, res, CV_8U);
+const MarkerGeometry *MarkerGeometry::Get(double edge_length, int res, double margin) {
+	GeometryKey key;
+	key.edge_length = edge_length;
+	key.res = res;
+	key.margin = margin;
+	Lock lock(&geometry_mutex);
+	map<GeometryKey, MarkerGeometry*>::iterator iter = geometry_cache.find(key);
+	if (iter != geometry_cache.end()) return iter->second;
+	MarkerGeometry *g = new MarkerGeometry;
+	g->edge_length = edge_length;
+	g->res = res;
+	g->margin = margin;
+	BuildGeometry(*g);
+	geometry_cache[key] = g;
+	return g;
+}
+
+void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
+	// TODO: Is this right place for default marker size?
+	edge_length = (_edge_length?_edge_length:1);
+	res = _res; //(_res?_res:10);
+	margin = (_margin?_margin:1);
+	geometry = MarkerGeometry::Get(edge_length, res, margin);
+	marker_corners.assign(geometry->corners.begin(), geometry->corners.end());
+	marker_corners_img.resize(4);
+
+	// Rest can be done only if we have existing resolution
+	if (res <= 0) return;
+
+	// marker content, reused when the resolution stays the same
+	if (marker_content && ((marker_content->rows != res) || (marker_content->cols != res))) {
+		cvReleaseMat(&marker_content);
+	}
+	if (!marker_content) marker_content = cvCreateMat(res, res, CV_8U);
 	cvSet(marker_content, cvScalar(255));
 }
 Marker::~Marker() {
@@ -518,9 +605,12 @@ Marker::~Marker() {
 Marker::Marker(double _edge_length, int _res, double _margin)
 {
 	marker_content = NULL;
+	geometry = NULL;
 	margin_error = 0;
 	decode_error = 0;
 	track_error = 0;
+	bilinear_sampling = false;
+	memset(pose_covariance, 0, sizeof(pose_covariance));
 	SetMarkerSize(_edge_length, _res, _margin);
 	ros_orientation = -1;
 	ros_corners_3D.resize(4);
@@ -528,12 +618,15 @@ Marker::Marker(double _edge_length, int _res, double _margin)
 }
 Marker::Marker(const Marker& m) {
 	marker_content = NULL;
+	geometry = NULL;
 	SetMarkerSize(m.edge_length, m.res, m.margin);
 
 	pose = m.pose;
+	memcpy(pose_covariance, m.pose_covariance, sizeof(pose_covariance));
 	margin_error = m.margin_error;
 	decode_error = m.decode_error;
 	track_error = m.track_error;
+	bilinear_sampling = m.bilinear_sampling;
 	cvCopy(m.marker_content, marker_content);
     ros_orientation = m.ros_orientation;
 
@@ -541,10 +634,10 @@ Marker::Marker(const Marker& m) {
 	copy(m.ros_marker_points_img.begin(), m.ros_marker_points_img.end(), ros_marker_points_img.begin());
 	marker_corners.resize(m.marker_corners.size());
 	copy(m.marker_corners.begin(), m.marker_corners.end(), marker_corners.begin());
-	marker_points.resize(m.marker_points.size());
-	copy(m.marker_points.begin(), m.marker_points.end(), marker_points.begin());
 	marker_corners_img.resize(m.marker_corners_img.size());
 	copy(m.marker_corners_img.begin(), m.marker_corners_img.end(), marker_corners_img.begin());
+	marker_corners_img_velocity.resize(m.marker_corners_img_velocity.size());
+	copy(m.marker_corners_img_velocity.begin(), m.marker_corners_img_velocity.end(), marker_corners_img_velocity.begin());
     ros_corners_3D.resize(m.ros_corners_3D.size());
 	copy(m.ros_corners_3D.begin(), m.ros_corners_3D.end(), ros_corners_3D.begin());
 
@@ -667,7 +760,7 @@ void MarkerData::DecodeOrientation(int *error, int *total, int *orientation) {
 	//*orientation = 0; // ttehop
 }
 
-bool MarkerData::DetectResolution(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam) {
+bool MarkerData::DetectResolution(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, const vector<int> *resolutions) {
 	vector<PointDouble> marker_corners_img_undist;
 	marker_corners_img_undist.resize(_marker_corners_img.size());
 	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img_undist.begin());
@@ -742,28 +835,31 @@ bool MarkerData::DetectResolution(vector<PointDouble > &_marker_corners_img, Ipl
 		}
 	}
 
+	int new_res;
 	if ((white_count[0]+white_count[1]) == (white_count[2]+white_count[3])) return false;
 	else if ((white_count[0]+white_count[1]) > (white_count[2]+white_count[3])) {
 		if (white_count[0] != white_count[1]) return false;
 		if (white_count[0] < 2) return false;
 		int nof_whites = white_count[0]*2-(white?1:0); // 'white' contains middle color
-		int new_res = 2*nof_whites-1;
-		SetMarkerSize(edge_length, new_res, margin);
+		new_res = 2*nof_whites-1;
 	} 
 	else {
 		if (white_count[2] != white_count[3]) return false;
 		if (white_count[2] < 2) return false;
 		if (((white_count[2]%2) == 0) != white) return false;
 		int nof_whites = white_count[2]*2-(white?1:0);
-		int new_res = 2*nof_whites-1;
-		SetMarkerSize(edge_length, new_res, margin);
+		new_res = 2*nof_whites-1;
 	}
+	// The content is not read at all for the other resolutions
+	if (resolutions && !resolutions->empty() &&
+		(find(resolutions->begin(), resolutions->end(), new_res) == resolutions->end())) return false;
+	SetMarkerSize(edge_length, new_res, margin);
 	return true;
 }
 
 bool MarkerData::UpdateContent(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/) {
 	if (res == 0) {
-		if (!DetectResolution(_marker_corners_img, gray, cam)) return false;
+		if (!DetectResolution(_marker_corners_img, gray, cam, allowed_res)) return false;
 	}
 	return UpdateContentBasic(_marker_corners_img, gray, cam, frame_no);
 }
@@ -784,10 +880,10 @@ int MarkerData::DecodeCode(int orientation, BitsetExt *bs, int *erroneous, int *
 				if ((j == res/2) && (i >= (res/2)-2) && (i <= (res/2)+2)) continue;
 			}
 			int color = 0;
-			if (orientation == 0) color = (int)cvGetReal2D(marker_content, j, i);
-			else if (orientation == 1) color = (int)cvGetReal2D(marker_content, res-i-1, j);
-			else if (orientation == 2) color = (int)cvGetReal2D(marker_content, res-j-1, res-i-1);
-			else if (orientation == 3) color = (int)cvGetReal2D(marker_content, i, res-j-1);
+			if (orientation == 0) color = CV_MAT_ELEM(*marker_content, uchar, j, i);
+			else if (orientation == 1) color = CV_MAT_ELEM(*marker_content, uchar, res-i-1, j);
+			else if (orientation == 2) color = CV_MAT_ELEM(*marker_content, uchar, res-j-1, res-i-1);
+			else if (orientation == 3) color = CV_MAT_ELEM(*marker_content, uchar, i, res-j-1);
 			if (color) bs->push_back(false);
 			else bs->push_back(true);
 			(*total)++;
@@ -875,9 +971,23 @@ void MarkerData::Read6bitStr(BitsetExt *bs, char *s, size_t s_max_len) {
 	s[len] = 0;
 }
 
+bool MarkerData::DecodeContentTable(int *orientation) {
+	unsigned long id;
+	int distance;
+	if (!decode_table->Find(MarkerDataTable::Code(marker_content), decode_table_max_distance, &id, orientation, &distance)) {
+		decode_error = DBL_MAX;
+		return false;
+	}
+	content_type = MARKER_CONTENT_TYPE_NUMBER;
+	data.id = id;
+	decode_error = (double)distance/(res*res);
+	return true;
+}
+
 bool MarkerData::DecodeContent(int *orientation) {
 	//bool decode(vector<int>& colors, int *orientation, double *error) {
 	*orientation = 0;
+	if (decode_table && (decode_table->GetRes() == res)) return DecodeContentTable(orientation);
 
 	BitsetExt bs;
 	int erroneous=0;
@@ -1044,7 +1154,8 @@ void MarkerData::SetContent(MarkerContentType _content_type, unsigned long _id,
 	
 	// Fill in the marker content
 	deque<bool> bs(bs_flags.GetBits());
-	bs.insert(bs.end(), bs_data.GetBits().begin(), bs_data.GetBits().end());
+	deque<bool> bs_data_bits(bs_data.GetBits());
+	bs.insert(bs.end(), bs_data_bits.begin(), bs_data_bits.end());
 	deque<bool>::const_iterator iter = bs.begin();
 	SetMarkerSize(edge_length, res, margin);
 	cvSet(marker_content, cvScalar(255));
@@ -1066,4 +1177,138 @@ void MarkerData::SetContent(MarkerContentType _content_type, unsigned long _id,
 	}
 }
 
+MarkerDataTable::MarkerDataTable(int _res) : res(_res), hash_bits(1), min_distance(0) {
+	// Encode every id that fits into the resolution
+	MarkerData marker(1, 0, 2);
+	for (unsigned long id=0; ; id++) {
+		marker.SetContent(MarkerData::MARKER_CONTENT_TYPE_NUMBER, id, 0);
+		if (marker.GetRes() != res) break;
+		const CvMat *content = marker.GetContent();
+		for (int k=0; k<4; k++) {
+			uint64_t code = 0;
+			for (int j=0; j<res; j++) {
+				for (int i=0; i<res; i++) {
+					if (CV_MAT_ELEM(*content, uchar, j, i)) continue;
+					// The cell (j, i) is read from (r, c) in orientation k (see DecodeCode)
+					int r = j, c = i;
+					if (k == 1) { r = res-i-1; c = j; }
+					else if (k == 2) { r = res-j-1; c = res-i-1; }
+					else if (k == 3) { r = i; c = res-j-1; }
+					code |= ((uint64_t)1) << (r*res + c);
+				}
+			}
+			codes.push_back(code);
+		}
+	}
+	Build();
+}
+
+MarkerDataTable::MarkerDataTable(const MarkerDataTable &table, const vector<unsigned long> &_ids) :
+	res(table.res), hash_bits(1), min_distance(0)
+{
+	for (size_t i=0; i<_ids.size(); i++) {
+		// The position of the id in the codes of the other table
+		size_t index = _ids[i];
+		if (!table.ids.empty()) {
+			index = find(table.ids.begin(), table.ids.end(), _ids[i]) - table.ids.begin();
+		}
+		if (4*index >= table.codes.size()) continue;
+		ids.push_back(_ids[i]);
+		codes.insert(codes.end(), table.codes.begin() + 4*index, table.codes.begin() + 4*index + 4);
+	}
+	Build();
+}
+
+void MarkerDataTable::Build() {
+	min_distance = res*res;
+	for (size_t n=0; n<codes.size(); n++) {
+		for (size_t m=n+1; m<codes.size(); m++) {
+			int d = PopCount(codes[n] ^ codes[m]);
+			if (d < min_distance) min_distance = d;
+		}
+	}
+
+	while ((size_t(1) << hash_bits) < 2*codes.size()) hash_bits++;
+	slots.assign(size_t(1) << hash_bits, -1);
+	for (size_t n=0; n<codes.size(); n++) {
+		int slot = Slot(codes[n]);
+		if (slots[slot] < 0) slots[slot] = (int)n;
+	}
+}
+
+int MarkerDataTable::GetMaxDistance(const MarkerDataTable &table, int max_distance) const {
+	// volume[d] is the number of codes within d cells of a code
+	int cells = res*res;
+	vector<double> volume(cells+1, 1);
+	double term = 1;
+	for (int d=1; d<=cells; d++) {
+		term = term * (cells-d+1) / d;
+		volume[d] = volume[d-1] + term;
+	}
+	if (max_distance < 0) max_distance = 0;
+	if (max_distance > cells) max_distance = cells;
+	double matched = table.codes.size() * volume[max_distance];
+	int distance = max_distance;
+	while ((distance+1 <= (min_distance-1)/2) && (codes.size() * volume[distance+1] <= matched)) distance++;
+	return distance;
+}
+
+int MarkerDataTable::Slot(uint64_t code) const {
+	size_t mask = slots.size() - 1;
+	size_t slot = (size_t)((code * 0x9e3779b97f4a7c15ULL) >> (64 - hash_bits));
+	while ((slots[slot] >= 0) && (codes[slots[slot]] != code)) slot = (slot + 1) & mask;
+	return (int)slot;
+}
+
+uint64_t MarkerDataTable::Code(const CvMat *content) {
+	uint64_t code = 0;
+	for (int j=0; j<content->rows; j++) {
+		const uchar *row = content->data.ptr + j*content->step;
+		for (int i=0; i<content->cols; i++) {
+			if (!row[i]) code |= ((uint64_t)1) << (j*content->cols + i);
+		}
+	}
+	return code;
+}
+
+bool MarkerDataTable::Find(uint64_t code, int max_distance, unsigned long *id, int *orientation, int *distance) const {
+	int n = slots[Slot(code)];
+	if (n < 0) {
+		// The nearest code, rejected if there is another one as near
+		int best_distance = max_distance + 1;
+		bool ambiguous = false;
+		for (size_t m=0; m<codes.size(); m++) {
+			int d = PopCount(codes[m] ^ code);
+			if (d < best_distance) {
+				n = (int)m;
+				best_distance = d;
+				ambiguous = false;
+			} else if (d == best_distance) {
+				ambiguous = true;
+			}
+		}
+		if ((n < 0) || ambiguous) return false;
+		*distance = best_distance;
+	} else {
+		*distance = 0;
+	}
+	*id = (ids.empty() ? (unsigned long)(n / 4) : ids[n / 4]);
+	*orientation = n % 4;
+	return true;
+}
+
+static Mutex table_mutex;
+static map<int, MarkerDataTable*> table_cache;
+
+const MarkerDataTable *MarkerDataTable::Get(int res) {
+	// The larger resolutions have too many ids for a table
+	if (res != 5) return NULL;
+	Lock lock(&table_mutex);
+	map<int, MarkerDataTable*>::iterator iter = table_cache.find(res);
+	if (iter != table_cache.end()) return iter->second;
+	MarkerDataTable *table = new MarkerDataTable(res);
+	table_cache[res] = table;
+	return table;
+}
+
 } // namespace alvar
@@ -22,6 +22,7 @@
  */
 
 #include "ar_track_alvar/MarkerDetector.h"
+#include "ar_track_alvar/WorkerPool.h"
 
 template class ALVAR_EXPORT alvar::MarkerDetector<alvar::Marker>;
 template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerData>;
@@ -30,14 +31,50 @@ template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerArtoolkit>;
 using namespace std;
 
 namespace alvar {
+	// The outcomes of decoding a new marker candidate
+	enum {
+		DECODE_ACCEPTED,
+		DECODE_PREFILTER_REJECTED,
+		DECODE_CONTENT_REJECTED,
+		DECODE_DECODE_REJECTED,
+		DECODE_ID_REJECTED,
+		DECODE_ERROR_REJECTED
+	};
+
 	MarkerDetectorImpl::MarkerDetectorImpl() {
+		decode_threads = 1;
+		decode_pool = NULL;
+		decode_table_enabled = false;
+		decode_table_max_distance = 1;
+		decode_table = NULL;
+		allowed_table = NULL;
+		flow_gray = NULL;
+		flow_prev_gray = NULL;
+		flow_pyramid = NULL;
+		flow_prev_pyramid = NULL;
 		SetMarkerSize();
 		SetOptions();
+		SetThresholdMethod();
+		SetPixelFormat();
+		SetPyramidLevels();
+		SetRoiTracking();
+		SetFlowTracking();
+		SetLabelingThreads();
+		SetPrefilter();
+		SetBilinearSampling();
+		SetDecodeTable();
+		SetAllowedIds();
+		SetAllowedResolutions();
+		SetDecodeThreads();
 		labeling = NULL;
 	}
 
 	MarkerDetectorImpl::~MarkerDetectorImpl() {
 		if (labeling) delete labeling;
+		if (decode_pool) delete decode_pool;
+		if (allowed_table) delete allowed_table;
+		ClearDecodeScratch();
+		ReleaseFlowImages();
 	}
 
 	void MarkerDetectorImpl::TrackMarkersReset() {
@@ -51,6 +88,7 @@ namespace alvar {
 		}
 
 		mn->SetId(id);
+		mn->SetBilinearSampling(bilinear_sampling);
 		mn->marker_corners_img.clear();
 		mn->marker_corners_img.push_back(corners[0]);
 		mn->marker_corners_img.push_back(corners[1]);
@@ -65,6 +103,8 @@ namespace alvar {
 		res = _res;
 		margin = _margin;
 		map_edge_length.clear(); // TODO: Should we clear these here?
+		ClearDecodeScratch();
+		UpdateDecodeTable();
   }
 
 	void MarkerDetectorImpl::SetMarkerSizeForId(unsigned long id, double _edge_length) {
@@ -75,6 +115,505 @@ namespace alvar {
 		detect_pose_grayscale = _detect_pose_grayscale;
 	}
 
+	void MarkerDetectorImpl::SetThresholdMethod(Labeling::ThresholdMethod _thresh_method) {
+		thresh_method = _thresh_method;
+	}
+
+	void MarkerDetectorImpl::SetPixelFormat(Labeling::PixelFormat _pixel_format) {
+		pixel_format = _pixel_format;
+	}
+
+	void MarkerDetectorImpl::SetPyramidLevels(int _levels, double _tolerance) {
+		pyramid_levels = _levels;
+		pyramid_tolerance = _tolerance;
+	}
+
+	void MarkerDetectorImpl::SetLabelingThreads(int _threads) {
+		labeling_threads = _threads;
+	}
+
+	void MarkerDetectorImpl::SetBilinearSampling(bool _enable) {
+		bilinear_sampling = _enable;
+	}
+
+	void MarkerDetectorImpl::SetDecodeTable(bool _enable, int _max_distance) {
+		decode_table_enabled = _enable;
+		decode_table_max_distance = _max_distance;
+		UpdateDecodeTable();
+	}
+
+	void MarkerDetectorImpl::SetAllowedIds(const vector<unsigned long> &ids) {
+		allowed_ids.clear();
+		allowed_ids.insert(ids.begin(), ids.end());
+		UpdateDecodeTable();
+	}
+
+	void MarkerDetectorImpl::SetAllowedResolutions(const vector<int> &resolutions) {
+		allowed_res = resolutions;
+		res_hints.clear();
+		res_hints_next.clear();
+	}
+
+	void MarkerDetectorImpl::AddResolutionHint(const Marker *mn) {
+		if ((res > 0) || (mn->GetRes() <= 0) || (mn->marker_corners_img.size() != 4)) return;
+		ResolutionHint hint;
+		hint.center.x = 0; hint.center.y = 0;
+		for (size_t j=0; j<4; j++) {
+			hint.center.x += 0.25*mn->marker_corners_img[j].x;
+			hint.center.y += 0.25*mn->marker_corners_img[j].y;
+		}
+		hint.size = 0;
+		for (size_t j=0; j<4; j++) {
+			hint.size = max(hint.size, PointSquaredDistance(mn->marker_corners_img[j], hint.center));
+		}
+		hint.size = sqrt(hint.size);
+		hint.res = mn->GetRes();
+		res_hints_next.push_back(hint);
+	}
+
+	int MarkerDetectorImpl::FindResolutionHint(const vector<PointDouble> &corners) const {
+		if (res > 0) return res;
+		if (allowed_res.size() == 1) return allowed_res[0];
+		if (corners.size() != 4) return 0;
+		PointDouble center(0, 0);
+		for (size_t j=0; j<4; j++) {
+			center.x += 0.25*corners[j].x;
+			center.y += 0.25*corners[j].y;
+		}
+		double size = 0;
+		for (size_t j=0; j<4; j++) size = max(size, PointSquaredDistance(corners[j], center));
+		size = sqrt(size);
+
+		// The nearest marker whose center is inside the quad and whose size is about the same
+		int best_res = 0;
+		double best_dist = 1e200;
+		for (size_t i=0; i<res_hints.size(); i++) {
+			const ResolutionHint &hint = res_hints[i];
+			double dist = PointSquaredDistance(center, hint.center);
+			if ((dist > 0.25*size*size) || (size < 0.5*hint.size) || (size > 2*hint.size)) continue;
+			if (dist < best_dist) {
+				best_dist = dist;
+				best_res = hint.res;
+			}
+		}
+		return best_res;
+	}
+
+	void MarkerDetectorImpl::MatchTracks(IplImage *image, vector<vector<PointDouble> > &blob_corners, double max_track_error) {
+		size_t n_tracks = _track_markers_size();
+		TrackMatch none;
+		none.error = 1e200;
+		none.track = 0;
+		none.blob = -1;
+		none.orientation = 0;
+		track_matches.assign(n_tracks, none);
+		track_candidates.clear();
+
+		// The blob center can be at most max_track_error times the marker diagonal away from
+		// the tracked center, as the error is the RMS corner distance relative to the diagonal
+		double gate_sum = 0;
+		int gate_count = 0;
+		for (size_t ii=0; ii<n_tracks; ii++) {
+			Marker *mn = _track_markers_at(ii);
+			if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue; // We track only perfectly decoded markers
+			if (mn->marker_corners_img.size() != 4) continue;
+			const vector<PointDouble> &c = mn->marker_corners_img;
+			gate_sum += max_track_error*sqrt(max(PointSquaredDistance(c[0], c[2]), PointSquaredDistance(c[1], c[3])));
+			gate_count++;
+		}
+		if (gate_count == 0) return;
+
+		// Bucket the blob centers into a uniform grid with cells of about the average gate
+		double cell = max(8.0, gate_sum/gate_count);
+		int cols = int(image->width/cell) + 1;
+		int rows = int(image->height/cell) + 1;
+		int n_blobs = (int)blob_corners.size();
+		blob_centers.resize(n_blobs);
+		blob_grid_start.assign(cols*rows + 1, 0);
+		blob_grid.resize(n_blobs);
+		blob_cells.assign(n_blobs, -1);
+		for (int i=0; i<n_blobs; i++) {
+			if (blob_corners[i].size() != 4) continue;
+			PointDouble &center = blob_centers[i];
+			center.x = 0; center.y = 0;
+			for (size_t j=0; j<4; j++) {
+				center.x += 0.25*blob_corners[i][j].x;
+				center.y += 0.25*blob_corners[i][j].y;
+			}
+			int cx = min(max(int(center.x/cell), 0), cols-1);
+			int cy = min(max(int(center.y/cell), 0), rows-1);
+			blob_cells[i] = cy*cols + cx;
+			blob_grid_start[blob_cells[i]]++;
+		}
+		// Counting sort, the cells are filled from their ends so that the starts remain
+		for (int k=1; k<=cols*rows; k++) blob_grid_start[k] += blob_grid_start[k-1];
+		for (int i=n_blobs-1; i>=0; i--) {
+			if (blob_cells[i] >= 0) blob_grid[--blob_grid_start[blob_cells[i]]] = i;
+		}
+
+		// Compare the corners only for the blobs within the gate
+		for (size_t ii=0; ii<n_tracks; ii++) {
+			Marker *mn = _track_markers_at(ii);
+			if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue;
+			if (mn->marker_corners_img.size() != 4) continue;
+			const vector<PointDouble> &c = mn->marker_corners_img;
+			double gate = max_track_error*sqrt(max(PointSquaredDistance(c[0], c[2]), PointSquaredDistance(c[1], c[3])));
+			PointDouble center(0.25*(c[0].x + c[1].x + c[2].x + c[3].x), 0.25*(c[0].y + c[1].y + c[2].y + c[3].y));
+			int x0 = min(max(int(floor((center.x - gate)/cell)), 0), cols-1);
+			int x1 = min(max(int(floor((center.x + gate)/cell)), 0), cols-1);
+			int y0 = min(max(int(floor((center.y - gate)/cell)), 0), rows-1);
+			int y1 = min(max(int(floor((center.y + gate)/cell)), 0), rows-1);
+			for (int y=y0; y<=y1; y++) {
+				for (int x=x0; x<=x1; x++) {
+					int k = y*cols + x;
+					for (int p=blob_grid_start[k]; p<blob_grid_start[k+1]; p++) {
+						int i = blob_grid[p];
+						if (PointSquaredDistance(center, blob_centers[i]) > gate*gate) continue;
+						TrackMatch m;
+						m.track = ii;
+						m.blob = i;
+						mn->CompareCorners(blob_corners[i], &m.orientation, &m.error);
+						if (m.error <= max_track_error) track_candidates.push_back(m);
+					}
+				}
+			}
+		}
+
+		// Greedy assignment by the error
+		sort(track_candidates.begin(), track_candidates.end());
+		for (size_t k=0; k<track_candidates.size(); k++) {
+			const TrackMatch &m = track_candidates[k];
+			if ((blob_cells[m.blob] < 0) || (track_matches[m.track].blob >= 0)) continue;
+			blob_cells[m.blob] = -1;
+			track_matches[m.track] = m;
+		}
+	}
+
+	void MarkerDetectorImpl::UpdateDecodeTable() {
+		if (allowed_table) {
+			delete allowed_table;
+			allowed_table = NULL;
+		}
+		decode_table = (decode_table_enabled ? MarkerDataTable::Get(res) : NULL);
+		decode_table_distance = decode_table_max_distance;
+		decode_table_error = 0;
+		if (!decode_table || allowed_ids.empty()) return;
+
+		// The allowed codes are further apart than all the codes, so more cells can be corrected
+		vector<unsigned long> ids(allowed_ids.begin(), allowed_ids.end());
+		allowed_table = new MarkerDataTable(*decode_table, ids);
+		decode_table_distance = allowed_table->GetMaxDistance(*decode_table, decode_table_max_distance);
+		decode_table = allowed_table;
+		// The cells corrected beyond decode_table_max_distance are not counted in the decode error
+		decode_table_error = double(decode_table_distance - decode_table_max_distance) / (res*res);
+	}
+
+	double MarkerDetectorImpl::DecodeError(const Marker *mn) const {
+		if (decode_table_error <= 0) return mn->GetError(Marker::MARGIN_ERROR | Marker::DECODE_ERROR);
+		double decode_error = max(0.0, mn->GetError(Marker::DECODE_ERROR) - decode_table_error);
+		return (mn->GetError(Marker::MARGIN_ERROR) + decode_error) / 2;
+	}
+
+	void MarkerDetectorImpl::SetDecodeThreads(int _threads) {
+		if (_threads == decode_threads && (_threads <= 1 || decode_pool)) return;
+		decode_threads = _threads;
+		if (decode_pool) {
+			delete decode_pool;
+			decode_pool = NULL;
+		}
+		if (decode_threads > 1) decode_pool = new WorkerPool(decode_threads);
+	}
+
+	void MarkerDetectorImpl::ClearDecodeScratch() {
+		for (size_t i=0; i<decode_scratch.size(); i++) {
+			delete decode_scratch[i];
+		}
+		decode_scratch.clear();
+	}
+
+	void MarkerDetectorImpl::DecodeJob(void *detector, int slice) {
+		((MarkerDetectorImpl *)detector)->DecodeSlice(slice);
+	}
+
+	void MarkerDetectorImpl::DecodeSlice(int slice) {
+		vector<vector<PointDouble> >& blob_corners = labeling->blob_corners;
+		IplImage* gray = labeling->gray;
+		Marker *&mn = decode_scratch[slice];
+
+		for (size_t k=slice; k<decode_candidates.size(); k+=decode_slices) {
+			vector<PointDouble> &corners = blob_corners[decode_candidates[k]];
+			int quad_res = FindResolutionHint(corners);
+			if (!PrefilterQuad(corners, gray, quad_res)) {
+				decode_outcomes[k] = DECODE_PREFILTER_REJECTED;
+				continue;
+			}
+
+			// The candidates reuse the scratch marker of the slice
+			if (!mn) mn = new_M(edge_length, res, margin);
+			mn->SetBilinearSampling(bilinear_sampling);
+			MarkerData *md = dynamic_cast<MarkerData *>(mn);
+			if (md) {
+				md->SetDecodeTable(decode_table, decode_table_distance);
+				md->SetAllowedResolutions(&allowed_res);
+			}
+			int orientation;
+			if (quad_res != mn->GetRes()) mn->SetMarkerSize(edge_length, quad_res, margin);
+			bool ub = mn->UpdateContent(corners, gray, decode_cam);
+			bool db = ub && mn->DecodeContent(&orientation);
+			if (!db && (quad_res != res) && (allowed_res.size() != 1)) {
+				// The marker near the quad was not this one, detect the resolution
+				mn->SetMarkerSize(edge_length, res, margin);
+				ub = mn->UpdateContent(corners, gray, decode_cam);
+				db = ub && mn->DecodeContent(&orientation);
+			}
+			if (!ub) decode_outcomes[k] = DECODE_CONTENT_REJECTED;
+			else if (!db) decode_outcomes[k] = DECODE_DECODE_REJECTED;
+			else if (!allowed_ids.empty() && !allowed_ids.count(mn->GetId())) decode_outcomes[k] = DECODE_ID_REJECTED;
+			else if (DecodeError(mn) > decode_max_error) decode_outcomes[k] = DECODE_ERROR_REJECTED;
+			else
+			{
+				decode_outcomes[k] = DECODE_ACCEPTED;
+				map<unsigned long, double>::const_iterator size_iter = map_edge_length.find(mn->GetId());
+				if (size_iter != map_edge_length.end()) {
+					mn->SetMarkerSize(size_iter->second, mn->GetRes(), margin);
+				}
+				mn->UpdatePose(corners, decode_cam, orientation, 0, decode_update_pose);
+				mn->ros_orientation = orientation;
+				decode_results[k] = mn;
+				mn = NULL;
+				continue;
+			}
+
+			// The automatic resolution detection may have resized the marker
+			if (mn->GetRes() != res) mn->SetMarkerSize(edge_length, res, margin);
+		}
+	}
+
+	void MarkerDetectorImpl::SetRoiTracking(bool _enable, int _full_scan_interval, double _padding) {
+		roi_tracking = _enable;
+		roi_full_scan_interval = _full_scan_interval;
+		roi_padding = _padding;
+		roi_frame_count = 0;
+	}
+
+	void MarkerDetectorImpl::SetFlowTracking(bool _enable, int _keyframe_interval, int _win_size, int _pyr_levels, double _max_flow_error) {
+		flow_tracking = _enable;
+		flow_keyframe_interval = _keyframe_interval;
+		flow_win_size = _win_size;
+		flow_pyr_levels = _pyr_levels;
+		flow_max_error = _max_flow_error;
+		flow_frame_count = 0;
+		if (!flow_tracking) ReleaseFlowImages();
+	}
+
+	void MarkerDetectorImpl::ReleaseFlowImages() {
+		if (flow_gray) cvReleaseImage(&flow_gray);
+		if (flow_prev_gray) cvReleaseImage(&flow_prev_gray);
+		if (flow_pyramid) cvReleaseImage(&flow_pyramid);
+		if (flow_prev_pyramid) cvReleaseImage(&flow_prev_pyramid);
+		flow_gray_valid = false;
+		flow_prev_gray_valid = false;
+		flow_pyramid_ready = false;
+		flow_prev_pyramid_ready = false;
+	}
+
+	void MarkerDetectorImpl::StoreFlowGray(IplImage *gray) {
+		if (flow_gray && ((flow_gray->width != gray->width) || (flow_gray->height != gray->height))) {
+			ReleaseFlowImages();
+		}
+		if (!flow_gray) {
+			flow_gray = cvCreateImage(cvGetSize(gray), IPL_DEPTH_8U, 1);
+			flow_prev_gray = cvCreateImage(cvGetSize(gray), IPL_DEPTH_8U, 1);
+			// The pyramid buffer size required by cvCalcOpticalFlowPyrLK
+			flow_pyramid = cvCreateImage(cvSize(gray->width+8, gray->height/3), IPL_DEPTH_8U, 1);
+			flow_prev_pyramid = cvCreateImage(cvSize(gray->width+8, gray->height/3), IPL_DEPTH_8U, 1);
+		}
+		IplImage *tmp;
+		CV_SWAP(flow_prev_gray, flow_gray, tmp);
+		CV_SWAP(flow_prev_pyramid, flow_pyramid, tmp);
+		flow_prev_gray_valid = flow_gray_valid;
+		flow_prev_pyramid_ready = flow_pyramid_ready;
+		flow_pyramid_ready = false;
+		cvCopy(gray, flow_gray);
+		flow_gray_valid = true;
+	}
+
+	// The sign of the turn at every corner of a quad, zero if the quad is not strictly convex
+	static int QuadTurn(const PointDouble *c) {
+		int sign = 0;
+		for (int j=0; j<4; j++) {
+			const PointDouble &a = c[j], &b = c[(j+1)%4], &d = c[(j+2)%4];
+			double cross = (b.x-a.x)*(d.y-b.y) - (b.y-a.y)*(d.x-b.x);
+			int s = (cross > 0 ? 1 : (cross < 0 ? -1 : 0));
+			if ((s == 0) || ((sign != 0) && (s != sign))) return 0;
+			sign = s;
+		}
+		return sign;
+	}
+
+	bool MarkerDetectorImpl::TrackFlow(IplImage *image, Camera *cam, bool update_pose, bool visualize, double max_track_error) {
+		if (!flow_prev_gray_valid) return false;
+
+		// The corners of the perfectly decoded tracked markers, the others are dropped as in Detect
+		flow_points_prev.clear();
+		for (size_t ii=0; ii<_track_markers_size(); ii++) {
+			Marker *mn = _track_markers_at(ii);
+			if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue;
+			if (mn->marker_corners_img.size() != 4) continue;
+			for (size_t j=0; j<4; j++) {
+				flow_points_prev.push_back(cvPoint2D32f(mn->marker_corners_img[j].x, mn->marker_corners_img[j].y));
+			}
+		}
+		int n = (int)flow_points_prev.size();
+		if (n == 0) return false;
+
+		// Forward and backward flow, the pyramids are reused when they are ready
+		flow_points.resize(n);
+		flow_points_back.resize(n);
+		flow_status.resize(n);
+		flow_status_back.resize(n);
+		CvTermCriteria criteria = cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS, 20, 0.03);
+		cvCalcOpticalFlowPyrLK(flow_prev_gray, flow_gray, flow_prev_pyramid, flow_pyramid,
+			&flow_points_prev[0], &flow_points[0], n, cvSize(flow_win_size, flow_win_size), flow_pyr_levels,
+			&flow_status[0], 0, criteria, (flow_prev_pyramid_ready ? CV_LKFLOW_PYR_A_READY : 0));
+		cvCalcOpticalFlowPyrLK(flow_gray, flow_prev_gray, flow_pyramid, flow_prev_pyramid,
+			&flow_points[0], &flow_points_back[0], n, cvSize(flow_win_size, flow_win_size), flow_pyr_levels,
+			&flow_status_back[0], 0, criteria, CV_LKFLOW_PYR_A_READY|CV_LKFLOW_PYR_B_READY);
+		flow_pyramid_ready = true;
+		flow_prev_pyramid_ready = true;
+
+		// Check every marker before changing any of them
+		for (int i=0; i<n; i++) {
+			if (!flow_status[i] || !flow_status_back[i]) return false;
+			double dx = flow_points_back[i].x - flow_points_prev[i].x;
+			double dy = flow_points_back[i].y - flow_points_prev[i].y;
+			if (dx*dx + dy*dy > flow_max_error*flow_max_error) return false;
+		}
+		vector<PointDouble> corners(4);
+		int k = 0;
+		for (size_t ii=0; ii<_track_markers_size(); ii++) {
+			Marker *mn = _track_markers_at(ii);
+			if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue;
+			if (mn->marker_corners_img.size() != 4) continue;
+			for (size_t j=0; j<4; j++) corners[j] = PointDouble(flow_points[k+j].x, flow_points[k+j].y);
+			k += 4;
+			if (QuadTurn(&corners[0]) != QuadTurn(&mn->marker_corners_img[0])) return false;
+			int orientation;
+			double error;
+			mn->CompareCorners(corners, &orientation, &error);
+			if ((orientation != 0) || (error > max_track_error)) return false;
+		}
+
+		// The corners are already in the marker order
+		k = 0;
+		for (size_t ii=0; ii<_track_markers_size(); ii++) {
+			Marker *mn = _track_markers_at(ii);
+			if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue;
+			if (mn->marker_corners_img.size() != 4) continue;
+			for (size_t j=0; j<4; j++) corners[j] = PointDouble(flow_points[k+j].x, flow_points[k+j].y);
+			k += 4;
+			int orientation;
+			double error;
+			mn->CompareCorners(corners, &orientation, &error);
+			mn->SetError(Marker::TRACK_ERROR, error);
+			mn->UpdateContent(corners, flow_gray, cam);
+			vector<PointDouble> prev_corners = mn->marker_corners_img;
+			if (update_pose) mn->RefinePose(corners, cam, 0);
+			else mn->UpdatePose(corners, cam, 0, 0, false);
+			mn->marker_corners_img_velocity.resize(4);
+			for (size_t j=0; j<4; j++) {
+				mn->marker_corners_img_velocity[j].x = mn->marker_corners_img[j].x - prev_corners[j].x;
+				mn->marker_corners_img_velocity[j].y = mn->marker_corners_img[j].y - prev_corners[j].y;
+			}
+			_markers_push_back(mn);
+			AddResolutionHint(mn);
+			stats.flow_tracked++;
+			if (visualize) mn->Visualize(image, cam, CV_RGB(255,0,255));
+		}
+		return true;
+	}
+
+	void MarkerDetectorImpl::SetPrefilter(bool _enable, double _min_contrast, double _max_error) {
+		prefilter = _enable;
+		prefilter_min_contrast = _min_contrast;
+		prefilter_max_error = _max_error;
+	}
+
+	bool MarkerDetectorImpl::PrefilterQuad(const vector<PointDouble> &corners, IplImage *gray, int quad_res) {
+		if (!prefilter || (quad_res <= 0) || (corners.size() != 4)) return true;
+
+		// The middle of the black border and half a cell outside the marker as fractions of the edge
+		double cells = quad_res + margin + margin;
+		double offsets[2] = {0.5*margin/cells, -0.5/cells};
+		const double along[3] = {0.3, 0.5, 0.7};
+
+		int values[2][12];
+		int counts[2] = {0, 0};
+		double sums[2] = {0, 0};
+		for (int side=0; side<4; side++) {
+			for (int k=0; k<3; k++) {
+				for (int ring=0; ring<2; ring++) {
+					double d = offsets[ring];
+					double u, v;
+					if (side == 0)      { u = along[k]; v = d; }
+					else if (side == 1) { u = 1-d; v = along[k]; }
+					else if (side == 2) { u = along[k]; v = 1-d; }
+					else                { u = d; v = along[k]; }
+					// The bilinear interpolation of the corners is close enough for these samples
+					double x = (1-u)*(1-v)*corners[0].x + u*(1-v)*corners[1].x + u*v*corners[2].x + (1-u)*v*corners[3].x;
+					double y = (1-u)*(1-v)*corners[0].y + u*(1-v)*corners[1].y + u*v*corners[2].y + (1-u)*v*corners[3].y;
+					if ((x < 0) || (y < 0) || (x > gray->width-1) || (y > gray->height-1)) continue;
+					const unsigned char *row = (const unsigned char *)(gray->imageData + int(y+0.5)*gray->widthStep);
+					int val = row[int(x+0.5)];
+					values[ring][counts[ring]++] = val;
+					sums[ring] += val;
+				}
+			}
+		}
+		// Too few samples inside the image to judge
+		if ((counts[0] < 6) || (counts[1] < 6)) return true;
+
+		double black = sums[0]/counts[0];
+		double white = sums[1]/counts[1];
+		if (white - black < prefilter_min_contrast) return false;
+
+		double mid = (black + white)/2;
+		int erroneous = 0;
+		for (int i=0; i<counts[0]; i++) if (values[0][i] > mid) erroneous++;
+		for (int i=0; i<counts[1]; i++) if (values[1][i] < mid) erroneous++;
+		return (erroneous <= prefilter_max_error*(counts[0]+counts[1]));
+	}
+
+	void MarkerDetectorImpl::PredictTrackRegions(IplImage *image, vector<CvRect> &regions) {
+		regions.clear();
+		for (size_t ii=0; ii<_track_markers_size(); ii++) {
+			Marker *mn = _track_markers_at(ii);
+			if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue; // We track only perfectly decoded markers
+			if (mn->marker_corners_img.size() != 4) continue;
+			bool has_velocity = (mn->marker_corners_img_velocity.size() == 4);
+
+			// Constant velocity prediction of the corners
+			double x0=1e200, y0=1e200, x1=-1e200, y1=-1e200;
+			for (size_t j=0; j<4; j++) {
+				double x = mn->marker_corners_img[j].x;
+				double y = mn->marker_corners_img[j].y;
+				if (has_velocity) {
+					x += mn->marker_corners_img_velocity[j].x;
+					y += mn->marker_corners_img_velocity[j].y;
+				}
+				x0 = min(x0, x); y0 = min(y0, y);
+				x1 = max(x1, x); y1 = max(y1, y);
+			}
+			double pad = roi_padding*max(x1-x0, y1-y0);
+			int rx0 = max(int(x0-pad), 0);
+			int ry0 = max(int(y0-pad), 0);
+			int rx1 = min(int(x1+pad)+1, image->width);
+			int ry1 = min(int(y1+pad)+1, image->height);
+			if ((rx1 <= rx0) || (ry1 <= ry0)) continue;
+			regions.push_back(cvRect(rx0, ry0, rx1-rx0, ry1-ry0));
+		}
+	}
+
 	int MarkerDetectorImpl::Detect(IplImage *image,
 			   Camera *cam,
 			   bool track,
@@ -85,82 +624,164 @@ namespace alvar {
 			   bool update_pose)
 	{
 		assert(image->origin == 0); // Currently only top-left origin supported
-		double error=-1;
 
 		// Swap marker tables
 		_swap_marker_tables();
 		_markers_clear();
+		stats = DetectStats();
 
 		switch(labeling_method)
 		{
 			case CVSEQ :
 		
-				if(!labeling)
+				if(!dynamic_cast<LabelingCvSeq*>(labeling)) {
+					delete labeling;
 					labeling = new LabelingCvSeq();
-				((LabelingCvSeq*)labeling)->SetOptions(detect_pose_grayscale);
+				}
+				((LabelingCvSeq*)labeling)->SetPyramid(pyramid_levels, pyramid_tolerance);
+				((LabelingCvSeq*)labeling)->SetThreads(labeling_threads);
+				break;
+
+			case RLE :
+
+				if(!dynamic_cast<LabelingRle*>(labeling)) {
+					delete labeling;
+					labeling = new LabelingRle();
+				}
 				break;
 		}
 
+		// The visualization draws into the image, so it can not be used as the gray image then
+		Labeling::PixelFormat labeling_format = pixel_format;
+		if (visualize && (pixel_format == Labeling::PIXEL_MONO8)) labeling_format = Labeling::PIXEL_AUTO;
+
+		// Between the keyframes the tracked markers are moved with the optical flow
+		bool flow_stored = false;
+		if (track && flow_tracking && (flow_frame_count < flow_keyframe_interval) && (_track_markers_size() > 0)) {
+			labeling->SetPixelFormat(labeling_format);
+			labeling->UpdateGray(image);
+			StoreFlowGray(labeling->gray);
+			flow_stored = true;
+			if (TrackFlow(image, cam, update_pose, visualize, max_track_error)) {
+				flow_frame_count++;
+				res_hints.swap(res_hints_next);
+				res_hints_next.clear();
+				return (int) _markers_size();
+			}
+		}
+		flow_frame_count = 0;
+
+		// With the region tracking only the predicted marker regions are labeled between the full scans
+		vector<CvRect> regions;
+		if (track && roi_tracking && (roi_frame_count < roi_full_scan_interval)) {
+			PredictTrackRegions(image, regions);
+		}
+		if (regions.empty()) roi_frame_count = 0;
+		else roi_frame_count++;
+
 		labeling->SetCamera(cam);
+		labeling->SetOptions(detect_pose_grayscale);
+		labeling->SetThreshMethod(thresh_method);
+		labeling->SetPixelFormat(labeling_format);
+		labeling->SetRegions(regions);
+		// The flow keyframe needs the whole frame, the regions alone would leave stale pixels around them
+		if (flow_tracking && !flow_stored && !regions.empty()) labeling->UpdateGray(image);
 		labeling->LabelSquares(image, visualize);
 		vector<vector<PointDouble> >& blob_corners = labeling->blob_corners;
 		IplImage* gray = labeling->gray;
+		if (flow_tracking && !flow_stored) StoreFlowGray(gray);
 
-		int orientation;
-
-		// When tracking we find the best matching blob and test if it is near enough?
+		// When tracking we match the blobs near enough to the tracked markers
 		if (track) {
+			MatchTracks(image, blob_corners, max_track_error);
 			for (size_t ii=0; ii<_track_markers_size(); ii++) {
 				Marker *mn = _track_markers_at(ii);
 				if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue; // We track only perfectly decoded markers
-				int track_i=-1;
-				int track_orientation=0;
-				double track_error=1e200;
-				for(unsigned i = 0; i < blob_corners.size()/*blobs_ret.size()*/; ++i) {
-					if (blob_corners[i].empty()) continue;
-					mn->CompareCorners(blob_corners[i], &orientation, &error);
-					if (error < track_error) {
-						track_i = i;
-						track_orientation = orientation;
-						track_error = error;
-					}
-				}
-				if (track_error <= max_track_error) {
+				int track_i = track_matches[ii].blob;
+				int track_orientation = track_matches[ii].orientation;
+				double track_error = track_matches[ii].error;
+				if (track_i >= 0) {
 					mn->SetError(Marker::DECODE_ERROR, 0);
 					mn->SetError(Marker::MARGIN_ERROR, 0);
 					mn->SetError(Marker::TRACK_ERROR, track_error);
                     mn->UpdateContent(blob_corners[track_i], gray, cam);    //Maybe should only do this when kinect is being used? Don't think it hurts anything...
-					mn->UpdatePose(blob_corners[track_i], cam, track_orientation, update_pose);
+					vector<PointDouble> prev_corners = mn->marker_corners_img;
+					if (update_pose) mn->RefinePose(blob_corners[track_i], cam, track_orientation);
+					else mn->UpdatePose(blob_corners[track_i], cam, track_orientation, 0, false);
+					if (prev_corners.size() == 4) {
+						mn->marker_corners_img_velocity.resize(4);
+						for (size_t j=0; j<4; j++) {
+							mn->marker_corners_img_velocity[j].x = mn->marker_corners_img[j].x - prev_corners[j].x;
+							mn->marker_corners_img_velocity[j].y = mn->marker_corners_img[j].y - prev_corners[j].y;
+						}
+					}
 					_markers_push_back(mn);
+					AddResolutionHint(mn);
 					blob_corners[track_i].clear(); // We don't want to handle this again...
 					if (visualize) mn->Visualize(image, cam, CV_RGB(255,255,0));
+				} else if (!regions.empty()) {
+					// Lost the track, scan the whole image in the next frame
+					roi_frame_count = roi_full_scan_interval;
 				}
 			}
 		}
 
 		// Now we go through the rest of the blobs -- in case there are new markers...
+		decode_candidates.clear();
 		for(size_t i = 0; i < blob_corners.size(); ++i)
 		{
-			if (blob_corners[i].empty()) continue;
+			if (!blob_corners[i].empty()) decode_candidates.push_back(i);
+		}
+		stats.candidates = (int)decode_candidates.size();
 
-			Marker *mn = new_M(edge_length, res, margin);
-			bool ub = mn->UpdateContent(blob_corners[i], gray, cam);
-            bool db = mn->DecodeContent(&orientation); 
-			if (ub && db &&
-				(mn->GetError(Marker::MARGIN_ERROR | Marker::DECODE_ERROR) <= max_new_marker_error))
+		// The resolutions of the markers found in the previous frame or tracked in this one
+		res_hints.insert(res_hints.end(), res_hints_next.begin(), res_hints_next.end());
+
+		// The candidates are decoded in interleaved slices, each slice with its own scratch marker
+		int n_candidates = (int)decode_candidates.size();
+		decode_slices = (decode_pool ? min(decode_pool->size(), n_candidates) : 1);
+		if (decode_slices < 1) decode_slices = 1;
+		if ((int)decode_scratch.size() < decode_slices) decode_scratch.resize(decode_slices, NULL);
+		decode_results.assign(n_candidates, NULL);
+		decode_outcomes.assign(n_candidates, DECODE_PREFILTER_REJECTED);
+		decode_cam = cam;
+		decode_max_error = max_new_marker_error;
+		decode_update_pose = update_pose;
+		if (decode_slices > 1) decode_pool->run(DecodeJob, this, decode_slices);
+		else DecodeSlice(0);
+
+		// Merge the results in the blob order so that the output does not depend on the threads
+		size_t free_slot = 0;
+		for (int k = 0; k < n_candidates; ++k)
+		{
+			switch (decode_outcomes[k])
 			{
-				if (map_edge_length.find(mn->GetId()) != map_edge_length.end()) {
-					mn->SetMarkerSize(map_edge_length[mn->GetId()], res, margin);
-				}
-				mn->UpdatePose(blob_corners[i], cam, orientation, update_pose);
-                mn->ros_orientation = orientation;
-				_markers_push_back(mn);
- 
-				if (visualize) mn->Visualize(image, cam, CV_RGB(255,0,0));
+				case DECODE_PREFILTER_REJECTED: stats.prefilter_rejected++; break;
+				case DECODE_CONTENT_REJECTED: stats.content_rejected++; break;
+				case DECODE_DECODE_REJECTED: stats.decode_rejected++; break;
+				case DECODE_ID_REJECTED: stats.id_rejected++; break;
+				case DECODE_ERROR_REJECTED: stats.error_rejected++; break;
+				default: stats.accepted++; break;
 			}
+			Marker *mn = decode_results[k];
+			if (!mn) continue;
+			_markers_push_back(mn);
+			AddResolutionHint(mn);
 
-			delete mn;
+			if (visualize) mn->Visualize(image, cam, CV_RGB(255,0,0));
+
+			// The merged marker replaces the scratch marker its slice gave away
+			while ((free_slot < decode_scratch.size()) && decode_scratch[free_slot]) free_slot++;
+			if (free_slot < decode_scratch.size()) {
+				mn->SetMarkerSize(edge_length, res, margin);
+				decode_scratch[free_slot] = mn;
+			} else {
+				delete mn;
+			}
 		}
+		decode_results.clear();
+		res_hints.swap(res_hints_next);
+		res_hints_next.clear();
 
 		return (int) _markers_size();
 	}
@@ -169,31 +790,21 @@ namespace alvar {
 	{
 		assert(image->origin == 0); // Currently only top-left origin supported
 		if(!labeling) return -1;
-		double error=-1;
-		int orientation;
 		int count=0;
 		vector<vector<PointDouble> >& blob_corners = labeling->blob_corners;
 
+		MatchTracks(image, blob_corners, max_track_error);
 		for (size_t ii=0; ii<_track_markers_size(); ii++) {
 			Marker *mn = _track_markers_at(ii);
 			if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue; // We track only perfectly decoded markers
-			int track_i=-1;
-			int track_orientation=0;
-			double track_error=1e200;
-			for(unsigned i = 0; i < blob_corners.size(); ++i) {
-				if (blob_corners[i].empty()) continue;
-				mn->CompareCorners(blob_corners[i], &orientation, &error);
-				if (error < track_error) {
-					track_i = i;
-					track_orientation = orientation;
-					track_error = error;
-				}
-			}
-			if (track_error <= max_track_error) {
+			int track_i = track_matches[ii].blob;
+			int track_orientation = track_matches[ii].orientation;
+			double track_error = track_matches[ii].error;
+			if (track_i >= 0) {
 				mn->SetError(Marker::DECODE_ERROR, 0);
 				mn->SetError(Marker::MARGIN_ERROR, 0);
 				mn->SetError(Marker::TRACK_ERROR, track_error);
-				mn->UpdatePose(blob_corners[track_i], cam, track_orientation);
+				mn->RefinePose(blob_corners[track_i], cam, track_orientation);
 				_markers_push_back(mn);
 				count++;
 				blob_corners[track_i].clear(); // We don't want to handle this again...
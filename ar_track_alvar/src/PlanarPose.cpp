@@ -0,0 +1,376 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+
+#include "ar_track_alvar/PlanarPose.h"
+#include <cmath>
+#include <cstring>
+
+namespace alvar {
+
+// Solves A x = b in place with Gaussian elimination (A is n x n, row-major), b gets the solution
+static bool SolveLinear(double *A, double *b, int n) {
+	for (int c=0; c<n; c++) {
+		int pivot = c;
+		for (int r=c+1; r<n; r++) {
+			if (fabs(A[r*n+c]) > fabs(A[pivot*n+c])) pivot = r;
+		}
+		if (fabs(A[pivot*n+c]) < 1e-12) return false;
+		if (pivot != c) {
+			for (int k=0; k<n; k++) {
+				double tmp = A[c*n+k]; A[c*n+k] = A[pivot*n+k]; A[pivot*n+k] = tmp;
+			}
+			double tmp = b[c]; b[c] = b[pivot]; b[pivot] = tmp;
+		}
+		for (int r=c+1; r<n; r++) {
+			double f = A[r*n+c]/A[c*n+c];
+			if (f == 0) continue;
+			for (int k=c; k<n; k++) A[r*n+k] -= f*A[c*n+k];
+			b[r] -= f*b[c];
+		}
+	}
+	for (int c=n-1; c>=0; c--) {
+		double sum = b[c];
+		for (int k=c+1; k<n; k++) sum -= A[c*n+k]*b[k];
+		b[c] = sum/A[c*n+c];
+	}
+	return true;
+}
+
+// The homography (with H[8] = 1) from the model points to the image points in least squares sense
+static bool FindHomography(const double *model, const double *image, int count, double H[9]) {
+	double AtA[64] = {0};
+	double Atb[8] = {0};
+	for (int i=0; i<count; i++) {
+		double X = model[2*i], Y = model[2*i+1];
+		double x = image[2*i], y = image[2*i+1];
+		double rows[2][8] = {
+			{X, Y, 1, 0, 0, 0, -x*X, -x*Y},
+			{0, 0, 0, X, Y, 1, -y*X, -y*Y}
+		};
+		double rhs[2] = {x, y};
+		for (int r=0; r<2; r++) {
+			for (int j=0; j<8; j++) {
+				if (rows[r][j] == 0) continue;
+				for (int k=0; k<8; k++) AtA[j*8+k] += rows[r][j]*rows[r][k];
+				Atb[j] += rows[r][j]*rhs[r];
+			}
+		}
+	}
+	if (!SolveLinear(AtA, Atb, 8)) return false;
+	memcpy(H, Atb, sizeof(double)*8);
+	H[8] = 1;
+	return true;
+}
+
+// The two IPPE rotations from the image point v of the model origin and the Jacobian J there
+static bool IppeRotations(double p, double q, const double J[4], double R1[9], double R2[9]) {
+	// Rv rotates the z-axis to the direction of the ray through v
+	double t = sqrt(p*p + q*q);
+	double s = sqrt(p*p + q*q + 1);
+	double Rv[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	if (t > 1e-12) {
+		double kx = -q/t, ky = p/t;
+		double c = 1/s, sn = t/s;
+		Rv[0] = 1 + (1-c)*(kx*kx-1); Rv[1] = (1-c)*kx*ky;         Rv[2] = sn*ky;
+		Rv[3] = (1-c)*kx*ky;         Rv[4] = 1 + (1-c)*(ky*ky-1); Rv[5] = -sn*kx;
+		Rv[6] = -sn*ky;              Rv[7] = sn*kx;               Rv[8] = c;
+	}
+
+	// A = B^-1 J, where B = [I | -v] Rv[:, 0:2]
+	double b00 = Rv[0] - p*Rv[6], b01 = Rv[1] - p*Rv[7];
+	double b10 = Rv[3] - q*Rv[6], b11 = Rv[4] - q*Rv[7];
+	double det = b00*b11 - b01*b10;
+	if (fabs(det) < 1e-12) return false;
+	double a00 = ( b11*J[0] - b01*J[2])/det, a01 = ( b11*J[1] - b01*J[3])/det;
+	double a10 = (-b10*J[0] + b00*J[2])/det, a11 = (-b10*J[1] + b00*J[3])/det;
+
+	// The largest singular value of A scales it to the upper-left block of a rotation
+	double ata00 = a00*a00 + a10*a10, ata01 = a00*a01 + a10*a11, ata11 = a01*a01 + a11*a11;
+	double gamma = sqrt(0.5*(ata00 + ata11 + sqrt((ata00-ata11)*(ata00-ata11) + 4*ata01*ata01)));
+	if (gamma < 1e-12) return false;
+	double r00 = a00/gamma, r01 = a01/gamma, r10 = a10/gamma, r11 = a11/gamma;
+
+	// The third row of the first two columns, orthogonal to each other
+	double c0 = sqrt(fabs(1 - r00*r00 - r10*r10));
+	double c1 = sqrt(fabs(1 - r01*r01 - r11*r11));
+	if (r00*r01 + r10*r11 > 0) c1 = -c1;
+
+	for (int k=0; k<2; k++) {
+		double sign = (k == 0 ? 1 : -1);
+		double col0[3] = {r00, r10, sign*c0};
+		double col1[3] = {r01, r11, sign*c1};
+		double col2[3] = {
+			col0[1]*col1[2] - col0[2]*col1[1],
+			col0[2]*col1[0] - col0[0]*col1[2],
+			col0[0]*col1[1] - col0[1]*col1[0]
+		};
+		double *R = (k == 0 ? R1 : R2);
+		for (int i=0; i<3; i++) {
+			R[i*3+0] = Rv[i*3+0]*col0[0] + Rv[i*3+1]*col0[1] + Rv[i*3+2]*col0[2];
+			R[i*3+1] = Rv[i*3+0]*col1[0] + Rv[i*3+1]*col1[1] + Rv[i*3+2]*col1[2];
+			R[i*3+2] = Rv[i*3+0]*col2[0] + Rv[i*3+1]*col2[1] + Rv[i*3+2]*col2[2];
+		}
+	}
+	return true;
+}
+
+// The translation minimizing the algebraic reprojection error for the rotation R
+static bool SolveTranslation(const double *model, const double *image, int count, const double R[9], double tra[3]) {
+	double AtA[9] = {0};
+	double Atb[3] = {0};
+	for (int i=0; i<count; i++) {
+		double X = model[2*i], Y = model[2*i+1];
+		double x = image[2*i], y = image[2*i+1];
+		double Q0 = R[0]*X + R[1]*Y, Q1 = R[3]*X + R[4]*Y, Q2 = R[6]*X + R[7]*Y;
+		// tx - x*tz = x*Q2 - Q0 and ty - y*tz = y*Q2 - Q1
+		double bx = x*Q2 - Q0, by = y*Q2 - Q1;
+		AtA[0] += 1;  AtA[2] += -x;
+		AtA[4] += 1;  AtA[5] += -y;
+		AtA[8] += x*x + y*y;
+		Atb[0] += bx;
+		Atb[1] += by;
+		Atb[2] += -x*bx - y*by;
+	}
+	AtA[6] = AtA[2];
+	AtA[7] = AtA[5];
+	if (!SolveLinear(AtA, Atb, 3)) return false;
+	memcpy(tra, Atb, sizeof(double)*3);
+	return true;
+}
+
+// The sum of squared reprojection errors on normalized image plane
+static double ReprojectionError(const double *model, const double *image, int count, const double R[9], const double tra[3]) {
+	double error = 0;
+	for (int i=0; i<count; i++) {
+		double X = model[2*i], Y = model[2*i+1];
+		double Z = R[6]*X + R[7]*Y + tra[2];
+		if (Z <= 0) return HUGE_VAL;
+		double dx = (R[0]*X + R[1]*Y + tra[0])/Z - image[2*i];
+		double dy = (R[3]*X + R[4]*Y + tra[1])/Z - image[2*i+1];
+		error += dx*dx + dy*dy;
+	}
+	return error;
+}
+
+// The rotation exp([w]x) R
+static void RotateBy(const double w[3], const double R[9], double Rn[9]) {
+	double theta = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+	double dR[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	if (theta > 1e-15) {
+		// Rodrigues formula
+		double kx = w[0]/theta, ky = w[1]/theta, kz = w[2]/theta;
+		double c = cos(theta), sn = sin(theta), v = 1 - c;
+		dR[0] = c + kx*kx*v;    dR[1] = kx*ky*v - kz*sn; dR[2] = kx*kz*v + ky*sn;
+		dR[3] = ky*kx*v + kz*sn; dR[4] = c + ky*ky*v;    dR[5] = ky*kz*v - kx*sn;
+		dR[6] = kz*kx*v - ky*sn; dR[7] = kz*ky*v + kx*sn; dR[8] = c + kz*kz*v;
+	}
+	for (int i=0; i<3; i++) {
+		for (int j=0; j<3; j++) {
+			Rn[i*3+j] = dR[i*3+0]*R[0*3+j] + dR[i*3+1]*R[1*3+j] + dR[i*3+2]*R[2*3+j];
+		}
+	}
+}
+
+// The Gauss-Newton normal equations J^T J and J^T r of the reprojection error for the
+// parameters (w, t) of the update R = exp([w]x) R, t = t + dt. Jtr is skipped when image is NULL.
+static void NormalEquations(const double *model, const double *image, int count, const double R[9], const double tra[3],
+                            double JtJ[36], double Jtr[6]) {
+	memset(JtJ, 0, sizeof(double)*36);
+	if (image) memset(Jtr, 0, sizeof(double)*6);
+	for (int i=0; i<count; i++) {
+		double X = model[2*i], Y = model[2*i+1];
+		double P[3] = {R[0]*X + R[1]*Y, R[3]*X + R[4]*Y, R[6]*X + R[7]*Y};
+		double iz = 1/(P[2] + tra[2]);
+		double u = (P[0] + tra[0])*iz, v = (P[1] + tra[1])*iz;
+		// d(u,v)/dC and dC/d(w,t) = [-[P]x | I]
+		double du[3] = {iz, 0, -u*iz};
+		double dv[3] = {0, iz, -v*iz};
+		double rows[2][6] = {
+			{P[1]*du[2] - P[2]*du[1], P[2]*du[0] - P[0]*du[2], P[0]*du[1] - P[1]*du[0], du[0], du[1], du[2]},
+			{P[1]*dv[2] - P[2]*dv[1], P[2]*dv[0] - P[0]*dv[2], P[0]*dv[1] - P[1]*dv[0], dv[0], dv[1], dv[2]}
+		};
+		for (int k=0; k<2; k++) {
+			for (int a=0; a<6; a++) {
+				for (int b=0; b<6; b++) JtJ[a*6+b] += rows[k][a]*rows[k][b];
+			}
+		}
+		if (image) {
+			double r[2] = {image[2*i] - u, image[2*i+1] - v};
+			for (int k=0; k<2; k++) {
+				for (int a=0; a<6; a++) Jtr[a] += rows[k][a]*r[k];
+			}
+		}
+	}
+}
+
+// Levenberg-Marquardt steps for the reprojection error, the rotation is updated as R = exp([w]x) R.
+// Returns the sum of the squared errors.
+static double Refine(const double *model, const double *image, int count, double R[9], double tra[3], int iterations) {
+	double error = ReprojectionError(model, image, count, R, tra);
+	if (error == HUGE_VAL) return error;
+	double lambda = 1e-3;
+	for (int iter=0; iter<iterations; iter++) {
+		double JtJ[36], Jtr[6];
+		NormalEquations(model, image, count, R, tra, JtJ, Jtr);
+
+		// Try the damped steps until the error decreases
+		bool improved = false;
+		while (!improved && (lambda < 1e6)) {
+			double A[36], delta[6];
+			memcpy(A, JtJ, sizeof(A));
+			memcpy(delta, Jtr, sizeof(delta));
+			for (int a=0; a<6; a++) A[a*6+a] *= 1 + lambda;
+			if (!SolveLinear(A, delta, 6)) return error;
+			double Rn[9], tn[3] = {tra[0] + delta[3], tra[1] + delta[4], tra[2] + delta[5]};
+			RotateBy(delta, R, Rn);
+			double new_error = ReprojectionError(model, image, count, Rn, tn);
+			if (new_error < error) {
+				memcpy(R, Rn, sizeof(Rn));
+				memcpy(tra, tn, sizeof(tn));
+				// Stop when the error does not decrease any more
+				bool converged = (error - new_error < 1e-6*error);
+				error = new_error;
+				lambda *= 0.1;
+				improved = true;
+				if (converged) return error;
+			} else {
+				lambda *= 10;
+			}
+		}
+		if (!improved) break;
+	}
+	return error;
+}
+
+// The model centered and scaled to unit size, returns false if all the points are the same
+static bool NormalizeModel(const double *model, int count, double *centered, double &mx, double &my, double &scale) {
+	mx = 0;
+	my = 0;
+	for (int i=0; i<count; i++) {
+		mx += model[2*i];
+		my += model[2*i+1];
+	}
+	mx /= count;
+	my /= count;
+	scale = 0;
+	for (int i=0; i<count; i++) {
+		scale += (model[2*i]-mx)*(model[2*i]-mx) + (model[2*i+1]-my)*(model[2*i+1]-my);
+	}
+	scale = sqrt(scale/count);
+	if (scale <= 0) return false;
+	for (int i=0; i<count; i++) {
+		centered[2*i] = (model[2*i]-mx)/scale;
+		centered[2*i+1] = (model[2*i+1]-my)/scale;
+	}
+	return true;
+}
+
+int PlanarPose::Solve(const double *model, const double *image, int count,
+                      double rot[2][9], double tra[2][3], double error[2], int iterations)
+{
+	if ((count < 4) || (count > MAX_POINTS)) return 0;
+
+	// Center the model and scale it to unit size to condition the homography
+	double centered[2*MAX_POINTS];
+	double mx, my, scale;
+	if (!NormalizeModel(model, count, centered, mx, my, scale)) return 0;
+
+	int n = 0;
+	double H[9];
+	if (FindHomography(centered, image, count, H)) {
+		double J[4] = {H[0] - H[6]*H[2], H[1] - H[7]*H[2], H[3] - H[6]*H[5], H[4] - H[7]*H[5]};
+		double R[2][9];
+		if (IppeRotations(H[2], H[5], J, R[0], R[1])) {
+			for (int k=0; k<2; k++) {
+				double t[3];
+				if (!SolveTranslation(centered, image, count, R[k], t)) continue;
+				double e = Refine(centered, image, count, R[k], t, iterations);
+				if (e == HUGE_VAL) continue;
+				memcpy(rot[n], R[k], sizeof(double)*9);
+				// Back to the original model coordinates
+				for (int i=0; i<3; i++) {
+					tra[n][i] = scale*t[i] - R[k][i*3+0]*mx - R[k][i*3+1]*my;
+				}
+				error[n] = e;
+				n++;
+			}
+		}
+	}
+
+	if ((n == 2) && (error[1] < error[0])) {
+		double tmp[9];
+		memcpy(tmp, rot[0], sizeof(tmp)); memcpy(rot[0], rot[1], sizeof(tmp)); memcpy(rot[1], tmp, sizeof(tmp));
+		memcpy(tmp, tra[0], sizeof(double)*3); memcpy(tra[0], tra[1], sizeof(double)*3); memcpy(tra[1], tmp, sizeof(double)*3);
+		double e = error[0]; error[0] = error[1]; error[1] = e;
+	}
+	return n;
+}
+
+double PlanarPose::Refine(const double *model, const double *image, int count,
+                          double rot[9], double tra[3], int iterations)
+{
+	if ((count < 3) || (count > MAX_POINTS)) return HUGE_VAL;
+	double centered[2*MAX_POINTS];
+	double mx, my, scale;
+	if (!NormalizeModel(model, count, centered, mx, my, scale)) return HUGE_VAL;
+
+	// The translation for the normalized model
+	double t[3];
+	for (int i=0; i<3; i++) {
+		t[i] = (tra[i] + rot[i*3+0]*mx + rot[i*3+1]*my)/scale;
+	}
+	double R[9];
+	memcpy(R, rot, sizeof(R));
+	double error = alvar::Refine(centered, image, count, R, t, iterations);
+	if (error == HUGE_VAL) return error;
+	memcpy(rot, R, sizeof(R));
+	for (int i=0; i<3; i++) {
+		tra[i] = scale*t[i] - R[i*3+0]*mx - R[i*3+1]*my;
+	}
+	return error;
+}
+
+bool PlanarPose::Covariance(const double *model, int count, const double rot[9], const double tra[3],
+                            double variance, double cov[36])
+{
+	if ((count < 3) || (count > MAX_POINTS)) return false;
+	for (int i=0; i<count; i++) {
+		if (rot[6]*model[2*i] + rot[7]*model[2*i+1] + tra[2] <= 0) return false;
+	}
+	double JtJ[36];
+	NormalEquations(model, NULL, count, rot, tra, JtJ, NULL);
+
+	// The parameters are (w, t), the covariance is ordered (t, w)
+	static const int order[6] = {3, 4, 5, 0, 1, 2};
+	for (int b=0; b<6; b++) {
+		double A[36], x[6] = {0};
+		memcpy(A, JtJ, sizeof(A));
+		x[order[b]] = 1;
+		if (!SolveLinear(A, x, 6)) return false;
+		for (int a=0; a<6; a++) cov[a*6+b] = variance*x[order[a]];
+	}
+	return true;
+}
+
+} // namespace alvar
@@ -0,0 +1,313 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#include "ar_track_alvar/PoseTracker.h"
+#include <cmath>
+
+using namespace std;
+
+namespace alvar {
+using namespace std;
+
+// State layout of KalmanPose
+static const int POSE_T = 0;
+static const int POSE_V = 3;
+static const int POSE_Q = 6;
+static const int POSE_W = 10;
+static const int POSE_N = 13;
+
+// The derivative dq/dtheta (4x3) of a left multiplied small rotation theta
+static void QuatJacobian(const double q[4], double m[12]) {
+	m[0]  = -0.5*q[1]; m[1]  = -0.5*q[2]; m[2]  = -0.5*q[3];
+	m[3]  =  0.5*q[0]; m[4]  =  0.5*q[3]; m[5]  = -0.5*q[2];
+	m[6]  = -0.5*q[3]; m[7]  =  0.5*q[0]; m[8]  =  0.5*q[1];
+	m[9]  =  0.5*q[2]; m[10] = -0.5*q[1]; m[11] =  0.5*q[0];
+}
+
+static void QuatNormalize(double q[4]) {
+	double len = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+	if (len <= 0) { q[0] = 1; q[1] = q[2] = q[3] = 0; return; }
+	for (int i=0; i<4; i++) q[i] /= len;
+}
+
+void KalmanPose::f(CvMat *_x, CvMat *_x_pred, double dt) {
+	const double *xs = _x->data.db;
+	double *xp = _x_pred->data.db;
+	for (int i=0; i<3; i++) {
+		xp[POSE_T+i] = xs[POSE_T+i] + dt*xs[POSE_V+i];
+		xp[POSE_V+i] = xs[POSE_V+i];
+		xp[POSE_W+i] = xs[POSE_W+i];
+	}
+	// q_pred = exp(w*dt) * q
+	double a[3] = { xs[POSE_W]*dt, xs[POSE_W+1]*dt, xs[POSE_W+2]*dt };
+	double theta = sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+	double dq[4];
+	if (theta > 1e-12) {
+		double s = sin(theta/2)/theta;
+		dq[0] = cos(theta/2); dq[1] = a[0]*s; dq[2] = a[1]*s; dq[3] = a[2]*s;
+	} else {
+		dq[0] = 1; dq[1] = a[0]/2; dq[2] = a[1]/2; dq[3] = a[2]/2;
+	}
+	const double *q = xs + POSE_Q;
+	double *qp = xp + POSE_Q;
+	qp[0] = dq[0]*q[0] - dq[1]*q[1] - dq[2]*q[2] - dq[3]*q[3];
+	qp[1] = dq[0]*q[1] + dq[1]*q[0] + dq[2]*q[3] - dq[3]*q[2];
+	qp[2] = dq[0]*q[2] - dq[1]*q[3] + dq[2]*q[0] + dq[3]*q[1];
+	qp[3] = dq[0]*q[3] + dq[1]*q[2] - dq[2]*q[1] + dq[3]*q[0];
+	QuatNormalize(qp);
+}
+
+void KalmanPose::update_F(unsigned long tick) {
+	KalmanEkf::update_F(tick);
+
+	// Discrete white noise acceleration for both the translation and the
+	// rotation; the rotation part is mapped into the quaternion with dq/dtheta
+	double dt = (tick-prev_tick)/1000.0;
+	double dt2 = dt*dt, dt3 = dt2*dt, dt4 = dt3*dt;
+	double qa = acceleration_noise*acceleration_noise;
+	double qw = angular_acceleration_noise*angular_acceleration_noise;
+	double m[12];
+	QuatJacobian(x->data.db + POSE_Q, m);
+	cvZero(Q);
+	for (int i=0; i<3; i++) {
+		cvmSet(Q, POSE_T+i, POSE_T+i, qa*dt4/4);
+		cvmSet(Q, POSE_T+i, POSE_V+i, qa*dt3/2);
+		cvmSet(Q, POSE_V+i, POSE_T+i, qa*dt3/2);
+		cvmSet(Q, POSE_V+i, POSE_V+i, qa*dt2);
+		cvmSet(Q, POSE_W+i, POSE_W+i, qw*dt2);
+	}
+	for (int j=0; j<4; j++) {
+		for (int i=0; i<4; i++) {
+			double mm = 0;
+			for (int k=0; k<3; k++) mm += m[j*3+k]*m[i*3+k];
+			cvmSet(Q, POSE_Q+j, POSE_Q+i, qw*dt4/4*mm);
+		}
+		for (int k=0; k<3; k++) {
+			cvmSet(Q, POSE_Q+j, POSE_W+k, qw*dt3/2*m[j*3+k]);
+			cvmSet(Q, POSE_W+k, POSE_Q+j, qw*dt3/2*m[j*3+k]);
+		}
+	}
+}
+
+void KalmanPose::SetMeasurement(const double tra[3], const double quat[4], const double cov[36]) {
+	const double *q = x->data.db + POSE_Q;
+	double *z = sensor.z->data.db;
+	double sign = (quat[0]*q[0] + quat[1]*q[1] + quat[2]*q[2] + quat[3]*q[3] < 0 ? -1 : 1);
+	for (int i=0; i<3; i++) z[i] = tra[i];
+	for (int i=0; i<4; i++) z[3+i] = sign*quat[i];
+	QuatNormalize(z+3);
+
+	// R = J*cov*trans(J) where J maps (t, theta) into (t, q). The small
+	// diagonal term keeps the quaternion block invertible along q itself.
+	double m[12];
+	QuatJacobian(z+3, m);
+	double j[7*6] = {0};
+	for (int i=0; i<3; i++) j[i*6+i] = 1;
+	for (int r=0; r<4; r++) {
+		for (int c=0; c<3; c++) j[(3+r)*6+3+c] = m[r*3+c];
+	}
+	double jc[7*6];
+	for (int r=0; r<7; r++) {
+		for (int c=0; c<6; c++) {
+			double sum = 0;
+			for (int k=0; k<6; k++) sum += j[r*6+k]*cov[k*6+c];
+			jc[r*6+c] = sum;
+		}
+	}
+	for (int r=0; r<7; r++) {
+		for (int c=0; c<7; c++) {
+			double sum = 0;
+			for (int k=0; k<6; k++) sum += jc[r*6+k]*j[c*6+k];
+			if (r == c && r >= 3) sum += 1e-9;
+			cvmSet(sensor.R, r, c, sum);
+		}
+	}
+}
+
+KalmanPose::KalmanPose(double _acceleration_noise, double _angular_acceleration_noise)
+	: KalmanEkf(POSE_N), sensor(POSE_N, 7)
+{
+	acceleration_noise = _acceleration_noise;
+	angular_acceleration_noise = _angular_acceleration_noise;
+	initialized = false;
+	cvZero(sensor.H);
+	for (int i=0; i<3; i++) cvmSet(sensor.H, i, POSE_T+i, 1);
+	for (int i=0; i<4; i++) cvmSet(sensor.H, 3+i, POSE_Q+i, 1);
+}
+
+void KalmanPose::Update(unsigned long tick, const double tra[3], const double quat[4], const double cov[36]) {
+	if (!initialized) {
+		// Start from the measurement itself; the velocities are unknown and
+		// get the uncertainty of one second of acceleration
+		cvZero(x);
+		cvmSet(x, POSE_Q, 0, 1);
+		SetMeasurement(tra, quat, cov);
+		for (int i=0; i<7; i++) {
+			cvmSet(x, (i < 3 ? POSE_T+i : POSE_Q+i-3), 0, cvmGet(sensor.z, i, 0));
+		}
+		cvZero(P);
+		for (int r=0; r<7; r++) {
+			for (int c=0; c<7; c++) {
+				cvmSet(P, (r < 3 ? POSE_T+r : POSE_Q+r-3), (c < 3 ? POSE_T+c : POSE_Q+c-3), cvmGet(sensor.R, r, c));
+			}
+		}
+		for (int i=0; i<3; i++) {
+			cvmSet(P, POSE_V+i, POSE_V+i, acceleration_noise*acceleration_noise);
+			cvmSet(P, POSE_W+i, POSE_W+i, angular_acceleration_noise*angular_acceleration_noise);
+		}
+		prev_tick = tick;
+		initialized = true;
+		return;
+	}
+	if (tick < (unsigned long)prev_tick) tick = prev_tick;
+	SetMeasurement(tra, quat, cov);
+	predict_update(&sensor, tick);
+	QuatNormalize(x->data.db + POSE_Q);
+}
+
+void KalmanPose::Predict(unsigned long tick, double tra[3], double quat[4], double cov[36]) {
+	if (tick < (unsigned long)prev_tick) tick = prev_tick;
+	predict(tick);
+	const double *xp = x_pred->data.db;
+	for (int i=0; i<3; i++) tra[i] = xp[POSE_T+i];
+	for (int i=0; i<4; i++) quat[i] = xp[POSE_Q+i];
+	QuatNormalize(quat);
+	if (!cov) return;
+
+	// theta = 2*trans(Xi)*dq where Xi = 2*dq/dtheta has orthonormal columns,
+	// so (t, theta) = N*(t, q) with N = [I 0; 0 4*trans(dq/dtheta)]
+	double m[12];
+	QuatJacobian(quat, m);
+	double nm[6*7] = {0};
+	for (int i=0; i<3; i++) nm[i*7+i] = 1;
+	for (int r=0; r<3; r++) {
+		for (int c=0; c<4; c++) nm[(3+r)*7+3+c] = 4*m[c*3+r];
+	}
+	double p[7*7];
+	for (int r=0; r<7; r++) {
+		for (int c=0; c<7; c++) {
+			p[r*7+c] = cvmGet(P_pred, (r < 3 ? POSE_T+r : POSE_Q+r-3), (c < 3 ? POSE_T+c : POSE_Q+c-3));
+		}
+	}
+	double np[6*7];
+	for (int r=0; r<6; r++) {
+		for (int c=0; c<7; c++) {
+			double sum = 0;
+			for (int k=0; k<7; k++) sum += nm[r*7+k]*p[k*7+c];
+			np[r*7+c] = sum;
+		}
+	}
+	for (int r=0; r<6; r++) {
+		for (int c=0; c<6; c++) {
+			double sum = 0;
+			for (int k=0; k<7; k++) sum += np[r*7+k]*nm[c*7+k];
+			cov[r*6+c] = sum;
+		}
+	}
+}
+
+unsigned long PoseTracker::Tick(double time) {
+	if (!started) {
+		start_time = time;
+		started = true;
+	}
+	// Tick zero is reserved for "never updated" in Kalman
+	double ms = (time - start_time)*1000.0;
+	return (ms > 0 ? (unsigned long)(ms + 0.5) : 0) + 1;
+}
+
+PoseTracker::PoseTracker(double _timeout, double _acceleration_noise, double _angular_acceleration_noise,
+	double _position_sigma, double _rotation_sigma)
+{
+	timeout = _timeout;
+	acceleration_noise = _acceleration_noise;
+	angular_acceleration_noise = _angular_acceleration_noise;
+	position_sigma = _position_sigma;
+	rotation_sigma = _rotation_sigma;
+	start_time = 0;
+	started = false;
+}
+
+PoseTracker::~PoseTracker() {
+	Reset();
+}
+
+void PoseTracker::Reset() {
+	for (map<int, KalmanPose *>::iterator it = filters.begin(); it != filters.end(); ++it) {
+		delete it->second;
+	}
+	filters.clear();
+	started = false;
+}
+
+void PoseTracker::Update(int id, double time, const double tra[3], const double quat[4], const double *cov) {
+	double default_cov[36] = {0};
+	bool has_cov = false;
+	if (cov) {
+		for (int i=0; i<6; i++) if (cov[i*6+i] > 0) has_cov = true;
+	}
+	if (!has_cov) {
+		for (int i=0; i<3; i++) {
+			default_cov[i*6+i] = position_sigma*position_sigma;
+			default_cov[(3+i)*6+3+i] = rotation_sigma*rotation_sigma;
+		}
+		cov = default_cov;
+	}
+
+	unsigned long tick = Tick(time);
+	KalmanPose *&filter = filters[id];
+	if (!filter) filter = new KalmanPose(acceleration_noise, angular_acceleration_noise);
+	else if (tick > filter->GetUpdateTick() + (unsigned long)(timeout*1000.0)) {
+		// Lost for longer than the timeout; start over rather than
+		// extrapolate the old velocities
+		filter->Reset();
+	}
+	filter->Update(tick, tra, quat, cov);
+}
+
+bool PoseTracker::Get(int id, double time, double tra[3], double quat[4], double *cov) {
+	map<int, KalmanPose *>::iterator it = filters.find(id);
+	if (it == filters.end() || !started) return false;
+	unsigned long tick = Tick(time);
+	if (tick > it->second->GetUpdateTick() + (unsigned long)(timeout*1000.0)) return false;
+	it->second->Predict(tick, tra, quat, cov);
+	return true;
+}
+
+void PoseTracker::GetIds(double time, vector<int> &ids) {
+	ids.clear();
+	if (!started) return;
+	unsigned long tick = Tick(time);
+	map<int, KalmanPose *>::iterator it = filters.begin();
+	while (it != filters.end()) {
+		if (tick > it->second->GetUpdateTick() + (unsigned long)(timeout*1000.0)) {
+			delete it->second;
+			filters.erase(it++);
+		} else {
+			ids.push_back(it->first);
+			++it;
+		}
+	}
+}
+
+} // namespace alvar
@@ -0,0 +1,80 @@
+#include "ar_track_alvar/ConnectedComponents.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+using namespace alvar;
+using namespace std;
+
+// Draw rotated marker-like squares (dark frame, bright inside with a dark block) on a bright background
+void fillImage(IplImage *image, int count)
+{
+    cvSet(image, cvScalarAll(210));
+    int cols = (int)ceil(sqrt((double)count));
+    int rows = (count+cols-1)/cols;
+    int cell = min(image->width/cols, image->height/rows);
+    for (int i=0; i<count; i++) {
+        double cx = (i%cols + 0.5)*cell;
+        double cy = (i/cols + 0.5)*cell;
+        double angle = i*0.37;
+        double size[3] = {0.35*cell, 0.25*cell, 0.1*cell};
+        CvScalar colors[3] = {cvScalarAll(30), cvScalarAll(210), cvScalarAll(30)};
+        for (int k=0; k<3; k++) {
+            CvPoint pts[4];
+            for (int j=0; j<4; j++) {
+                double a = angle + j*CV_PI/2;
+                pts[j] = cvPoint(int(cx + size[k]*cos(a) + 0.5), int(cy + size[k]*sin(a) + 0.5));
+            }
+            cvFillConvexPoly(image, pts, 4, colors[k]);
+        }
+    }
+    // Some noise
+    for (int i=0; i<image->width*image->height/200; i++)
+        cvSet2D(image, rand()%image->height, rand()%image->width, cvScalarAll(rand()%256));
+}
+
+// Average time of LabelSquares in milliseconds
+double timeLabeling(Labeling &labeling, IplImage *image, int rounds)
+{
+    int64 t0 = cvGetTickCount();
+    for (int i=0; i<rounds; i++)
+        labeling.LabelSquares(image);
+    return (cvGetTickCount()-t0)/(cvGetTickFrequency()*1000.0*rounds);
+}
+
+int main(int argc, char *argv[])
+{
+    cout << "SampleLabelingBenchmark" << endl;
+    cout << "=======================" << endl;
+    cout << endl;
+    cout << "Description:" << endl;
+    cout << "  Compares the time used by the 'LabelingCvSeq' and 'LabelingRle' labeling" << endl;
+    cout << "  methods on synthetic images with different sizes and numbers of markers." << endl;
+    cout << endl;
+    cout << "Usage:" << endl;
+    cout << "  labelingBenchmark [rounds]" << endl;
+    cout << endl;
+
+    const int sizes[][2] = {{320, 240}, {640, 480}, {1280, 960}};
+    const int counts[] = {1, 9, 30};
+    int rounds = (argc > 1 ? atoi(argv[1]) : 10);
+    if (rounds < 1) rounds = 1;
+
+    srand(42);
+    for (size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+        for (size_t c=0; c<sizeof(counts)/sizeof(counts[0]); c++) {
+            IplImage *image = cvCreateImage(cvSize(sizes[s][0], sizes[s][1]), IPL_DEPTH_8U, 1);
+            fillImage(image, counts[c]);
+
+            LabelingCvSeq cvseq;
+            LabelingRle rle;
+            double t_cvseq = timeLabeling(cvseq, image, rounds);
+            double t_rle = timeLabeling(rle, image, rounds);
+            printf("%dx%d with %d markers: CVSEQ %.2f ms, RLE %.2f ms\n", sizes[s][0], sizes[s][1],
+                   counts[c], t_cvseq, t_rle);
+            cvReleaseImage(&image);
+        }
+    }
+    return 0;
+}
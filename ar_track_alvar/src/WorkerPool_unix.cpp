@@ -0,0 +1,151 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+
+#include "ar_track_alvar/WorkerPool_private.h"
+
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace alvar {
+
+class WorkerPoolPrivateData
+{
+public:
+    WorkerPoolPrivateData()
+        : mHandles()
+        , mMethod(0)
+        , mParameters(0)
+        , mNext(0)
+        , mCount(0)
+        , mPending(0)
+        , mStop(false)
+    {
+    }
+
+    // Takes the next index and runs it, returns false when there is nothing left.
+    // The mutex is locked when entering and leaving.
+    bool runNext()
+    {
+        if (mNext >= mCount) {
+            return false;
+        }
+        int index = mNext++;
+        void (*method)(void *, int) = mMethod;
+        void *parameters = mParameters;
+        pthread_mutex_unlock(&mMutex);
+        method(parameters, index);
+        pthread_mutex_lock(&mMutex);
+        if (--mPending == 0) {
+            pthread_cond_signal(&mDone);
+        }
+        return true;
+    }
+
+    static void *worker(void *parameters)
+    {
+        WorkerPoolPrivateData *data = (WorkerPoolPrivateData *)parameters;
+        pthread_mutex_lock(&data->mMutex);
+        while (!data->mStop) {
+            if (!data->runNext()) {
+                pthread_cond_wait(&data->mWork, &data->mMutex);
+            }
+        }
+        pthread_mutex_unlock(&data->mMutex);
+        return 0;
+    }
+
+    std::vector<pthread_t> mHandles;
+    pthread_mutex_t mMutex;
+    pthread_cond_t mWork;
+    pthread_cond_t mDone;
+    void (*mMethod)(void *, int);
+    void *mParameters;
+    int mNext;
+    int mCount;
+    int mPending;
+    bool mStop;
+};
+
+WorkerPoolPrivate::WorkerPoolPrivate(int threads)
+    : d(new WorkerPoolPrivateData())
+{
+    pthread_mutex_init(&d->mMutex, NULL);
+    pthread_cond_init(&d->mWork, NULL);
+    pthread_cond_init(&d->mDone, NULL);
+
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    for (int i = 1; i < threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, WorkerPoolPrivateData::worker, d) == 0) {
+            d->mHandles.push_back(thread);
+        }
+    }
+}
+
+WorkerPoolPrivate::~WorkerPoolPrivate()
+{
+    pthread_mutex_lock(&d->mMutex);
+    d->mStop = true;
+    pthread_cond_broadcast(&d->mWork);
+    pthread_mutex_unlock(&d->mMutex);
+    for (int i = 0; i < (int)d->mHandles.size(); ++i) {
+        pthread_join(d->mHandles.at(i), NULL);
+    }
+    d->mHandles.clear();
+
+    pthread_cond_destroy(&d->mDone);
+    pthread_cond_destroy(&d->mWork);
+    pthread_mutex_destroy(&d->mMutex);
+    delete d;
+}
+
+int WorkerPoolPrivate::size() const
+{
+    return (int)d->mHandles.size() + 1;
+}
+
+void WorkerPoolPrivate::run(void (*method)(void *, int), void *parameters, int count)
+{
+    if (count <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&d->mMutex);
+    d->mMethod = method;
+    d->mParameters = parameters;
+    d->mNext = 0;
+    d->mCount = count;
+    d->mPending = count;
+    pthread_cond_broadcast(&d->mWork);
+    while (d->runNext()) {
+    }
+    while (d->mPending > 0) {
+        pthread_cond_wait(&d->mDone, &d->mMutex);
+    }
+    pthread_mutex_unlock(&d->mMutex);
+}
+
+} // namespace alvar
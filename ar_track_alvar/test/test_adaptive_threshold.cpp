@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file 
+ * 
+ * Test that the integral image threshold backend gives the same binary image
+ * as cvAdaptiveThreshold (CV_ADAPTIVE_THRESH_MEAN_C, CV_THRESH_BINARY_INV)
+ */
+
+#include <ar_track_alvar/IntegralImage.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using alvar::IntegralThreshold;
+
+// Fill the image with a checkerboard of dark and bright squares plus noise
+void fillImage(IplImage *gray)
+{
+  for (int y=0; y<gray->height; y++)
+  {
+    unsigned char *row = (unsigned char *)(gray->imageData + y*gray->widthStep);
+    for (int x=0; x<gray->width; x++)
+    {
+      if (rand()%4 == 0)
+        row[x] = rand()%256;
+      else
+        row[x] = (((x/13)+(y/9))%2 ? 200 : 30) + rand()%20;
+    }
+  }
+}
+
+// Count the rows where the two binary images differ
+int compareImages(IplImage *a, IplImage *b)
+{
+  int rows = 0;
+  for (int y=0; y<a->height; y++)
+  {
+    if (memcmp(a->imageData + y*a->widthStep, b->imageData + y*b->widthStep, a->width) != 0)
+      rows++;
+  }
+  return rows;
+}
+
+int main (int argc, char** argv)
+{
+  const int sizes[][2] = {{1, 1}, {15, 7}, {64, 48}, {333, 41}, {1280, 960}};
+  const int block_sizes[] = {3, 11, 31, 51};
+  const int params[] = {-3, 0, 5, 12};
+  int failures = 0;
+
+  srand(42);
+  for (size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++)
+  {
+    CvSize size = cvSize(sizes[s][0], sizes[s][1]);
+    IplImage *gray = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    IplImage *bw_cv = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    IplImage *bw_integral = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    IntegralThreshold integral_threshold;
+    fillImage(gray);
+    for (size_t b=0; b<sizeof(block_sizes)/sizeof(block_sizes[0]); b++)
+    {
+      for (size_t p=0; p<sizeof(params)/sizeof(params[0]); p++)
+      {
+        cvAdaptiveThreshold(gray, bw_cv, 255, CV_ADAPTIVE_THRESH_MEAN_C, CV_THRESH_BINARY_INV,
+                            block_sizes[b], params[p]);
+        integral_threshold.Threshold(gray, bw_integral, block_sizes[b], params[p]);
+        int rows = compareImages(bw_cv, bw_integral);
+        if (rows > 0)
+        {
+          printf("%dx%d block %d param %d: %d rows differ\n", size.width, size.height,
+                 block_sizes[b], params[p], rows);
+          failures++;
+        }
+      }
+    }
+    cvReleaseImage(&gray);
+    cvReleaseImage(&bw_cv);
+    cvReleaseImage(&bw_integral);
+  }
+  printf("%d failures\n", failures);
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that the lookup grids of DistortionMap agree with the exact distortion
+ * model and that distorting an undistorted point gives back the point
+ */
+
+#include <ar_track_alvar/DistortionMap.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+using alvar::DistortionMap;
+using alvar::PointDouble;
+
+int main(int argc, char *argv[])
+{
+  // A wide-angle camera with strong barrel distortion
+  const double K[3][3] = {{500, 0, 320}, {0, 500, 240}, {0, 0, 1}};
+  const double D[4] = {-0.3, 0.1, 0.001, -0.002};
+  const int steps[2] = {1, 4};
+  const double tolerance[2] = {0.002, 0.02};
+
+  int failures = 0;
+  for (int s=0; s<2; s++)
+  {
+    DistortionMap map;
+    map.Build(K, D, 640, 480, steps[s]);
+    double undistort_error = 0, distort_error = 0, roundtrip_error = 0;
+    srand(1);
+    for (int i=0; i<10000; i++)
+    {
+      PointDouble p(rand()%6400/10.0, rand()%4800/10.0);
+
+      PointDouble u = p, ue = p;
+      map.Undistort(&u, 1);
+      DistortionMap::UndistortExact(K, D, ue.x, ue.y, 50);
+      undistort_error = std::max(undistort_error, sqrt(PointSquaredDistance(u, ue)));
+
+      PointDouble d = p, de = p;
+      map.Distort(&d, 1);
+      DistortionMap::DistortExact(K, D, de.x, de.y);
+      distort_error = std::max(distort_error, sqrt(PointSquaredDistance(d, de)));
+
+      map.Distort(&u, 1);
+      roundtrip_error = std::max(roundtrip_error, sqrt(PointSquaredDistance(u, p)));
+    }
+    printf("step %d: undistort %g, distort %g, round trip %g pixels\n",
+           steps[s], undistort_error, distort_error, roundtrip_error);
+    if ((undistort_error > tolerance[s]) || (distort_error > tolerance[s]) || (roundtrip_error > 2*tolerance[s])) failures++;
+  }
+
+  // Without distortion the points are not changed
+  const double no_distortion[4] = {0, 0, 0, 0};
+  DistortionMap map;
+  map.Build(K, no_distortion, 640, 480);
+  PointDouble p(123.25, 45.5);
+  map.Undistort(&p, 1);
+  map.Distort(&p, 1);
+  if (!map.IsEmpty() || (p.x != 123.25) || (p.y != 45.5)) failures++;
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that the packed BitsetExt Hamming coding matches the original
+ * deque<bool> implementation on random codewords with random bit errors.
+ * The only intended difference is a syndrome that points past the end of its
+ * block: the original flipped the first bit of the next block, the packed
+ * version reports the block as uncorrectable (-1).
+ */
+
+#include <ar_track_alvar/Bitset.h>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+
+using alvar::BitsetExt;
+using std::deque;
+
+// The original deque<bool> implementation of BitsetExt::hamming_enc_block
+void refEncBlock(deque<bool> &bits, unsigned long block_len, deque<bool>::iterator &iter)
+{
+  unsigned long next_parity=1;
+  for (unsigned long i=1; i<=block_len; i++) {
+    if (i == next_parity) {
+      next_parity <<= 1;
+      iter = bits.insert(iter, false);
+    } 
+    else {
+      if (iter == bits.end()) {
+        block_len = i-1;
+        break;
+      }
+      if (*iter) {
+        unsigned long parity = next_parity>>1;
+        while (parity) {
+          if (i & parity) {
+            deque<bool>::iterator parity_iter=(iter - (i - parity));
+            *parity_iter = !*parity_iter;
+          }
+          parity >>= 1;
+        }
+      }
+    }
+    iter++;
+  }
+  if (block_len == (next_parity >> 1)) {
+    for (unsigned long ii=1; ii<block_len; ii++) {
+      if (*(iter-ii-1)) *(iter-1) = !*(iter-1);
+    }
+  }
+}
+
+void refEnc(deque<bool> &bits, int block_len)
+{
+  deque<bool>::iterator iter=bits.begin();
+  while (iter != bits.end())
+    refEncBlock(bits, block_len, iter);
+}
+
+// The original deque<bool> implementation of BitsetExt::hamming_dec_block. The
+// syndromes that point past the block are reported in outside instead of
+// flipping the next block (or past the end).
+int refDecBlock(deque<bool> &bits, unsigned long block_len, deque<bool>::iterator &iter, bool &outside)
+{
+  bool potentially_double_error = false;
+  unsigned long total_parity=0;
+  unsigned long parity=0;
+  unsigned long next_parity=1;
+  for (unsigned long i=1; i<=block_len; i++) {
+    if (iter == bits.end()) {
+      block_len = i;
+      break;
+    }
+    if (*iter) {
+      parity = parity ^ i;
+      total_parity = total_parity ^ 1;
+    }
+    if (i == next_parity) {
+      next_parity <<= 1;
+      iter = bits.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+  if (block_len < 3) return 0;
+  if (block_len == (next_parity >> 1)) {
+    parity = parity & ~(next_parity >> 1);
+    if (total_parity == 0) potentially_double_error = true;
+  }
+  int steps=0;
+  if (parity) {
+    if (potentially_double_error) return -1;
+    next_parity = 1;
+    for (unsigned long i=1; i<=block_len; i++) {
+      if (i == next_parity) {
+        next_parity <<= 1;
+        if (i == parity) return 1;
+      } else if (i >= parity) {
+        steps++;
+      }
+    }
+    if ((steps == 0) || (steps > iter-bits.begin())) outside = true;
+    else iter[-steps] = !iter[-steps];
+    return 1;
+  }
+  return 0;
+}
+
+int refDec(deque<bool> &bits, int block_len, bool &outside)
+{
+  int error_count=0;
+  deque<bool>::iterator iter=bits.begin();
+  while (iter != bits.end()) {
+    int error=refDecBlock(bits, block_len, iter, outside);
+    if ((error == -1) || (error_count == -1)) error_count=-1;
+    else error_count += error;
+  }
+  return error_count;
+}
+
+int main(int argc, char *argv[])
+{
+  srand(1);
+  int failures = 0, outside_count = 0;
+  for (int n=0; n<200000; n++)
+  {
+    int block_len = (rand()%2 ? 8 : 16);
+    int len = 1 + rand()%64;
+
+    BitsetExt bs;
+    deque<bool> ref;
+    for (int i=0; i<len; i++)
+    {
+      bool bit = (rand()%2 != 0);
+      bs.push_back(bit);
+      ref.push_back(bit);
+    }
+    bs.hamming_enc(block_len);
+    refEnc(ref, block_len);
+    if (bs.GetBits() != ref)
+    {
+      printf("%d: encoded %d bits with block %d differently\n", n, len, block_len);
+      failures++;
+      continue;
+    }
+
+    int flips = rand()%4;
+    for (int i=0; i<flips; i++)
+    {
+      size_t pos = rand()%ref.size();
+      bs.flip(pos);
+      ref[pos] = !ref[pos];
+    }
+
+    bool outside = false;
+    int errors = bs.hamming_dec(block_len);
+    int ref_errors = refDec(ref, block_len, outside);
+    if (outside)
+    {
+      outside_count++;
+      if (errors != -1)
+      {
+        printf("%d: syndrome outside the block decoded with %d errors\n", n, errors);
+        failures++;
+      }
+    }
+    else if ((errors != ref_errors) || (bs.GetBits() != ref))
+    {
+      printf("%d: %d errors, expected %d\n", n, errors, ref_errors);
+      failures++;
+    }
+  }
+  printf("%d syndromes outside the block\n", outside_count);
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that the closed form Homography::Find maps a marker onto random quads
+ * of any size, and that it rejects the quads that have collapsed onto a line
+ * or a point instead of returning a singular homography
+ */
+
+#include <ar_track_alvar/Camera.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+using alvar::Homography;
+using alvar::PointDouble;
+
+PointDouble point(double x, double y)
+{
+  PointDouble p;
+  p.x = x;
+  p.y = y;
+  return p;
+}
+
+double randomCoordinate()
+{
+  return (rand()%2000-1000)/1000.0;
+}
+
+// Find must fail and leave H untouched
+int expectRejected(const char *name, const PointDouble pw[4], const PointDouble pi[4])
+{
+  Homography H;
+  for (int i=0; i<9; i++) H.H_data[i/3][i%3] = i;
+  bool found = H.Find(pw, pi);
+  bool untouched = true;
+  for (int i=0; i<9; i++) untouched = untouched && (H.H_data[i/3][i%3] == i);
+  if (found || !untouched)
+  {
+    printf("%s: found %d untouched %d\n", name, found, untouched);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const double edge = 0.1;
+  PointDouble model[4] = {point(-edge/2, -edge/2), point(edge/2, -edge/2), point(edge/2, edge/2), point(-edge/2, edge/2)};
+
+  // Perspective views of the marker from the far corner of a large image down to a fraction of a pixel
+  srand(1);
+  int failures = 0;
+  for (int n=0; n<1000; n++)
+  {
+    double scale = pow(10.0, n%6 - 3);
+    double cx = 1000 + 100*randomCoordinate(), cy = 1000 + 100*randomCoordinate();
+    PointDouble image[4];
+    for (int i=0; i<4; i++)
+    {
+      double x = model[i].x/edge + 0.2*randomCoordinate();
+      double y = model[i].y/edge + 0.2*randomCoordinate();
+      double w = 1 + 0.1*(x*randomCoordinate() + y*randomCoordinate());
+      image[i] = point(cx + scale*x/w, cy + scale*y/w);
+    }
+    Homography H;
+    PointDouble projected[4];
+    bool found = H.Find(model, image);
+    double error = 0;
+    if (found)
+    {
+      H.ProjectPoints(model, projected, 4);
+      for (int i=0; i<4; i++) error = std::max(error, std::max(fabs(projected[i].x - image[i].x), fabs(projected[i].y - image[i].y)));
+    }
+    if (!found || (error > 1e-9*cx))
+    {
+      printf("quad %d scale %g: found %d error %g\n", n, scale, found, error);
+      failures++;
+    }
+  }
+
+  // The quads collapsed onto a point, onto a line and into a triangle
+  PointDouble point_quad[4] = {point(320, 240), point(320, 240), point(320, 240), point(320, 240)};
+  PointDouble line_quad[4] = {point(100, 100), point(200, 150), point(300, 200), point(400, 250)};
+  PointDouble bent_quad[4] = {point(100, 100), point(200, 150 + 1e-12), point(300, 200), point(400, 250 - 1e-12)};
+  PointDouble triangle_quad[4] = {point(100, 100), point(100, 100), point(300, 300), point(100, 300)};
+  PointDouble folded_quad[4] = {point(100, 100), point(300, 100), point(500, 100), point(300, 300)};
+  failures += expectRejected("point", model, point_quad);
+  failures += expectRejected("line", model, line_quad);
+  failures += expectRejected("almost a line", model, bent_quad);
+  failures += expectRejected("triangle", model, triangle_quad);
+  failures += expectRejected("folded", model, folded_quad);
+  failures += expectRejected("collapsed model", line_quad, model);
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that the coarse-to-fine labeling of LabelingCvSeq finds the same
+ * squares as the full resolution labeling, including the inner borders of the
+ * marker frames, with corners that agree within a fraction of a pixel
+ */
+
+#include <ar_track_alvar/ConnectedComponents.h>
+#include <cstdio>
+#include <cmath>
+
+using alvar::LabelingCvSeq;
+using alvar::PointDouble;
+
+// Draw a marker-like square (dark frame, bright inside with a dark block) on a bright background
+void drawMarker(IplImage *image, double cx, double cy, double size, double angle)
+{
+  double sizes[3] = {size, 0.65*size, 0.25*size};
+  CvScalar colors[3] = {cvScalarAll(30), cvScalarAll(210), cvScalarAll(30)};
+  for (int k=0; k<3; k++)
+  {
+    CvPoint pts[4];
+    for (int j=0; j<4; j++)
+    {
+      double a = angle + CV_PI/4 + j*CV_PI/2;
+      double r = sizes[k]/sqrt(2.0);
+      pts[j] = cvPoint(int(cx + r*cos(a) + 0.5), int(cy + r*sin(a) + 0.5));
+    }
+    cvFillConvexPoly(image, pts, 4, colors[k]);
+  }
+}
+
+// Is there a square in b with the same corners (in some rotation) as the square a?
+bool findSquare(const std::vector<PointDouble> &a, const std::vector<std::vector<PointDouble> > &b, double tolerance)
+{
+  for (size_t i=0; i<b.size(); i++)
+  {
+    for (int r=0; r<4; r++)
+    {
+      bool same = true;
+      for (int j=0; j<4; j++)
+      {
+        const PointDouble &p = a[j], &q = b[i][(j+r)%4];
+        if (fabs(p.x-q.x) > tolerance || fabs(p.y-q.y) > tolerance) same = false;
+      }
+      if (same) return true;
+    }
+  }
+  return false;
+}
+
+int main (int argc, char** argv)
+{
+  const double tolerance = 0.5;
+  int failures = 0;
+
+  IplImage *image = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
+  for (int levels=1; levels<=2; levels++)
+  {
+    for (int a=0; a<6; a++)
+    {
+      double angle = a*0.27;
+      cvSet(image, cvScalarAll(210));
+      drawMarker(image, 170, 180, 200, angle);
+      drawMarker(image, 460, 300, 150, -angle);
+
+      // The threshold block is larger than the dark areas, so that they are not split into rings
+      LabelingCvSeq full, pyramid;
+      full.SetThreshParams(61, 5);
+      pyramid.SetThreshParams(61, 5);
+      pyramid.SetPyramid(levels, 0.05);
+      full.LabelSquares(image);
+      pyramid.LabelSquares(image);
+
+      // The outer and the inner border of both frames and both blocks
+      int missing = 0, extra = 0;
+      for (size_t i=0; i<full.blob_corners.size(); i++)
+      {
+        if (!findSquare(full.blob_corners[i], pyramid.blob_corners, tolerance)) missing++;
+      }
+      for (size_t i=0; i<pyramid.blob_corners.size(); i++)
+      {
+        if (!findSquare(pyramid.blob_corners[i], full.blob_corners, tolerance)) extra++;
+      }
+      if ((full.blob_corners.size() != 6) || missing || extra)
+      {
+        printf("levels %d angle %.2f: %d squares in full resolution, %d missing and %d extra in the pyramid\n",
+               levels, angle, (int)full.blob_corners.size(), missing, extra);
+        failures++;
+      }
+    }
+  }
+  cvReleaseImage(&image);
+  printf("%d failures\n", failures);
+  return (failures ? 1 : 0);
+}
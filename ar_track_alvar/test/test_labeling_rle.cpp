@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file 
+ * 
+ * Test that LabelingRle finds the same squares as LabelingCvSeq (the timing of
+ * the two methods is compared in SampleLabelingBenchmark)
+ */
+
+#include <ar_track_alvar/ConnectedComponents.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+using alvar::LabelingCvSeq;
+using alvar::LabelingRle;
+using alvar::PointDouble;
+
+// Draw rotated marker-like squares (dark frame, bright inside with a dark block) on a bright background
+void fillImage(IplImage *image, int count)
+{
+  cvSet(image, cvScalarAll(210));
+  int cols = (int)ceil(sqrt((double)count));
+  int rows = (count+cols-1)/cols;
+  int cell = std::min(image->width/cols, image->height/rows);
+  for (int i=0; i<count; i++)
+  {
+    double cx = (i%cols + 0.5)*cell;
+    double cy = (i/cols + 0.5)*cell;
+    double angle = i*0.37;
+    double size[3] = {0.35*cell, 0.25*cell, 0.1*cell};
+    CvScalar colors[3] = {cvScalarAll(30), cvScalarAll(210), cvScalarAll(30)};
+    for (int k=0; k<3; k++)
+    {
+      CvPoint pts[4];
+      for (int j=0; j<4; j++)
+      {
+        double a = angle + j*CV_PI/2;
+        pts[j] = cvPoint(int(cx + size[k]*cos(a) + 0.5), int(cy + size[k]*sin(a) + 0.5));
+      }
+      cvFillConvexPoly(image, pts, 4, colors[k]);
+    }
+  }
+  // Some noise
+  for (int i=0; i<image->width*image->height/200; i++)
+    cvSet2D(image, rand()%image->height, rand()%image->width, cvScalarAll(rand()%256));
+}
+
+// Is there a square in b with the same corners (in some rotation) as the square a?
+bool findSquare(const std::vector<PointDouble> &a, const std::vector<std::vector<PointDouble> > &b)
+{
+  for (size_t i=0; i<b.size(); i++)
+  {
+    for (int r=0; r<4; r++)
+    {
+      bool same = true;
+      for (int j=0; j<4; j++)
+      {
+        const PointDouble &p = a[j], &q = b[i][(j+r)%4];
+        if (fabs(p.x-q.x) > 0.5 || fabs(p.y-q.y) > 0.5) same = false;
+      }
+      if (same) return true;
+    }
+  }
+  return false;
+}
+
+int main (int argc, char** argv)
+{
+  const int sizes[][2] = {{320, 240}, {640, 480}, {1280, 960}};
+  const int counts[] = {1, 9, 30};
+  int failures = 0;
+
+  srand(42);
+  for (size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++)
+  {
+    for (size_t c=0; c<sizeof(counts)/sizeof(counts[0]); c++)
+    {
+      IplImage *image = cvCreateImage(cvSize(sizes[s][0], sizes[s][1]), IPL_DEPTH_8U, 1);
+      fillImage(image, counts[c]);
+
+      LabelingCvSeq cvseq;
+      LabelingRle rle;
+      cvseq.LabelSquares(image);
+      rle.LabelSquares(image);
+
+      // The frame and the inner block of every marker are found, and LabelingCvSeq finds the
+      // same squares (it also finds the inner borders of the frames)
+      int missing = 0;
+      for (size_t i=0; i<rle.blob_corners.size(); i++)
+      {
+        if (!findSquare(rle.blob_corners[i], cvseq.blob_corners)) missing++;
+      }
+      if ((missing > 0) || ((int)rle.blob_corners.size() < 2*counts[c]))
+      {
+        printf("%dx%d with %d markers: %d squares, %d not found by CVSEQ\n", sizes[s][0], sizes[s][1],
+               counts[c], (int)rle.blob_corners.size(), missing);
+        failures++;
+      }
+      cvReleaseImage(&image);
+    }
+  }
+  printf("%d failures\n", failures);
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that MarkerDataTable decodes the same ids and orientations as the
+ * Hamming decoding of MarkerData, also with one erroneous cell, and that a
+ * table of a few allowed ids recovers markers with more erroneous cells
+ */
+
+#include <ar_track_alvar/Marker.h>
+#include <cstdio>
+#include <vector>
+
+using alvar::MarkerData;
+using alvar::MarkerDataTable;
+
+// Write the content of orientation 0 as it is seen in orientation k (see MarkerData::DecodeCode)
+void rotateContent(CvMat *src, CvMat *dst, int k)
+{
+  int res = src->rows;
+  for (int j=0; j<res; j++)
+  {
+    for (int i=0; i<res; i++)
+    {
+      int r = j, c = i;
+      if (k == 1) { r = res-i-1; c = j; }
+      else if (k == 2) { r = res-j-1; c = res-i-1; }
+      else if (k == 3) { r = i; c = res-j-1; }
+      cvSetReal2D(dst, r, c, cvGetReal2D(src, j, i));
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const MarkerDataTable *table = MarkerDataTable::Get(5);
+  if (!table)
+  {
+    printf("No table for 5x5 markers\n");
+    return 1;
+  }
+
+  MarkerData encoder(1, 0, 2);
+  MarkerData marker(1, 5, 2);
+  int failures = 0;
+  for (unsigned long id=0; id<256; id++)
+  {
+    encoder.SetContent(MarkerData::MARKER_CONTENT_TYPE_NUMBER, id, 0);
+    for (int k=0; k<4; k++)
+    {
+      rotateContent(encoder.GetContent(), marker.GetContent(), k);
+      for (int flip=0; flip<2; flip++)
+      {
+        // The cell (0, 1) is a data cell in every orientation
+        if (flip) cvSetReal2D(marker.GetContent(), 0, 1, 255-cvGetReal2D(marker.GetContent(), 0, 1));
+
+        int orientation_hamming, orientation_table;
+        marker.SetDecodeTable(NULL);
+        bool hamming = marker.DecodeContent(&orientation_hamming) && (marker.GetId() == id);
+        marker.SetDecodeTable(table, 1);
+        bool lookup = marker.DecodeContent(&orientation_table) && (marker.GetId() == id);
+        if (!hamming || !lookup || (orientation_hamming != k) || (orientation_table != k))
+        {
+          printf("id %lu orientation %d flip %d: hamming %d (%d) table %d (%d)\n",
+                 id, k, flip, hamming, orientation_hamming, lookup, orientation_table);
+          failures++;
+        }
+      }
+    }
+  }
+
+  // A table with a few ids decodes only them, and its codes are at least as far apart
+  std::vector<unsigned long> ids;
+  ids.push_back(3);
+  ids.push_back(77);
+  ids.push_back(200);
+  MarkerDataTable allowed(*table, ids);
+  if (allowed.GetMinDistance() < table->GetMinDistance()) failures++;
+  for (unsigned long id=0; id<256; id++)
+  {
+    encoder.SetContent(MarkerData::MARKER_CONTENT_TYPE_NUMBER, id, 0);
+    unsigned long found_id;
+    int orientation, distance;
+    bool found = allowed.Find(MarkerDataTable::Code(encoder.GetContent()), 0, &found_id, &orientation, &distance);
+    bool expected = (id == 3 || id == 77 || id == 200);
+    if ((found != expected) || (found && (found_id != id || orientation != 0)))
+    {
+      printf("id %lu: allowed table %d (%lu)\n", id, found, found_id);
+      failures++;
+    }
+  }
+
+  // The fewer allowed ids the more cells are corrected, but not so many that a random code
+  // would match an allowed id more often than any id within one cell with the full table
+  if (table->GetMaxDistance(*table, 1) != 1) failures++;
+  if (allowed.GetMaxDistance(*table, 1) != 2) failures++;
+  ids.pop_back();
+  MarkerDataTable allowed_pair(*table, ids);
+  int distance = allowed_pair.GetMaxDistance(*table, 1);
+  if (distance != 3)
+  {
+    printf("allowed pair corrects %d cells\n", distance);
+    failures++;
+  }
+
+  // A marker with three erroneous cells is recovered, and MarkerDetector counts only one
+  // of them in the error as the cells corrected beyond one are not counted
+  double extra_error = double(distance - 1) / 25;
+  marker.SetDecodeTable(&allowed_pair, distance);
+  for (size_t i=0; i<ids.size(); i++)
+  {
+    encoder.SetContent(MarkerData::MARKER_CONTENT_TYPE_NUMBER, ids[i], 0);
+    for (int k=0; k<4; k++)
+    {
+      for (int cell=0; cell<25; cell++)
+      {
+        rotateContent(encoder.GetContent(), marker.GetContent(), k);
+        for (int n=0; n<3; n++)
+        {
+          int c = (cell + 8*n) % 25;
+          cvSetReal2D(marker.GetContent(), c/5, c%5, 255-cvGetReal2D(marker.GetContent(), c/5, c%5));
+        }
+        int orientation;
+        bool found = marker.DecodeContent(&orientation);
+        double error = marker.GetError(alvar::Marker::DECODE_ERROR) - extra_error;
+        if (!found || (marker.GetId() != ids[i]) || (orientation != k) || (error > 1.0 / 25 + 1e-9))
+        {
+          printf("id %lu orientation %d cell %d: recovered %d (%lu, %d) error %g\n",
+                 ids[i], k, cell, found, marker.GetId(), orientation, error);
+          failures++;
+        }
+      }
+    }
+  }
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
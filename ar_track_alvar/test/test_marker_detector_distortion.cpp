@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that MarkerDetector finds a marker rendered through a strongly
+ * distorting lens when the undistortion is enabled, and that the corners stay
+ * in the raw image coordinates while the pose comes out undistorted
+ */
+
+#include <ar_track_alvar/MarkerDetector.h>
+#include <ar_track_alvar/DistortionMap.h>
+#include <ros/ros.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+using namespace alvar;
+
+// Rotation matrix from the rotations about the x, y and z axes, R = Rz*Ry*Rx
+void eulerToMatrix(double ax, double ay, double az, double R[3][3])
+{
+  double cx = cos(ax), sx = sin(ax), cy = cos(ay), sy = sin(ay), cz = cos(az), sz = sin(az);
+  R[0][0] = cz*cy; R[0][1] = cz*sy*sx-sz*cx; R[0][2] = cz*sy*cx+sz*sx;
+  R[1][0] = sz*cy; R[1][1] = sz*sy*sx+cz*cx; R[1][2] = sz*sy*cx-cz*sx;
+  R[2][0] = -sy;   R[2][1] = cy*sx;          R[2][2] = cy*cx;
+}
+
+// Inverse of a 3x3 matrix
+void invert3(const double A[3][3], double B[3][3])
+{
+  double det = A[0][0]*(A[1][1]*A[2][2]-A[1][2]*A[2][1])
+             - A[0][1]*(A[1][0]*A[2][2]-A[1][2]*A[2][0])
+             + A[0][2]*(A[1][0]*A[2][1]-A[1][1]*A[2][0]);
+  for (int i=0; i<3; i++) {
+    for (int j=0; j<3; j++) {
+      int i1 = (j+1)%3, i2 = (j+2)%3, j1 = (i+1)%3, j2 = (i+2)%3;
+      B[i][j] = (A[i1][j1]*A[i2][j2]-A[i1][j2]*A[i2][j1])/det;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  // The Camera has a node handle for the camera info
+  ros::init(argc, argv, "test_marker_detector_distortion");
+
+  // A wide-angle camera with strong barrel distortion
+  Camera cam;
+  const double K[3][3] = {{500, 0, 320}, {0, 500, 240}, {0, 0, 1}};
+  const double D[4] = {-0.25, 0.07, 0, 0};
+  for (int i=0; i<3; i++) for (int j=0; j<3; j++) cam.calib_K_data[i][j] = K[i][j];
+  for (int i=0; i<4; i++) cam.calib_D_data[i] = D[i];
+  cam.SetUndistortion(true, 4);
+
+  // The marker and its pose, the marker faces the camera from the off-center
+  const double edge = 10;
+  const unsigned long id = 7;
+  MarkerData encoder(edge, 0, 2);
+  encoder.SetContent(MarkerData::MARKER_CONTENT_TYPE_NUMBER, id, 0);
+  const int res = encoder.GetRes();
+  const int cells = res+4;
+  const double step = edge/cells;
+  double R[3][3];
+  eulerToMatrix(M_PI-0.35, 0.25, 0.3, R);
+  const double t[3] = {12, -8, 45};
+
+  // The homography from the marker plane to the undistorted image
+  double G[3][3], Gi[3][3];
+  for (int i=0; i<3; i++) {
+    G[i][0] = K[i][0]*R[0][0]+K[i][1]*R[1][0]+K[i][2]*R[2][0];
+    G[i][1] = K[i][0]*R[0][1]+K[i][1]*R[1][1]+K[i][2]*R[2][1];
+    G[i][2] = K[i][0]*t[0]+K[i][1]*t[1]+K[i][2]*t[2];
+  }
+  invert3(G, Gi);
+
+  // Render the raw image by supersampling each pixel through the lens
+  const int ss = 4;
+  IplImage *image = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
+  for (int y=0; y<image->height; y++) {
+    unsigned char *row = (unsigned char *)(image->imageData + y*image->widthStep);
+    for (int x=0; x<image->width; x++) {
+      int sum = 0;
+      for (int sy=0; sy<ss; sy++) {
+        for (int sx=0; sx<ss; sx++) {
+          double u = x+(sx+0.5)/ss-0.5, v = y+(sy+0.5)/ss-0.5;
+          DistortionMap::UndistortExact(K, D, u, v);
+          double w = Gi[2][0]*u+Gi[2][1]*v+Gi[2][2];
+          double mx = (Gi[0][0]*u+Gi[0][1]*v+Gi[0][2])/w;
+          double my = (Gi[1][0]*u+Gi[1][1]*v+Gi[1][2])/w;
+          int ci = (int)floor((mx+edge/2)/step), cj = (int)floor((edge/2-my)/step);
+          if ((ci < 0) || (ci >= cells) || (cj < 0) || (cj >= cells)) sum += 220;
+          else if ((ci < 2) || (ci >= res+2) || (cj < 2) || (cj >= res+2)) sum += 30;
+          else sum += (cvGetReal2D(encoder.GetContent(), cj-2, ci-2) ? 220 : 30);
+        }
+      }
+      row[x] = (unsigned char)(sum/(ss*ss));
+    }
+  }
+
+  int failures = 0;
+  MarkerDetector<MarkerData> detector;
+  detector.SetMarkerSize(edge, res, 2);
+  detector.Detect(image, &cam, false, false, 0.08, 0.2);
+  if (detector.markers->size() != 1) {
+    printf("found %d markers instead of one\n", (int)detector.markers->size());
+    failures++;
+  }
+  else {
+    MarkerData &marker = detector.markers->at(0);
+    if (marker.GetId() != id) {
+      printf("decoded the id %lu instead of %lu\n", marker.GetId(), id);
+      failures++;
+    }
+
+    // Each corner has to be near the raw projection of some true corner
+    const double corners[4][2] = {{-edge/2, -edge/2}, {edge/2, -edge/2}, {edge/2, edge/2}, {-edge/2, edge/2}};
+    for (size_t c=0; c<marker.marker_corners_img.size(); c++) {
+      double best = 1e10;
+      for (int k=0; k<4; k++) {
+        double w = G[2][0]*corners[k][0]+G[2][1]*corners[k][1]+G[2][2];
+        double u = (G[0][0]*corners[k][0]+G[0][1]*corners[k][1]+G[0][2])/w;
+        double v = (G[1][0]*corners[k][0]+G[1][1]*corners[k][1]+G[1][2])/w;
+        DistortionMap::DistortExact(K, D, u, v);
+        best = std::min(best, hypot(marker.marker_corners_img[c].x-u, marker.marker_corners_img[c].y-v));
+      }
+      if (best > 1.0) {
+        printf("corner %d is %.2f pixels off the raw image\n", (int)c, best);
+        failures++;
+      }
+    }
+
+    // The pose is the same up to the symmetry of the marker
+    double rot_data[9], tra_data[3];
+    CvMat rot = cvMat(3, 3, CV_64F, rot_data);
+    CvMat tra = cvMat(3, 1, CV_64F, tra_data);
+    marker.pose.GetMatrix(&rot);
+    marker.pose.GetTranslation(&tra);
+    double dt = sqrt((tra_data[0]-t[0])*(tra_data[0]-t[0]) + (tra_data[1]-t[1])*(tra_data[1]-t[1]) + (tra_data[2]-t[2])*(tra_data[2]-t[2]));
+    double tn = sqrt(t[0]*t[0] + t[1]*t[1] + t[2]*t[2]);
+    if (dt > 0.02*tn) {
+      printf("translation (%.2f %.2f %.2f) is %.2f off\n", tra_data[0], tra_data[1], tra_data[2], dt);
+      failures++;
+    }
+    double dot = rot_data[2]*R[0][2] + rot_data[5]*R[1][2] + rot_data[8]*R[2][2];
+    double angle = acos(std::max(-1.0, std::min(1.0, dot)))*180/M_PI;
+    if (angle > 2.0) {
+      printf("marker normal is %.2f degrees off\n", angle);
+      failures++;
+    }
+  }
+  cvReleaseImage(&image);
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that PlanarPose finds the pose of a square marker from its exact
+ * projection among its two solutions, and that it refines a perturbed pose
+ * back to the exact one
+ */
+
+#include <ar_track_alvar/PlanarPose.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+using alvar::PlanarPose;
+
+// Rotation matrix from a rotation vector
+void rodrigues(const double w[3], double R[9])
+{
+  double theta = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+  double kx = w[0]/theta, ky = w[1]/theta, kz = w[2]/theta;
+  double c = cos(theta), s = sin(theta), v = 1-c;
+  R[0] = c+kx*kx*v;    R[1] = kx*ky*v-kz*s; R[2] = kx*kz*v+ky*s;
+  R[3] = ky*kx*v+kz*s; R[4] = c+ky*ky*v;    R[5] = ky*kz*v-kx*s;
+  R[6] = kz*kx*v-ky*s; R[7] = kz*ky*v+kx*s; R[8] = c+kz*kz*v;
+}
+
+int main(int argc, char *argv[])
+{
+  const double edge = 0.1;
+  const double model[8] = {-edge/2, -edge/2, edge/2, -edge/2, edge/2, edge/2, -edge/2, edge/2};
+
+  srand(1);
+  int tested = 0, failures = 0;
+  while (tested < 1000)
+  {
+    double w[3] = {(rand()%200-100)/100.0, (rand()%200-100)/100.0, (rand()%200-100)/100.0};
+    double R[9];
+    rodrigues(w, R);
+    double t[3] = {(rand()%100-50)/100.0, (rand()%100-50)/100.0, 0.5+(rand()%300)/100.0};
+
+    double image[8];
+    bool visible = true;
+    for (int i=0; i<4; i++)
+    {
+      double X = model[2*i], Y = model[2*i+1];
+      double Z = R[6]*X + R[7]*Y + t[2];
+      if (Z < 0.1) visible = false;
+      image[2*i] = (R[0]*X + R[1]*Y + t[0])/Z;
+      image[2*i+1] = (R[3]*X + R[4]*Y + t[1])/Z;
+    }
+    if (!visible) continue;
+    tested++;
+
+    double rot[2][9], tra[2][3], error[2];
+    int n = PlanarPose::Solve(model, image, 4, rot, tra, error);
+    double best = 1e200;
+    for (int k=0; k<n; k++)
+    {
+      double diff = 0;
+      for (int i=0; i<9; i++) diff += fabs(rot[k][i] - R[i]);
+      for (int i=0; i<3; i++) diff += fabs(tra[k][i] - t[i]);
+      if (diff < best) best = diff;
+    }
+    if ((n == 0) || (best > 1e-6) || (error[0] > 1e-12))
+    {
+      printf("pose %d: %d solutions, difference %g\n", tested, n, best);
+      failures++;
+    }
+
+    // Refine from a perturbed pose as for a tracked marker
+    double dw[3] = {(rand()%100-50)/1000.0, (rand()%100-50)/1000.0, (rand()%100-50)/1000.0};
+    double dR[9], rot_w[9], tra_w[3];
+    rodrigues(dw, dR);
+    for (int i=0; i<3; i++)
+    {
+      for (int j=0; j<3; j++)
+        rot_w[3*i+j] = dR[3*i]*R[j] + dR[3*i+1]*R[3+j] + dR[3*i+2]*R[6+j];
+      tra_w[i] = t[i] + (rand()%100-50)/5000.0;
+    }
+    double e = PlanarPose::Refine(model, image, 4, rot_w, tra_w);
+    double diff = 0;
+    for (int i=0; i<9; i++) diff += fabs(rot_w[i] - R[i]);
+    for (int i=0; i<3; i++) diff += fabs(tra_w[i] - t[i]);
+    if ((diff > 1e-6) || (e > 1e-12))
+    {
+      printf("refine %d: difference %g\n", tested, diff);
+      failures++;
+    }
+  }
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
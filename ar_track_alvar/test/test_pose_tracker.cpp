@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file 
+ * 
+ * Test that PoseTracker follows a marker moving and rotating at a constant
+ * velocity, predicts it through missed frames and drops it after the timeout
+ */
+
+#include <ar_track_alvar/PoseTracker.h>
+#include <cstdio>
+#include <cmath>
+
+using alvar::PoseTracker;
+
+// The pose at the given time; the quaternion sign flips every other second
+void pose(double time, double t[3], double q[4])
+{
+  t[0] = 2.0*time; t[1] = -1.0*time; t[2] = 50.0 + 0.5*time;
+  double a = 0.8*time;
+  double s = (int(time) % 2) ? -1 : 1;
+  q[0] = s*cos(a/2); q[1] = s*0.6*sin(a/2); q[2] = 0; q[3] = s*0.8*sin(a/2);
+}
+
+double error(double time, const double t[3], const double q[4])
+{
+  double tt[3], tq[4];
+  pose(time, tt, tq);
+  double dot = fabs(q[0]*tq[0] + q[1]*tq[1] + q[2]*tq[2] + q[3]*tq[3]);
+  double e = 2*acos(dot > 1 ? 1 : dot);
+  for (int i=0; i<3; i++) e += fabs(t[i] - tt[i]);
+  return e;
+}
+
+int main(int argc, char *argv[])
+{
+  PoseTracker tracker(0.5, 1.0, 1.0, 0.1, 0.01);
+  int failures = 0;
+  double t[3], q[4];
+  for (int k=0; k<150; k++)
+  {
+    double time = 10.0 + k/30.0;
+    bool missed = (k >= 100 && k < 110);
+    if (!missed)
+    {
+      pose(time, t, q);
+      tracker.Update(3, time, t, q);
+    }
+    bool tracked = tracker.Get(3, time, t, q);
+    if (!tracked || (k > 60 && error(time, t, q) > 0.01))
+    {
+      printf("frame %d: %s\n", k, tracked ? "wrong pose" : "lost");
+      failures++;
+    }
+  }
+  if (tracker.Get(4, 15.0, t, q))
+  {
+    printf("unknown id tracked\n");
+    failures++;
+  }
+  std::vector<int> ids;
+  tracker.GetIds(16.0, ids);
+  if (tracker.Get(3, 16.0, t, q) || !ids.empty())
+  {
+    printf("not dropped after the timeout\n");
+    failures++;
+  }
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}